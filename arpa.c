@@ -53,37 +53,119 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stddef.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <string.h>
 
-void
-arpa_qname_ip4(const void *addr, char **res) {
-	char buf[32];
-	snprintf(buf, sizeof(buf), "%u.%u.%u.%u.in-addr.arpa.",
-		 (unsigned)((uint8_t *) addr)[3],
-		 (unsigned)((uint8_t *) addr)[2],
-		 (unsigned)((uint8_t *) addr)[1],
-		 (unsigned)((uint8_t *) addr)[0]
-	);
-	*res = strdup(buf);
+#include "nss-ubdns.h"
+
+/* decimal presentation of each octet, without a terminating NUL */
+static const struct {
+	char s[3];
+	uint8_t len;
+} octets[256] = {
+	{ "0", 1 }, { "1", 1 }, { "2", 1 }, { "3", 1 }, { "4", 1 }, { "5", 1 }, { "6", 1 }, { "7", 1 },
+	{ "8", 1 }, { "9", 1 }, { "10", 2 }, { "11", 2 }, { "12", 2 }, { "13", 2 }, { "14", 2 }, { "15", 2 },
+	{ "16", 2 }, { "17", 2 }, { "18", 2 }, { "19", 2 }, { "20", 2 }, { "21", 2 }, { "22", 2 }, { "23", 2 },
+	{ "24", 2 }, { "25", 2 }, { "26", 2 }, { "27", 2 }, { "28", 2 }, { "29", 2 }, { "30", 2 }, { "31", 2 },
+	{ "32", 2 }, { "33", 2 }, { "34", 2 }, { "35", 2 }, { "36", 2 }, { "37", 2 }, { "38", 2 }, { "39", 2 },
+	{ "40", 2 }, { "41", 2 }, { "42", 2 }, { "43", 2 }, { "44", 2 }, { "45", 2 }, { "46", 2 }, { "47", 2 },
+	{ "48", 2 }, { "49", 2 }, { "50", 2 }, { "51", 2 }, { "52", 2 }, { "53", 2 }, { "54", 2 }, { "55", 2 },
+	{ "56", 2 }, { "57", 2 }, { "58", 2 }, { "59", 2 }, { "60", 2 }, { "61", 2 }, { "62", 2 }, { "63", 2 },
+	{ "64", 2 }, { "65", 2 }, { "66", 2 }, { "67", 2 }, { "68", 2 }, { "69", 2 }, { "70", 2 }, { "71", 2 },
+	{ "72", 2 }, { "73", 2 }, { "74", 2 }, { "75", 2 }, { "76", 2 }, { "77", 2 }, { "78", 2 }, { "79", 2 },
+	{ "80", 2 }, { "81", 2 }, { "82", 2 }, { "83", 2 }, { "84", 2 }, { "85", 2 }, { "86", 2 }, { "87", 2 },
+	{ "88", 2 }, { "89", 2 }, { "90", 2 }, { "91", 2 }, { "92", 2 }, { "93", 2 }, { "94", 2 }, { "95", 2 },
+	{ "96", 2 }, { "97", 2 }, { "98", 2 }, { "99", 2 }, { "100", 3 }, { "101", 3 }, { "102", 3 }, { "103", 3 },
+	{ "104", 3 }, { "105", 3 }, { "106", 3 }, { "107", 3 }, { "108", 3 }, { "109", 3 }, { "110", 3 }, { "111", 3 },
+	{ "112", 3 }, { "113", 3 }, { "114", 3 }, { "115", 3 }, { "116", 3 }, { "117", 3 }, { "118", 3 }, { "119", 3 },
+	{ "120", 3 }, { "121", 3 }, { "122", 3 }, { "123", 3 }, { "124", 3 }, { "125", 3 }, { "126", 3 }, { "127", 3 },
+	{ "128", 3 }, { "129", 3 }, { "130", 3 }, { "131", 3 }, { "132", 3 }, { "133", 3 }, { "134", 3 }, { "135", 3 },
+	{ "136", 3 }, { "137", 3 }, { "138", 3 }, { "139", 3 }, { "140", 3 }, { "141", 3 }, { "142", 3 }, { "143", 3 },
+	{ "144", 3 }, { "145", 3 }, { "146", 3 }, { "147", 3 }, { "148", 3 }, { "149", 3 }, { "150", 3 }, { "151", 3 },
+	{ "152", 3 }, { "153", 3 }, { "154", 3 }, { "155", 3 }, { "156", 3 }, { "157", 3 }, { "158", 3 }, { "159", 3 },
+	{ "160", 3 }, { "161", 3 }, { "162", 3 }, { "163", 3 }, { "164", 3 }, { "165", 3 }, { "166", 3 }, { "167", 3 },
+	{ "168", 3 }, { "169", 3 }, { "170", 3 }, { "171", 3 }, { "172", 3 }, { "173", 3 }, { "174", 3 }, { "175", 3 },
+	{ "176", 3 }, { "177", 3 }, { "178", 3 }, { "179", 3 }, { "180", 3 }, { "181", 3 }, { "182", 3 }, { "183", 3 },
+	{ "184", 3 }, { "185", 3 }, { "186", 3 }, { "187", 3 }, { "188", 3 }, { "189", 3 }, { "190", 3 }, { "191", 3 },
+	{ "192", 3 }, { "193", 3 }, { "194", 3 }, { "195", 3 }, { "196", 3 }, { "197", 3 }, { "198", 3 }, { "199", 3 },
+	{ "200", 3 }, { "201", 3 }, { "202", 3 }, { "203", 3 }, { "204", 3 }, { "205", 3 }, { "206", 3 }, { "207", 3 },
+	{ "208", 3 }, { "209", 3 }, { "210", 3 }, { "211", 3 }, { "212", 3 }, { "213", 3 }, { "214", 3 }, { "215", 3 },
+	{ "216", 3 }, { "217", 3 }, { "218", 3 }, { "219", 3 }, { "220", 3 }, { "221", 3 }, { "222", 3 }, { "223", 3 },
+	{ "224", 3 }, { "225", 3 }, { "226", 3 }, { "227", 3 }, { "228", 3 }, { "229", 3 }, { "230", 3 }, { "231", 3 },
+	{ "232", 3 }, { "233", 3 }, { "234", 3 }, { "235", 3 }, { "236", 3 }, { "237", 3 }, { "238", 3 }, { "239", 3 },
+	{ "240", 3 }, { "241", 3 }, { "242", 3 }, { "243", 3 }, { "244", 3 }, { "245", 3 }, { "246", 3 }, { "247", 3 },
+	{ "248", 3 }, { "249", 3 }, { "250", 3 }, { "251", 3 }, { "252", 3 }, { "253", 3 }, { "254", 3 }, { "255", 3 },
+};
+
+/* the two nibble labels of each octet, low nibble first */
+static const char nibbles[256][4] = {
+	"0.0.", "1.0.", "2.0.", "3.0.", "4.0.", "5.0.", "6.0.", "7.0.",
+	"8.0.", "9.0.", "a.0.", "b.0.", "c.0.", "d.0.", "e.0.", "f.0.",
+	"0.1.", "1.1.", "2.1.", "3.1.", "4.1.", "5.1.", "6.1.", "7.1.",
+	"8.1.", "9.1.", "a.1.", "b.1.", "c.1.", "d.1.", "e.1.", "f.1.",
+	"0.2.", "1.2.", "2.2.", "3.2.", "4.2.", "5.2.", "6.2.", "7.2.",
+	"8.2.", "9.2.", "a.2.", "b.2.", "c.2.", "d.2.", "e.2.", "f.2.",
+	"0.3.", "1.3.", "2.3.", "3.3.", "4.3.", "5.3.", "6.3.", "7.3.",
+	"8.3.", "9.3.", "a.3.", "b.3.", "c.3.", "d.3.", "e.3.", "f.3.",
+	"0.4.", "1.4.", "2.4.", "3.4.", "4.4.", "5.4.", "6.4.", "7.4.",
+	"8.4.", "9.4.", "a.4.", "b.4.", "c.4.", "d.4.", "e.4.", "f.4.",
+	"0.5.", "1.5.", "2.5.", "3.5.", "4.5.", "5.5.", "6.5.", "7.5.",
+	"8.5.", "9.5.", "a.5.", "b.5.", "c.5.", "d.5.", "e.5.", "f.5.",
+	"0.6.", "1.6.", "2.6.", "3.6.", "4.6.", "5.6.", "6.6.", "7.6.",
+	"8.6.", "9.6.", "a.6.", "b.6.", "c.6.", "d.6.", "e.6.", "f.6.",
+	"0.7.", "1.7.", "2.7.", "3.7.", "4.7.", "5.7.", "6.7.", "7.7.",
+	"8.7.", "9.7.", "a.7.", "b.7.", "c.7.", "d.7.", "e.7.", "f.7.",
+	"0.8.", "1.8.", "2.8.", "3.8.", "4.8.", "5.8.", "6.8.", "7.8.",
+	"8.8.", "9.8.", "a.8.", "b.8.", "c.8.", "d.8.", "e.8.", "f.8.",
+	"0.9.", "1.9.", "2.9.", "3.9.", "4.9.", "5.9.", "6.9.", "7.9.",
+	"8.9.", "9.9.", "a.9.", "b.9.", "c.9.", "d.9.", "e.9.", "f.9.",
+	"0.a.", "1.a.", "2.a.", "3.a.", "4.a.", "5.a.", "6.a.", "7.a.",
+	"8.a.", "9.a.", "a.a.", "b.a.", "c.a.", "d.a.", "e.a.", "f.a.",
+	"0.b.", "1.b.", "2.b.", "3.b.", "4.b.", "5.b.", "6.b.", "7.b.",
+	"8.b.", "9.b.", "a.b.", "b.b.", "c.b.", "d.b.", "e.b.", "f.b.",
+	"0.c.", "1.c.", "2.c.", "3.c.", "4.c.", "5.c.", "6.c.", "7.c.",
+	"8.c.", "9.c.", "a.c.", "b.c.", "c.c.", "d.c.", "e.c.", "f.c.",
+	"0.d.", "1.d.", "2.d.", "3.d.", "4.d.", "5.d.", "6.d.", "7.d.",
+	"8.d.", "9.d.", "a.d.", "b.d.", "c.d.", "d.d.", "e.d.", "f.d.",
+	"0.e.", "1.e.", "2.e.", "3.e.", "4.e.", "5.e.", "6.e.", "7.e.",
+	"8.e.", "9.e.", "a.e.", "b.e.", "c.e.", "d.e.", "e.e.", "f.e.",
+	"0.f.", "1.f.", "2.f.", "3.f.", "4.f.", "5.f.", "6.f.", "7.f.",
+	"8.f.", "9.f.", "a.f.", "b.f.", "c.f.", "d.f.", "e.f.", "f.f.",
+};
+
+/*
+ * Write the in-addr.arpa / ip6.arpa name of an address to dst, which must
+ * have room for NSS_UBDNS_ARPA_QNAME_MAX bytes. Returns the length of the
+ * name, not counting the terminating NUL.
+ */
+size_t
+arpa_qname_ip4(const void *addr, char *dst) {
+	static const char suffix[] = "in-addr.arpa.";
+	const uint8_t *a = addr;
+	char *p = dst;
+	int i;
+
+	for (i = 3; i >= 0; i--) {
+		memcpy(p, octets[a[i]].s, sizeof(octets[0].s));
+		p += octets[a[i]].len;
+		*p++ = '.';
+	}
+	memcpy(p, suffix, sizeof(suffix));
+	return (p - dst + sizeof(suffix) - 1);
 }
 
-void
-arpa_qname_ip6(const void *addr, char **res) {
-	const char *hex = "0123456789abcdef";
-	char buf[128];
-	char *p;
+size_t
+arpa_qname_ip6(const void *addr, char *dst) {
+	static const char suffix[] = "ip6.arpa.";
+	const uint8_t *a = addr;
+	char *p = dst;
 	int i;
 
-	p = buf;
 	for (i = 15; i >= 0; i--) {
-		uint8_t b = ((uint8_t *) addr)[i];
-		*p++ = hex[ (b & 0x0f) ];
-		*p++ = '.';
-		*p++ = hex[ (b & 0xf0) >> 4 ];
-		*p++ = '.';
+		memcpy(p, nibbles[a[i]], sizeof(nibbles[0]));
+		p += sizeof(nibbles[0]);
 	}
-	snprintf(buf + 16*4, sizeof(buf) - 16*4, "ip6.arpa.");
-	*res = strdup(buf);
+	memcpy(p, suffix, sizeof(suffix));
+	return (p - dst + sizeof(suffix) - 1);
 }
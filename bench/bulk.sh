@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Measure the throughput of ubdns-bulk on cold names for each of a series of
+# window sizes, printing one line of JSON per run.
+#
+#     $ make ubdns-bulk responder
+#     $ sh bench/bulk.sh
+#
+# As with scenarios.sh, the names are in a signed test zone served by
+# nss-ubdns-responder, and every answer is validated. Each run looks up
+# names no other run has, so nothing is answered from a cache. Set WINDOWS
+# to the window sizes to try, NAMES to the number of names each run looks
+# up, DELAY to the responder's delay in milliseconds and PORT to its port.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+WINDOWS=${WINDOWS:-"1 16 64 256 1024"}
+NAMES=${NAMES:-5000}
+DELAY=${DELAY:-10}
+PORT=${PORT:-5353}
+ZONE=signed.test
+
+confdir=$(mktemp -d)
+responder_pid=
+trap 'test -z "$responder_pid" || kill $responder_pid 2>/dev/null; rm -rf "$confdir"' EXIT
+
+mkdir "$confdir/keys"
+cat > "$confdir/libunbound.conf" <<CONF
+server:
+    do-not-query-localhost: no
+    local-zone: "test." nodefault
+forward-zone:
+    name: "$ZONE."
+    forward-addr: 127.0.0.1@$PORT
+CONF
+
+./bench/nss-ubdns-responder -p "$PORT" -z "$ZONE" -k "$confdir/keys/$ZONE.key" \
+    -d "$DELAY" &
+responder_pid=$!
+while [ ! -s "$confdir/keys/$ZONE.key" ]; do
+    kill -0 $responder_pid
+    sleep 0.1
+done
+
+for window in $WINDOWS; do
+    seq 1 "$NAMES" | sed "s/.*/w$window-&.$ZONE/" > "$confdir/names"
+    start=$(date +%s.%N)
+    NSS_UBDNS_CONFDIR=$confdir LD_LIBRARY_PATH=.${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH} \
+        ./ubdns-bulk -w "$window" < "$confdir/names" > "$confdir/out"
+    end=$(date +%s.%N)
+    found=$(grep -vc '	!' "$confdir/out" || true)
+    echo "$start $end" | awk -v w="$window" -v n="$NAMES" -v f="$found" -v d="$DELAY" '{
+        s = $2 - $1
+        printf "{\"window\": %d, \"names\": %d, \"found\": %d, \"delay_ms\": %d, \"seconds\": %.3f, \"qps\": %.0f}\n", w, n, f, d, s, n / s
+    }'
+done
@@ -0,0 +1,866 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * nss-ubdns-responder - fault-injecting authoritative server for testing
+ *
+ * Serves one DNSSEC-signed zone over UDP and TCP on a local address, for use
+ * as the upstream of the module in tests and benchmarks. Every name in the
+ * zone has an A and an AAAA record, and every other type is answered with a
+ * signed NODATA response, so lookups of freshly generated names always miss
+ * the resolver's cache. A name whose first label is "alias" is instead a
+ * CNAME for the rest of the name, so "alias.alias.www.ZONE" exercises a chain
+ * of two. Records are signed on the fly with an ECDSA P-256 key
+ * generated at startup, whose DNSKEY is written out as a trust anchor.
+ *
+ * Responses can be delayed, dropped, turned into SERVFAILs, truncated to force
+ * a retry over TCP, or given a corrupt signature, each for a percentage of the
+ * queries.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/core_names.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+
+#define TYPE_A		1
+#define TYPE_NS		2
+#define TYPE_CNAME	5
+#define TYPE_SOA	6
+#define TYPE_AAAA	28
+#define TYPE_OPT	41
+#define TYPE_DS		43
+#define TYPE_RRSIG	46
+#define TYPE_NSEC	47
+#define TYPE_DNSKEY	48
+
+#define RCODE_SERVFAIL	2
+#define RCODE_REFUSED	5
+
+#define ALG_ECDSAP256SHA256	13
+
+#define MAX_MSG		4096
+#define MAX_CLIENTS	64
+
+struct fault {
+	unsigned delay_ms;
+	unsigned jitter_ms;
+	unsigned delay_pct;
+	unsigned loss_pct;
+	unsigned servfail_pct;
+	unsigned truncate_pct;
+	unsigned bogus_pct;
+};
+
+/* a response waiting out its injected delay */
+struct pending {
+	uint64_t due;
+	int fd;
+	bool tcp;
+	struct sockaddr_storage sa;
+	socklen_t sa_len;
+	size_t len;
+	uint8_t msg[MAX_MSG];
+};
+
+struct tcp_client {
+	int fd;
+	size_t rlen;
+	uint8_t rbuf[2 + MAX_MSG];
+};
+
+struct query {
+	uint16_t id;
+	uint16_t flags;
+	uint8_t qname[256];	/* as received */
+	uint8_t lname[256];	/* lowercased */
+	size_t qname_len;
+	unsigned labels;
+	uint16_t qtype;
+	uint16_t qclass;
+	bool edns;
+	bool dnssec_ok;
+	uint16_t udp_size;
+};
+
+static struct fault fault;
+static uint32_t ttl = 60;
+static uint8_t zone[256];
+static size_t zone_len;
+static unsigned zone_labels;
+static EVP_PKEY *key;
+static uint8_t dnskey_rdata[4 + 64];
+static uint16_t key_tag;
+
+static struct pending **pending;
+static size_t n_pending;
+static struct tcp_client clients[MAX_CLIENTS];
+
+static volatile sig_atomic_t stop;
+
+static void
+on_signal(int sig) {
+	stop = 1;
+}
+
+static uint64_t
+now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static bool
+chance(unsigned pct) {
+	return (pct > 0 && (unsigned) (random() % 100) < pct);
+}
+
+/* Convert a presentation name to lowercase wire format. */
+static size_t
+name_from_str(const char *s, uint8_t *wire, unsigned *labels) {
+	size_t len = 0;
+	const char *dot;
+
+	*labels = 0;
+	while (*s != '\0') {
+		size_t l;
+
+		dot = strchr(s, '.');
+		l = dot != NULL ? (size_t) (dot - s) : strlen(s);
+		if (l == 0 || l > 63 || len + l + 2 > 255)
+			return (0);
+		wire[len++] = l;
+		for (size_t i = 0; i < l; i++)
+			wire[len++] = (s[i] >= 'A' && s[i] <= 'Z') ? s[i] + 32 : s[i];
+		(*labels)++;
+		s += l;
+		if (*s == '.')
+			s++;
+	}
+	wire[len++] = 0;
+	return (len);
+}
+
+static void
+put16(uint8_t *p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void
+put32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint16_t
+get16(const uint8_t *p) {
+	return ((p[0] << 8) | p[1]);
+}
+
+/* Key tag of a DNSKEY, RFC 4034 appendix B. */
+static uint16_t
+dnskey_tag(const uint8_t *rdata, size_t len) {
+	uint32_t ac = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		ac += (i & 1) ? rdata[i] : (uint32_t) rdata[i] << 8;
+	ac += (ac >> 16) & 0xffff;
+	return (ac & 0xffff);
+}
+
+static bool
+key_init(void) {
+	uint8_t pub[65];
+	size_t pub_len;
+
+	key = EVP_EC_gen("P-256");
+	if (key == NULL)
+		return (false);
+	if (!EVP_PKEY_get_octet_string_param(key, OSSL_PKEY_PARAM_PUB_KEY,
+					     pub, sizeof(pub), &pub_len) ||
+	    pub_len != sizeof(pub))
+		return (false);
+
+	put16(dnskey_rdata, 257);		/* zone key, secure entry point */
+	dnskey_rdata[2] = 3;
+	dnskey_rdata[3] = ALG_ECDSAP256SHA256;
+	memcpy(dnskey_rdata + 4, pub + 1, 64);	/* without the 0x04 prefix */
+	key_tag = dnskey_tag(dnskey_rdata, sizeof(dnskey_rdata));
+	return (true);
+}
+
+static void
+base64(const uint8_t *src, size_t len, char *dst) {
+	EVP_EncodeBlock((unsigned char *) dst, src, len);
+}
+
+static bool
+write_trust_anchor(const char *path, const char *zone_str) {
+	char b64[128];
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (fp == NULL)
+		return (false);
+	base64(dnskey_rdata + 4, 64, b64);
+	fprintf(fp, "%s%s IN DNSKEY 257 3 %u %s\n", zone_str,
+		zone_str[strlen(zone_str) - 1] == '.' ? "" : ".",
+		ALG_ECDSAP256SHA256, b64);
+	return (fclose(fp) == 0);
+}
+
+/*
+ * Sign an RRset of one record, RFC 4034 section 3.1.8.1, and return the
+ * RRSIG rdata in out.
+ */
+static size_t
+sign_rrset(const uint8_t *owner, size_t owner_len, unsigned labels, uint16_t type,
+	   const uint8_t *rdata, size_t rdlen, bool bogus, uint8_t *out)
+{
+	uint8_t data[18 + 256 + 256 + 10 + MAX_MSG];
+	uint8_t der[80], *p;
+	const unsigned char *dp = der;
+	const BIGNUM *r, *s;
+	ECDSA_SIG *sig;
+	EVP_MD_CTX *md;
+	size_t len = 0, der_len = sizeof(der), prefix_len;
+	time_t now = time(NULL);
+
+	put16(data, type);
+	data[2] = ALG_ECDSAP256SHA256;
+	data[3] = labels;
+	put32(data + 4, ttl);
+	put32(data + 8, now + 86400);
+	put32(data + 12, now - 3600);
+	put16(data + 16, key_tag);
+	memcpy(data + 18, zone, zone_len);
+	prefix_len = 18 + zone_len;
+	len = prefix_len;
+
+	memcpy(data + len, owner, owner_len);
+	len += owner_len;
+	put16(data + len, type);
+	put16(data + len + 2, 1);
+	put32(data + len + 4, ttl);
+	put16(data + len + 8, rdlen);
+	len += 10;
+	memcpy(data + len, rdata, rdlen);
+	len += rdlen;
+
+	md = EVP_MD_CTX_new();
+	if (md == NULL ||
+	    EVP_DigestSignInit(md, NULL, EVP_sha256(), NULL, key) != 1 ||
+	    EVP_DigestSign(md, der, &der_len, data, len) != 1)
+	{
+		EVP_MD_CTX_free(md);
+		return (0);
+	}
+	EVP_MD_CTX_free(md);
+
+	/* DNSSEC wants the raw r and s values rather than DER */
+	sig = d2i_ECDSA_SIG(NULL, &dp, der_len);
+	if (sig == NULL)
+		return (0);
+	ECDSA_SIG_get0(sig, &r, &s);
+	memcpy(out, data, prefix_len);
+	p = out + prefix_len;
+	BN_bn2binpad(r, p, 32);
+	BN_bn2binpad(s, p + 32, 32);
+	ECDSA_SIG_free(sig);
+
+	if (bogus)
+		p[random() % 64] ^= 0x01;
+	return (prefix_len + 64);
+}
+
+struct response {
+	uint8_t *msg;
+	size_t len;
+	size_t max;
+	bool bogus;
+};
+
+/*
+ * Append a record. An owner of NULL stands for the query name, which is
+ * compressed to a pointer to the question.
+ */
+static bool
+put_rr(struct response *r, const uint8_t *owner, size_t owner_len, uint16_t type,
+       const uint8_t *rdata, size_t rdlen)
+{
+	size_t need = (owner != NULL ? owner_len : 2) + 10 + rdlen;
+
+	if (r->len + need > r->max)
+		return (false);
+	if (owner != NULL) {
+		memcpy(r->msg + r->len, owner, owner_len);
+		r->len += owner_len;
+	} else {
+		put16(r->msg + r->len, 0xc000 | 12);
+		r->len += 2;
+	}
+	put16(r->msg + r->len, type);
+	put16(r->msg + r->len + 2, 1);
+	put32(r->msg + r->len + 4, ttl);
+	put16(r->msg + r->len + 8, rdlen);
+	memcpy(r->msg + r->len + 10, rdata, rdlen);
+	r->len += 10 + rdlen;
+	return (true);
+}
+
+/*
+ * Append a record and, if the client asked for DNSSEC records, its RRSIG.
+ * An owner of the query name itself is compressed.
+ */
+static bool
+put_rrset(struct response *r, const struct query *q, const uint8_t *owner, size_t owner_len,
+	  unsigned labels, uint16_t type, const uint8_t *rdata, size_t rdlen, unsigned *count)
+{
+	const uint8_t *name = owner == q->lname ? NULL : owner;
+	uint8_t rrsig[18 + 256 + 64];
+	size_t rrsig_len;
+
+	if (!put_rr(r, name, owner_len, type, rdata, rdlen))
+		return (false);
+	(*count)++;
+	if (!q->dnssec_ok)
+		return (true);
+
+	rrsig_len = sign_rrset(owner, owner_len, labels, type, rdata, rdlen, r->bogus, rrsig);
+	if (rrsig_len == 0 ||
+	    !put_rr(r, name, owner_len, TYPE_RRSIG, rrsig, rrsig_len))
+		return (false);
+	(*count)++;
+	return (true);
+}
+
+static size_t
+soa_rdata(uint8_t *rdata) {
+	size_t len = 0;
+
+	/* ns.ZONE hostmaster.ZONE 1 3600 600 86400 TTL */
+	rdata[len++] = 2;
+	memcpy(rdata + len, "ns", 2);
+	len += 2;
+	memcpy(rdata + len, zone, zone_len);
+	len += zone_len;
+	rdata[len++] = 10;
+	memcpy(rdata + len, "hostmaster", 10);
+	len += 10;
+	memcpy(rdata + len, zone, zone_len);
+	len += zone_len;
+	put32(rdata + len, 1);
+	put32(rdata + len + 4, 3600);
+	put32(rdata + len + 8, 600);
+	put32(rdata + len + 12, 86400);
+	put32(rdata + len + 16, ttl);
+	return (len + 20);
+}
+
+static bool
+in_zone(const struct query *q) {
+	size_t i = 0;
+
+	if (q->qname_len < zone_len)
+		return (false);
+	/* walk the labels until the remaining suffix is as long as the zone */
+	while (q->qname_len - i > zone_len)
+		i += q->lname[i] + 1;
+	return (q->qname_len - i == zone_len &&
+		memcmp(q->lname + i, zone, zone_len) == 0);
+}
+
+static bool
+parse_query(const uint8_t *msg, size_t len, struct query *q) {
+	size_t off = 12, i;
+	uint16_t arcount;
+
+	if (len < 12 || (msg[2] & 0x80) || get16(msg + 4) != 1)
+		return (false);
+	q->id = get16(msg);
+	q->flags = get16(msg + 2);
+
+	q->labels = 0;
+	q->qname_len = 0;
+	for (;;) {
+		uint8_t l;
+
+		if (off >= len)
+			return (false);
+		l = msg[off];
+		if (l > 63 || off + 1 + l > len || q->qname_len + 1 + l > 255)
+			return (false);
+		memcpy(q->qname + q->qname_len, msg + off, 1 + l);
+		q->qname_len += 1 + l;
+		off += 1 + l;
+		if (l == 0)
+			break;
+		q->labels++;
+	}
+	for (i = 0; i < q->qname_len; i++) {
+		uint8_t c = q->qname[i];
+		q->lname[i] = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+	}
+	if (off + 4 > len)
+		return (false);
+	q->qtype = get16(msg + off);
+	q->qclass = get16(msg + off + 2);
+	off += 4;
+
+	q->edns = false;
+	q->dnssec_ok = false;
+	q->udp_size = 512;
+	arcount = get16(msg + 10);
+	if (arcount == 1 && get16(msg + 6) == 0 && get16(msg + 8) == 0 &&
+	    off + 11 <= len && msg[off] == 0 && get16(msg + off + 1) == TYPE_OPT)
+	{
+		q->edns = true;
+		q->udp_size = get16(msg + off + 3);
+		if (q->udp_size < 512)
+			q->udp_size = 512;
+		q->dnssec_ok = (msg[off + 7] & 0x80) != 0;
+	}
+	return (true);
+}
+
+/*
+ * Build the response to a query. Returns its length, or 0 if the query is to
+ * be dropped.
+ */
+static size_t
+respond(const uint8_t *qmsg, size_t qlen, bool tcp, uint8_t *msg) {
+	struct response r = { .msg = msg, .max = MAX_MSG - 11 };
+	struct query q;
+	uint8_t rdata[512];
+	size_t rdlen;
+	unsigned an = 0, ns = 0;
+	uint16_t flags;
+	int rcode = 0;
+	bool truncate = false;
+
+	if (!parse_query(qmsg, qlen, &q))
+		return (0);
+	if (chance(fault.loss_pct))
+		return (0);
+
+	/* header and question */
+	memcpy(msg, qmsg, 12 + q.qname_len + 4);
+	r.len = 12 + q.qname_len + 4;
+	r.bogus = chance(fault.bogus_pct);
+
+	if (q.qclass != 1 || !in_zone(&q)) {
+		rcode = RCODE_REFUSED;
+	} else if (chance(fault.servfail_pct)) {
+		rcode = RCODE_SERVFAIL;
+	} else if (!tcp && chance(fault.truncate_pct)) {
+		truncate = true;
+	} else {
+		const uint8_t *owner = q.lname;
+		size_t owner_len = q.qname_len;
+		unsigned labels = q.labels, n_cname = 0;
+		bool apex;
+
+		/* follow the CNAME chain, answering with each link */
+		while (owner_len - 6 > zone_len && memcmp(owner, "\005alias", 6) == 0) {
+			put_rrset(&r, &q, owner, owner_len, labels, TYPE_CNAME,
+				  owner + 6, owner_len - 6, &an);
+			owner += 6;
+			owner_len -= 6;
+			labels--;
+		}
+		n_cname = an;
+		apex = owner_len == zone_len;
+
+		switch (q.qtype) {
+		case TYPE_A:
+			put32(rdata, 0xc0000201);	/* 192.0.2.1 */
+			put_rrset(&r, &q, owner, owner_len, labels, TYPE_A, rdata, 4, &an);
+			break;
+		case TYPE_AAAA:
+			memset(rdata, 0, 16);
+			put32(rdata, 0x20010db8);	/* 2001:db8::1 */
+			rdata[15] = 1;
+			put_rrset(&r, &q, owner, owner_len, labels, TYPE_AAAA, rdata, 16, &an);
+			break;
+		case TYPE_DNSKEY:
+			if (apex)
+				put_rrset(&r, &q, owner, owner_len, labels, TYPE_DNSKEY,
+					  dnskey_rdata, sizeof(dnskey_rdata), &an);
+			break;
+		case TYPE_SOA:
+			if (apex)
+				put_rrset(&r, &q, owner, owner_len, labels, TYPE_SOA,
+					  rdata, soa_rdata(rdata), &an);
+			break;
+		case TYPE_NS:
+			if (apex) {
+				rdata[0] = 2;
+				memcpy(rdata + 1, "ns", 2);
+				memcpy(rdata + 3, zone, zone_len);
+				put_rrset(&r, &q, owner, owner_len, labels, TYPE_NS,
+					  rdata, 3 + zone_len, &an);
+			}
+			break;
+		}
+
+		if (an == n_cname) {
+			/* NODATA, proven by an NSEC record covering only the name */
+			put_rrset(&r, &q, zone, zone_len, zone_labels, TYPE_SOA,
+				  rdata, soa_rdata(rdata), &ns);
+			if (q.dnssec_ok && owner_len + 2 <= 255) {
+				rdata[0] = 1;
+				rdata[1] = 0;
+				memcpy(rdata + 2, owner, owner_len);
+				rdlen = 2 + owner_len;
+				rdata[rdlen++] = 0;	/* window 0 */
+				rdata[rdlen++] = 7;
+				memset(rdata + rdlen, 0, 7);
+				rdata[rdlen + TYPE_A / 8] |= 0x80 >> (TYPE_A % 8);
+				rdata[rdlen + TYPE_AAAA / 8] |= 0x80 >> (TYPE_AAAA % 8);
+				rdata[rdlen + TYPE_RRSIG / 8] |= 0x80 >> (TYPE_RRSIG % 8);
+				rdata[rdlen + TYPE_NSEC / 8] |= 0x80 >> (TYPE_NSEC % 8);
+				if (apex) {
+					rdata[rdlen + TYPE_NS / 8] |= 0x80 >> (TYPE_NS % 8);
+					rdata[rdlen + TYPE_SOA / 8] |= 0x80 >> (TYPE_SOA % 8);
+					rdata[rdlen + TYPE_DNSKEY / 8] |= 0x80 >> (TYPE_DNSKEY % 8);
+				}
+				rdlen += 7;
+				put_rrset(&r, &q, owner, owner_len, labels, TYPE_NSEC,
+					  rdata, rdlen, &ns);
+			}
+		}
+	}
+
+	if (!tcp && r.len + (q.edns ? 11 : 0) > q.udp_size)
+		truncate = true;
+	if (truncate) {
+		r.len = 12 + q.qname_len + 4;
+		an = ns = 0;
+	}
+
+	flags = 0x8000 | 0x0400 | (q.flags & 0x0100) | 0x0080 | rcode;	/* QR AA RD RA */
+	if (truncate)
+		flags |= 0x0200;
+	put16(msg + 2, flags);
+	put16(msg + 6, an);
+	put16(msg + 8, ns);
+	put16(msg + 10, q.edns ? 1 : 0);
+
+	if (q.edns) {
+		uint8_t *p = msg + r.len;
+
+		p[0] = 0;
+		put16(p + 1, TYPE_OPT);
+		put16(p + 3, 1232);
+		put32(p + 5, q.dnssec_ok ? 0x8000 : 0);
+		put16(p + 9, 0);
+		r.len += 11;
+	}
+	return (r.len);
+}
+
+static void
+send_response(struct pending *pr) {
+	if (pr->tcp) {
+		uint8_t len[2];
+		struct iovec iov[2];
+		struct msghdr mh = { .msg_iov = iov, .msg_iovlen = 2 };
+
+		put16(len, pr->len);
+		iov[0].iov_base = len;
+		iov[0].iov_len = 2;
+		iov[1].iov_base = pr->msg;
+		iov[1].iov_len = pr->len;
+		(void) sendmsg(pr->fd, &mh, MSG_NOSIGNAL);
+	} else {
+		(void) sendto(pr->fd, pr->msg, pr->len, 0,
+			      (struct sockaddr *) &pr->sa, pr->sa_len);
+	}
+}
+
+static void
+handle(int fd, bool tcp, const uint8_t *qmsg, size_t qlen,
+       const struct sockaddr_storage *sa, socklen_t sa_len)
+{
+	struct pending *pr;
+	unsigned delay = 0;
+
+	pr = malloc(sizeof(*pr));
+	if (pr == NULL)
+		return;
+	pr->len = respond(qmsg, qlen, tcp, pr->msg);
+	if (pr->len == 0) {
+		free(pr);
+		return;
+	}
+	pr->fd = fd;
+	pr->tcp = tcp;
+	if (sa != NULL)
+		memcpy(&pr->sa, sa, sa_len);
+	pr->sa_len = sa_len;
+
+	if (chance(fault.delay_pct))
+		delay = fault.delay_ms + (fault.jitter_ms > 0 ? random() % (fault.jitter_ms + 1) : 0);
+	if (delay == 0) {
+		send_response(pr);
+		free(pr);
+		return;
+	}
+	pr->due = now_ms() + delay;
+
+	pending = realloc(pending, (n_pending + 1) * sizeof(*pending));
+	if (pending == NULL)
+		exit(EXIT_FAILURE);
+	pending[n_pending++] = pr;
+}
+
+/* Send the delayed responses that are due, returning the poll timeout. */
+static int
+flush_pending(void) {
+	uint64_t now = now_ms(), next = UINT64_MAX;
+	size_t i = 0;
+
+	while (i < n_pending) {
+		if (pending[i]->due <= now) {
+			send_response(pending[i]);
+			free(pending[i]);
+			pending[i] = pending[--n_pending];
+			continue;
+		}
+		if (pending[i]->due < next)
+			next = pending[i]->due;
+		i++;
+	}
+	return (next == UINT64_MAX ? -1 : (int) (next - now));
+}
+
+static void
+tcp_close(struct tcp_client *c) {
+	size_t i;
+
+	/* a delayed response must not go to whoever reuses the descriptor */
+	for (i = 0; i < n_pending; i++)
+		if (pending[i]->tcp && pending[i]->fd == c->fd)
+			pending[i]->fd = -1;
+	close(c->fd);
+	c->fd = -1;
+}
+
+static void
+tcp_read(struct tcp_client *c) {
+	ssize_t r;
+	size_t len;
+
+	r = read(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+	if (r <= 0) {
+		if (r < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		tcp_close(c);
+		return;
+	}
+	c->rlen += r;
+
+	while (c->rlen >= 2 && c->rlen >= 2 + (len = get16(c->rbuf))) {
+		handle(c->fd, true, c->rbuf + 2, len, NULL, 0);
+		memmove(c->rbuf, c->rbuf + 2 + len, c->rlen - 2 - len);
+		c->rlen -= 2 + len;
+	}
+	if (c->rlen == sizeof(c->rbuf))
+		tcp_close(c);
+}
+
+static void
+usage(void) {
+	fprintf(stderr,
+		"Usage: nss-ubdns-responder -z ZONE -k KEYFILE [-a ADDRESS] [-p PORT] [-T TTL]\n"
+		"                           [-d MS [-j MS] [-D PERCENT]] [-l PERCENT]\n"
+		"                           [-s PERCENT] [-t PERCENT] [-b PERCENT] [-S SEED]\n"
+		"\n"
+		"Serves ZONE, signed with a new key whose DNSKEY is written to KEYFILE\n"
+		"as a trust anchor, on ADDRESS (default 127.0.0.1) and PORT (default\n"
+		"5353), with records of TTL seconds (default 60).\n"
+		"\n"
+		"  -d MS        delay responses by MS milliseconds\n"
+		"  -j MS        plus a random delay of up to MS milliseconds\n"
+		"  -D PERCENT   delay only this share of the responses (default 100)\n"
+		"  -l PERCENT   drop queries without responding\n"
+		"  -s PERCENT   answer SERVFAIL\n"
+		"  -t PERCENT   truncate UDP responses, forcing a retry over TCP\n"
+		"  -b PERCENT   corrupt the signatures in the response\n");
+	exit(EXIT_FAILURE);
+}
+
+static unsigned
+percent(const char *s) {
+	unsigned long v = strtoul(s, NULL, 10);
+
+	if (v > 100)
+		usage();
+	return (v);
+}
+
+int
+main(int argc, char **argv) {
+	const char *address = "127.0.0.1", *zone_str = NULL, *key_path = NULL;
+	unsigned port = 5353, seed = time(NULL);
+	struct sockaddr_in sin;
+	struct pollfd pfd[2 + MAX_CLIENTS];
+	struct sigaction sa;
+	int udp_fd, tcp_fd, one = 1;
+	int opt, i;
+
+	fault.delay_pct = 100;
+	while ((opt = getopt(argc, argv, "a:b:d:j:k:l:p:s:t:z:D:S:T:")) != -1) {
+		switch (opt) {
+		case 'a': address = optarg; break;
+		case 'b': fault.bogus_pct = percent(optarg); break;
+		case 'd': fault.delay_ms = strtoul(optarg, NULL, 10); break;
+		case 'j': fault.jitter_ms = strtoul(optarg, NULL, 10); break;
+		case 'k': key_path = optarg; break;
+		case 'l': fault.loss_pct = percent(optarg); break;
+		case 'p': port = strtoul(optarg, NULL, 10); break;
+		case 's': fault.servfail_pct = percent(optarg); break;
+		case 't': fault.truncate_pct = percent(optarg); break;
+		case 'z': zone_str = optarg; break;
+		case 'D': fault.delay_pct = percent(optarg); break;
+		case 'S': seed = strtoul(optarg, NULL, 10); break;
+		case 'T': ttl = strtoul(optarg, NULL, 10); break;
+		default: usage();
+		}
+	}
+	if (zone_str == NULL || key_path == NULL)
+		usage();
+	srandom(seed);
+
+	zone_len = name_from_str(zone_str, zone, &zone_labels);
+	if (zone_len == 0) {
+		fprintf(stderr, "nss-ubdns-responder: invalid zone %s\n", zone_str);
+		return (EXIT_FAILURE);
+	}
+	if (!key_init()) {
+		fprintf(stderr, "nss-ubdns-responder: unable to generate a key\n");
+		return (EXIT_FAILURE);
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, address, &sin.sin_addr) != 1)
+		usage();
+
+	udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	tcp_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (udp_fd == -1 || tcp_fd == -1 ||
+	    setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+	    bind(udp_fd, (struct sockaddr *) &sin, sizeof(sin)) != 0 ||
+	    bind(tcp_fd, (struct sockaddr *) &sin, sizeof(sin)) != 0 ||
+	    listen(tcp_fd, 16) != 0)
+	{
+		fprintf(stderr, "nss-ubdns-responder: %s:%u: %s\n", address, port, strerror(errno));
+		return (EXIT_FAILURE);
+	}
+
+	/* the trust anchor appears only once the server is ready */
+	if (!write_trust_anchor(key_path, zone_str)) {
+		fprintf(stderr, "nss-ubdns-responder: %s: %s\n", key_path, strerror(errno));
+		return (EXIT_FAILURE);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	while (!stop) {
+		int timeout = flush_pending();
+		nfds_t n = 2;
+
+		pfd[0].fd = udp_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = tcp_fd;
+		pfd[1].events = POLLIN;
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			pfd[n].fd = clients[i].fd;
+			pfd[n].events = POLLIN;
+			n++;
+		}
+
+		if (poll(pfd, n, timeout) <= 0)
+			continue;
+
+		if (pfd[0].revents & POLLIN) {
+			uint8_t buf[MAX_MSG];
+			struct sockaddr_storage from;
+			socklen_t from_len;
+			ssize_t len;
+
+			for (;;) {
+				from_len = sizeof(from);
+				len = recvfrom(udp_fd, buf, sizeof(buf), 0,
+					       (struct sockaddr *) &from, &from_len);
+				if (len < 0)
+					break;
+				handle(udp_fd, false, buf, len, &from, from_len);
+			}
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			int fd = accept4(tcp_fd, NULL, NULL, SOCK_NONBLOCK);
+
+			for (i = 0; fd != -1 && i < MAX_CLIENTS; i++) {
+				if (clients[i].fd == -1) {
+					clients[i].fd = fd;
+					clients[i].rlen = 0;
+					break;
+				}
+			}
+			if (fd != -1 && i == MAX_CLIENTS)
+				close(fd);
+		}
+
+		for (i = 0; i < MAX_CLIENTS; i++)
+			if (clients[i].fd != -1 && (pfd[2 + i].revents & (POLLIN | POLLHUP | POLLERR)))
+				tcp_read(&clients[i]);
+	}
+
+	unlink(key_path);
+	return (EXIT_SUCCESS);
+}
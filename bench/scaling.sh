@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Measure how cold lookup throughput scales with the number of threads, for
+# each of a series of context pool sizes, printing one line of JSON per run.
+#
+#     $ make bench responder
+#     $ sh bench/scaling.sh
+#
+# As with scenarios.sh, the module resolves names in a signed test zone
+# served by nss-ubdns-responder, and validates every answer. Set CONTEXTS
+# and THREADS to the pool sizes and thread counts to try, NAMES to the
+# number of names each run looks up, DELAY to the responder's delay in
+# milliseconds and PORT to its port.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+CONTEXTS=${CONTEXTS:-"1 2 4 8"}
+THREADS=${THREADS:-"1 2 4 8 16 32 64"}
+NAMES=${NAMES:-2000}
+DELAY=${DELAY:-0}
+PORT=${PORT:-5353}
+ZONE=signed.test
+
+confdir=$(mktemp -d)
+responder_pid=
+trap 'test -z "$responder_pid" || kill $responder_pid 2>/dev/null; rm -rf "$confdir"' EXIT
+
+mkdir "$confdir/keys"
+cat > "$confdir/libunbound.conf" <<CONF
+server:
+    do-not-query-localhost: no
+    local-zone: "test." nodefault
+forward-zone:
+    name: "$ZONE."
+    forward-addr: 127.0.0.1@$PORT
+CONF
+
+./bench/nss-ubdns-responder -p "$PORT" -z "$ZONE" -k "$confdir/keys/$ZONE.key" \
+    -d "$DELAY" &
+responder_pid=$!
+while [ ! -s "$confdir/keys/$ZONE.key" ]; do
+    kill -0 $responder_pid
+    sleep 0.1
+done
+
+for contexts in $CONTEXTS; do
+    echo "contexts: $contexts" > "$confdir/nss-ubdns.conf"
+    for threads in $THREADS; do
+        NSS_UBDNS_CONFDIR=$confdir ./nss-ubdns-bench -z "$ZONE" -n "$NAMES" \
+            -t "$threads" -W cold -j -L "contexts=$contexts"
+    done
+done
@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# Run nss-ubdns-bench against nss-ubdns-responder under a series of upstream
+# faults, printing one line of JSON with the latency distribution for each.
+#
+#     $ make bench responder
+#     $ sh bench/scenarios.sh [SCENARIO...]
+#
+# The module is given a private configuration directory whose
+# libunbound.conf forwards the signed test zone to the responder, and whose
+# trust anchor is the key the responder generated, so every answer is
+# validated. Set NAMES, THREADS or PORT in the environment to change the
+# number of names looked up, the number of threads or the responder's port,
+# and DEADLINE to give each lookup a deadline in milliseconds.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+NAMES=${NAMES:-500}
+THREADS=${THREADS:-4}
+PORT=${PORT:-5353}
+DEADLINE=${DEADLINE:-0}
+ZONE=signed.test
+
+SCENARIOS="
+baseline:
+delay-20ms:-d 20
+jitter-0-200ms:-j 200
+slow-5pct-500ms:-d 500 -D 5
+loss-5pct:-l 5
+loss-30pct:-l 30
+servfail-10pct:-s 10
+truncate-50pct:-t 50
+bogus-10pct:-b 10
+"
+
+confdir=$(mktemp -d)
+responder_pid=
+trap 'test -z "$responder_pid" || kill $responder_pid 2>/dev/null; rm -rf "$confdir"' EXIT
+
+mkdir "$confdir/keys"
+cat > "$confdir/libunbound.conf" <<CONF
+server:
+    do-not-query-localhost: no
+    local-zone: "test." nodefault
+forward-zone:
+    name: "$ZONE."
+    forward-addr: 127.0.0.1@$PORT
+CONF
+echo "deadline: $DEADLINE" > "$confdir/nss-ubdns.conf"
+
+run() {
+    name=$1
+    shift
+
+    rm -f "$confdir/keys/$ZONE.key"
+    ./bench/nss-ubdns-responder -p "$PORT" -z "$ZONE" \
+        -k "$confdir/keys/$ZONE.key" "$@" &
+    responder_pid=$!
+    while [ ! -s "$confdir/keys/$ZONE.key" ]; do
+        kill -0 $responder_pid
+        sleep 0.1
+    done
+
+    NSS_UBDNS_CONFDIR=$confdir ./nss-ubdns-bench -z "$ZONE" -n "$NAMES" \
+        -t "$THREADS" -W cold -j -H -L "$name"
+
+    kill $responder_pid
+    wait $responder_pid || true
+    responder_pid=
+}
+
+echo "$SCENARIOS" | while IFS=: read -r name args; do
+    test -n "$name" || continue
+    if [ $# -gt 0 ]; then
+        case " $* " in
+        *" $name "*) ;;
+        *) continue ;;
+        esac
+    fi
+    run "$name" $args
+done
@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * In-process front cache of final lookup results, keyed by (kind, key) where
+ * kind is the address family of a forward lookup (AF_INET, AF_INET6 or
+ * AF_UNSPEC) or NSS_UBDNS_CACHE_PTR, and the key is the normalized name or
+ * the address being reversed. Values are stored exactly as the lookup
+ * functions return them, so a hit skips libunbound, result conversion and
+ * sorting entirely. Negative results are stored with an empty value.
+ * Expired entries stay until they are evicted, and may be served stale.
+ *
+ * The cache is split into shards with their own lock, hash table and memory
+ * budget, evicted with the CLOCK algorithm.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nss-ubdns.h"
+
+#define CACHE_SHARDS		64
+#define CACHE_BUCKETS		256	/* per shard */
+
+struct entry {
+	struct entry *next;		/* hash chain */
+	struct entry *ring_prev;	/* CLOCK ring */
+	struct entry *ring_next;
+	uint32_t hash;
+	uint8_t kind;
+	bool referenced;
+	bool prefetching;
+	uint32_t generation;
+	uint32_t hits;
+	int32_t ttl;
+	int64_t expire;
+	size_t key_len;
+	size_t val_len;
+	size_t size;
+	uint8_t data[];			/* key, then value */
+};
+
+struct shard {
+	pthread_mutex_t lock;
+	struct entry *buckets[CACHE_BUCKETS];
+	struct entry *hand;
+	size_t size;
+} __attribute__((aligned(64)));
+
+static struct shard shards[CACHE_SHARDS] = {
+	[0 ... CACHE_SHARDS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+/* entries from an older generation are treated as expired */
+static uint32_t cache_generation = 0;
+
+/* hits after which an answer in the last tenth of its TTL is refreshed */
+static unsigned cache_prefetch_hits = 0;
+
+static uint32_t
+cache_hash(int kind, const void *key, size_t key_len) {
+	const uint8_t *p = key;
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < key_len; i++)
+		h = (h ^ p[i]) * 16777619u;
+	h = (h ^ (uint32_t) kind) * 16777619u;
+	return (h);
+}
+
+static struct entry **
+cache_find(struct shard *s, uint32_t hash, int kind, const void *key, size_t key_len) {
+	struct entry **pp, *e;
+
+	for (pp = &s->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS]; (e = *pp) != NULL; pp = &e->next) {
+		if (e->hash == hash && e->kind == kind && e->key_len == key_len &&
+		    memcmp(e->data, key, key_len) == 0)
+			return (pp);
+	}
+	return (pp);
+}
+
+static void
+cache_unlink(struct shard *s, struct entry **pp) {
+	struct entry *e = *pp;
+
+	*pp = e->next;
+	if (e->ring_next == e) {
+		s->hand = NULL;
+	} else {
+		e->ring_prev->ring_next = e->ring_next;
+		e->ring_next->ring_prev = e->ring_prev;
+		if (s->hand == e)
+			s->hand = e->ring_next;
+	}
+	s->size -= e->size;
+	free(e);
+}
+
+/* Evict from a shard until an entry of the given size fits in its budget. */
+static void
+cache_evict(struct shard *s, size_t size, int64_t now) {
+	struct entry *e;
+
+	while (s->hand != NULL && s->size + size > NSS_UBDNS_CACHE_SIZE / CACHE_SHARDS) {
+		e = s->hand;
+		if (e->referenced && e->expire > now &&
+		    e->generation == __atomic_load_n(&cache_generation, __ATOMIC_RELAXED))
+		{
+			e->referenced = false;
+			s->hand = e->ring_next;
+			continue;
+		}
+		cache_unlink(s, cache_find(s, e->hash, e->kind, e->data, e->key_len));
+	}
+}
+
+/*
+ * Look up a result. Returns NSS_UBDNS_CACHE_HIT on a hit, with the remaining
+ * TTL in *ttl and a copy of the value in *val: buf itself if the value fits in
+ * buf_len bytes or is empty (a negative entry), otherwise a malloc()ed copy.
+ * The first hit on a popular entry that is about to expire returns
+ * NSS_UBDNS_CACHE_PREFETCH instead, and the caller should refresh it.
+ */
+int
+nss_ubdns_cache_get(int kind, const void *key, size_t key_len, void *buf, size_t buf_len,
+		    void **val, size_t *val_len, int32_t *ttl)
+{
+	struct shard *s;
+	struct entry *e;
+	uint32_t hash;
+	unsigned prefetch_hits;
+	int64_t now;
+	int hit = 0;
+
+	hash = cache_hash(kind, key, key_len);
+	s = &shards[hash % CACHE_SHARDS];
+	now = nss_ubdns_now();
+	prefetch_hits = __atomic_load_n(&cache_prefetch_hits, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&s->lock);
+	e = *cache_find(s, hash, kind, key, key_len);
+	if (e != NULL && e->expire > now &&
+	    e->generation == __atomic_load_n(&cache_generation, __ATOMIC_RELAXED))
+	{
+		*val = buf;
+		*val_len = e->val_len;
+		if (e->val_len > buf_len)
+			*val = malloc(e->val_len);
+		if (*val != NULL || e->val_len == 0) {
+			if (e->val_len > 0)
+				memcpy(*val, e->data + e->key_len, e->val_len);
+			*ttl = e->expire - now;
+			e->referenced = true;
+			e->hits++;
+			hit = NSS_UBDNS_CACHE_HIT;
+
+			if (prefetch_hits > 0 && e->hits >= prefetch_hits && !e->prefetching &&
+			    (e->expire - now) * 10 <= e->ttl)
+			{
+				e->prefetching = true;
+				hit = NSS_UBDNS_CACHE_PREFETCH;
+			}
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return (hit);
+}
+
+/*
+ * Look up a result that has expired, but by less than max_stale seconds, for
+ * serving stale. The value is returned as by nss_ubdns_cache_get(), or if val
+ * is NULL only its presence is reported.
+ */
+bool
+nss_ubdns_cache_get_stale(int kind, const void *key, size_t key_len, void *buf, size_t buf_len,
+			  void **val, size_t *val_len, int64_t max_stale)
+{
+	struct shard *s;
+	struct entry *e;
+	uint32_t hash;
+	int64_t now;
+	bool hit = false;
+
+	hash = cache_hash(kind, key, key_len);
+	s = &shards[hash % CACHE_SHARDS];
+	now = nss_ubdns_now();
+
+	pthread_mutex_lock(&s->lock);
+	e = *cache_find(s, hash, kind, key, key_len);
+	if (e != NULL && e->expire <= now && e->expire + max_stale > now &&
+	    e->generation == __atomic_load_n(&cache_generation, __ATOMIC_RELAXED))
+	{
+		hit = true;
+		if (val != NULL) {
+			*val = buf;
+			*val_len = e->val_len;
+			if (e->val_len > buf_len)
+				*val = malloc(e->val_len);
+			if (*val != NULL || e->val_len == 0) {
+				if (e->val_len > 0)
+					memcpy(*val, e->data + e->key_len, e->val_len);
+				e->referenced = true;
+			} else {
+				hit = false;
+			}
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return (hit);
+}
+
+void
+nss_ubdns_cache_put(int kind, const void *key, size_t key_len,
+		    const void *val, size_t val_len, int32_t ttl)
+{
+	struct entry **pp, *e;
+	struct shard *s;
+	uint32_t hash;
+	size_t size;
+	int64_t now;
+
+	if (ttl <= 0)
+		return;
+
+	size = sizeof(*e) + key_len + val_len;
+	if (size > NSS_UBDNS_CACHE_SIZE / CACHE_SHARDS)
+		return;
+
+	e = malloc(size);
+	if (e == NULL)
+		return;
+
+	hash = cache_hash(kind, key, key_len);
+	s = &shards[hash % CACHE_SHARDS];
+	now = nss_ubdns_now();
+
+	e->hash = hash;
+	e->kind = kind;
+	e->referenced = false;
+	e->prefetching = false;
+	e->generation = __atomic_load_n(&cache_generation, __ATOMIC_RELAXED);
+	e->hits = 0;
+	e->ttl = ttl;
+	e->expire = now + ttl;
+	e->key_len = key_len;
+	e->val_len = val_len;
+	e->size = size;
+	memcpy(e->data, key, key_len);
+	if (val_len > 0)
+		memcpy(e->data + key_len, val, val_len);
+
+	pthread_mutex_lock(&s->lock);
+
+	pp = cache_find(s, hash, kind, key, key_len);
+	if (*pp != NULL)
+		cache_unlink(s, pp);
+	cache_evict(s, size, now);
+
+	pp = cache_find(s, hash, kind, key, key_len);
+	e->next = NULL;
+	*pp = e;
+
+	/* new entries go just behind the hand, so they are examined last */
+	if (s->hand == NULL) {
+		e->ring_prev = e->ring_next = e;
+		s->hand = e;
+	} else {
+		e->ring_next = s->hand;
+		e->ring_prev = s->hand->ring_prev;
+		e->ring_prev->ring_next = e;
+		s->hand->ring_prev = e;
+	}
+	s->size += size;
+
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Remove a result, so that it can't be served stale either. */
+void
+nss_ubdns_cache_drop(int kind, const void *key, size_t key_len) {
+	struct entry **pp;
+	struct shard *s;
+	uint32_t hash;
+
+	hash = cache_hash(kind, key, key_len);
+	s = &shards[hash % CACHE_SHARDS];
+
+	pthread_mutex_lock(&s->lock);
+	pp = cache_find(s, hash, kind, key, key_len);
+	if (*pp != NULL)
+		cache_unlink(s, pp);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Invalidate every entry, e.g. after the configuration has changed. */
+void
+nss_ubdns_cache_flush(void) {
+	__atomic_add_fetch(&cache_generation, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Called around fork() with phase NSS_UBDNS_FORK_PREPARE, then _PARENT or
+ * _CHILD. The child keeps the cache, but none of the refreshes that were
+ * under way in the parent.
+ */
+void
+nss_ubdns_cache_fork(int phase) {
+	struct entry *e;
+	unsigned i, j;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		if (phase == NSS_UBDNS_FORK_PREPARE) {
+			pthread_mutex_lock(&shards[i].lock);
+			continue;
+		}
+		if (phase == NSS_UBDNS_FORK_CHILD) {
+			for (j = 0; j < CACHE_BUCKETS; j++)
+				for (e = shards[i].buckets[j]; e != NULL; e = e->next)
+					e->prefetching = false;
+		}
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+}
+
+/* Set how many hits make an entry worth refreshing before it expires, 0 for never. */
+void
+nss_ubdns_cache_set_prefetch(unsigned hits) {
+	__atomic_store_n(&cache_prefetch_hits, hits, __ATOMIC_RELAXED);
+}
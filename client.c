@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <unbound.h>
+
+#include "nss-ubdns.h"
+
+/* seconds to wait before trying to reach an absent daemon again */
+#define NSS_UBDNS_CACHED_RETRY		1
+
+/*
+ * milliseconds to wait for the daemon to send anything before resolving
+ * in-process instead, a little more than libunbound waits on one server
+ */
+#define NSS_UBDNS_CACHED_TIMEOUT	1500
+
+/* abandoned requests whose replies may be outstanding before reconnecting */
+#define NSS_UBDNS_CACHED_ABANDONED	64
+
+/*
+ * Each thread keeps its own connection to nss-ubdns-cached open across
+ * lookups, so that requests never have to be multiplexed between threads.
+ * The thread-specific key closes it when the thread exits. Every request on
+ * a connection has an id of its own, so that the replies to requests a
+ * search no longer needed can be told apart and skipped when they arrive.
+ */
+static __thread int cached_fd = -1;
+static __thread time_t cached_retry = 0;
+static __thread uint32_t cached_next_id = 0;
+static __thread unsigned cached_abandoned = 0;
+
+static pthread_key_t cached_key;
+static pthread_once_t cached_once = PTHREAD_ONCE_INIT;
+
+static void
+nss_ubdns_cached_thread_exit(void *arg) {
+	close((int) (intptr_t) arg - 1);
+}
+
+static void
+nss_ubdns_cached_close(void) {
+	if (cached_fd != -1) {
+		close(cached_fd);
+		cached_fd = -1;
+		cached_abandoned = 0;
+		pthread_setspecific(cached_key, NULL);
+	}
+}
+
+static void
+nss_ubdns_cached_atfork_child(void) {
+	/* the connection belongs to the parent process */
+	nss_ubdns_cached_close();
+}
+
+static void
+nss_ubdns_cached_init(void) {
+	pthread_key_create(&cached_key, nss_ubdns_cached_thread_exit);
+	pthread_atfork(NULL, NULL, nss_ubdns_cached_atfork_child);
+}
+
+static bool
+nss_ubdns_cached_connect(void) {
+	struct sockaddr_un sa;
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	time_t now;
+	int fd;
+
+	if (cached_fd != -1)
+		return (true);
+
+	now = time(NULL);
+	if (now < cached_retry)
+		return (false);
+
+	pthread_once(&cached_once, nss_ubdns_cached_init);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		goto fail;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, NSS_UBDNS_CACHED_SOCKET, sizeof(sa.sun_path) - 1);
+
+	/* only trust validation results from a daemon running as root */
+	if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) != 0 ||
+	    getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+	    cred.uid != 0)
+	{
+		close(fd);
+		goto fail;
+	}
+
+	cached_fd = fd;
+	pthread_setspecific(cached_key, (void *) (intptr_t) (fd + 1));
+	return (true);
+fail:
+	cached_retry = now + NSS_UBDNS_CACHED_RETRY;
+	return (false);
+}
+
+/*
+ * Fails with errno set to ETIMEDOUT if the lookup's deadline passes, or to
+ * EAGAIN if the daemon sends nothing for NSS_UBDNS_CACHED_TIMEOUT.
+ */
+static bool
+nss_ubdns_cached_read(void *buf, size_t len, int64_t deadline) {
+	struct pollfd pfd;
+	uint8_t *p = buf;
+	int64_t left, timeout;
+	ssize_t r;
+
+	while (len > 0) {
+		timeout = NSS_UBDNS_CACHED_TIMEOUT;
+		if (deadline != 0) {
+			left = deadline - nss_ubdns_now_ms();
+			if (left <= 0) {
+				errno = ETIMEDOUT;
+				return (false);
+			}
+			if (left < timeout)
+				timeout = left;
+		}
+		pfd.fd = cached_fd;
+		pfd.events = POLLIN;
+		r = poll(&pfd, 1, timeout);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r == 0) {
+			errno = (timeout == NSS_UBDNS_CACHED_TIMEOUT) ? EAGAIN : ETIMEDOUT;
+			return (false);
+		}
+		r = read(cached_fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return (false);
+		p += r;
+		len -= r;
+	}
+	return (true);
+}
+
+/* Skip the rest of a reply to an abandoned request. */
+static bool
+nss_ubdns_cached_skip(size_t len, int64_t deadline) {
+	uint8_t buf[4096];
+	size_t n;
+
+	while (len > 0) {
+		n = len < sizeof(buf) ? len : sizeof(buf);
+		if (!nss_ubdns_cached_read(buf, n, deadline))
+			return (false);
+		len -= n;
+	}
+	return (true);
+}
+
+static bool
+nss_ubdns_cached_send(uint32_t id, const char *qname, int rrtype) {
+	struct nss_ubdns_cached_request req;
+	struct msghdr msg;
+	struct iovec iov[2];
+	size_t qname_len = strlen(qname) + 1;
+	ssize_t r;
+
+	if (qname_len > NSS_UBDNS_PRESLEN_NAME)
+		return (false);
+
+	req.id = id;
+	req.rrtype = rrtype;
+	req.qname_len = qname_len;
+
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = (void *) qname;
+	iov[1].iov_len = qname_len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	do {
+		r = sendmsg(cached_fd, &msg, MSG_NOSIGNAL);
+	} while (r < 0 && errno == EINTR);
+
+	/* requests are small enough that a short write means a broken peer */
+	return (r == (ssize_t) (sizeof(req) + qname_len));
+}
+
+/* Read a reply to one of the queries, whose requests' ids start at base. */
+static bool
+nss_ubdns_cached_recv(struct nss_ubdns_query *q, unsigned n_q, uint32_t base, int64_t deadline) {
+	struct nss_ubdns_cached_reply rep;
+	struct ub_result *res;
+	uint8_t *rdata;
+	uint32_t i;
+
+	if (!nss_ubdns_cached_read(&rep, sizeof(rep), deadline))
+		return (false);
+	if (rep.len > NSS_UBDNS_CACHED_MAXMSG + NSS_UBDNS_NAMES_MAX || rep.names_len > rep.len)
+		return (false);
+	i = rep.id - base;
+	if (i >= n_q && cached_abandoned > 0) {
+		cached_abandoned--;
+		return (nss_ubdns_cached_skip(rep.len, deadline));
+	}
+	if (i >= n_q || q[i].done)
+		return (false);
+
+	rdata = malloc(rep.len + 1);
+	if (rdata == NULL)
+		return (false);
+	if (!nss_ubdns_cached_read(rdata, rep.len, deadline)) {
+		free(rdata);
+		return (false);
+	}
+	res = nss_ubdns_result_new(q[i].rrtype, rdata, rep.len - rep.names_len, rep.n_data,
+				   (char *) rdata + rep.len - rep.names_len, rep.names_len);
+	free(rdata);
+	if (res == NULL)
+		return (false);
+
+	res->havedata = rep.havedata;
+	res->nxdomain = rep.nxdomain;
+	res->secure = rep.secure;
+	res->bogus = rep.bogus;
+	res->rcode = rep.rcode;
+	res->ttl = rep.ttl;
+
+	q[i].err = rep.err;
+	q[i].done = true;
+	if (rep.err == 0) {
+		q[i].res = res;
+		q[i].cached = true;
+	} else {
+		free(res);
+	}
+	return (true);
+}
+
+/*
+ * Send the requests for the queries that are not done yet, and read replies
+ * until they all are, or decided says the rest are not needed. See
+ * nss_ubdns_cached_resolve() for the rest.
+ */
+static int
+nss_ubdns_cached_exchange(const char *const *qnames, struct nss_ubdns_query *q, unsigned n_q,
+			  int64_t deadline, bool prefetch,
+			  bool (*decided)(const struct nss_ubdns_query *, unsigned, void *),
+			  void *arg)
+{
+	bool sent[n_q];
+	unsigned i, n_abandoned = 0;
+	uint32_t base;
+	int err = NSS_UBDNS_ERR_TIMEOUT;
+
+	if (nss_ubdns_confdir_private() || !nss_ubdns_cached_connect())
+		return (-1);
+
+	base = cached_next_id;
+	cached_next_id += n_q;
+	for (i = 0; i < n_q; i++) {
+		sent[i] = !q[i].done;
+		if (sent[i] &&
+		    !nss_ubdns_cached_send(base + i, qnames[i],
+					   q[i].rrtype | (prefetch ? NSS_UBDNS_CACHED_PREFETCH : 0)))
+			goto fail;
+	}
+
+	for (;;) {
+		for (i = 0; i < n_q && q[i].done; i++)
+			;
+		if (i == n_q)
+			return (0);
+		if (decided != NULL && decided(q, n_q, arg)) {
+			err = NSS_UBDNS_ERR_CANCELLED;
+			goto abandon;
+		}
+
+		errno = 0;
+		if (!nss_ubdns_cached_recv(q, n_q, base, deadline)) {
+			if (errno == ETIMEDOUT)
+				goto abandon;
+
+			/* a daemon that has stalled is left alone for a while */
+			if (errno == EAGAIN)
+				cached_retry = time(NULL) + NSS_UBDNS_CACHED_RETRY;
+			goto fail;
+		}
+	}
+
+abandon:
+	for (i = 0; i < n_q; i++) {
+		if (!q[i].done) {
+			q[i].err = err;
+			q[i].done = true;
+			n_abandoned++;
+		}
+	}
+
+	/* a daemon too slow to answer in time gets a fresh start */
+	cached_abandoned += n_abandoned;
+	if (err == NSS_UBDNS_ERR_TIMEOUT || cached_abandoned > NSS_UBDNS_CACHED_ABANDONED)
+		nss_ubdns_cached_close();
+	return (0);
+fail:
+	for (i = 0; i < n_q; i++) {
+		if (!sent[i])
+			continue;
+		free(q[i].res);
+		q[i].res = NULL;
+		q[i].done = false;
+	}
+	nss_ubdns_cached_close();
+	return (-1);
+}
+
+/*
+ * Resolve the queries through nss-ubdns-cached. All requests are written
+ * before any reply is read, so the daemon works on them concurrently.
+ * Returns 0 on success, or -1 if the daemon is unavailable or has sent
+ * nothing for NSS_UBDNS_CACHED_TIMEOUT, in which case the caller should
+ * resolve in-process instead. Queries still unanswered at
+ * the deadline fail with NSS_UBDNS_ERR_TIMEOUT, and the connection is closed
+ * rather than left waiting on a daemon that is stuck. With prefetch, the
+ * daemon resolves them afresh, bypassing its caches, and refreshes the
+ * shared cache.
+ */
+int
+nss_ubdns_cached_resolve(const char *qname, struct nss_ubdns_query *q, unsigned n_q,
+			 int64_t deadline, bool prefetch)
+{
+	const char *qnames[n_q];
+	unsigned i;
+
+	for (i = 0; i < n_q; i++) {
+		qnames[i] = qname;
+		q[i].err = 0;
+		q[i].done = false;
+		q[i].cached = false;
+		q[i].res = NULL;
+	}
+	return (nss_ubdns_cached_exchange(qnames, q, n_q, deadline, prefetch, NULL, NULL));
+}
+
+/*
+ * As above, for queries of different names, qnames[i] being that of q[i],
+ * and skipping those already done. After each reply decided, if given, is
+ * asked whether the answers so far settle the lookup; once they do, the
+ * queries still outstanding fail with NSS_UBDNS_ERR_CANCELLED. The daemon
+ * goes on to resolve them all the same, for the shared cache, and their
+ * replies are skipped by later exchanges on the same connection.
+ */
+int
+nss_ubdns_cached_resolve_names(const char *const *qnames, struct nss_ubdns_query *q, unsigned n_q,
+			       int64_t deadline,
+			       bool (*decided)(const struct nss_ubdns_query *, unsigned, void *),
+			       void *arg)
+{
+	return (nss_ubdns_cached_exchange(qnames, q, n_q, deadline, false, decided, arg));
+}
@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <unbound.h>
+
+#include "nss-ubdns.h"
+
+/*
+ * The directory holding nss-ubdns.conf, libunbound.conf and the trust anchors. Tests and
+ * benchmarks can give a process a private one, which may also hold its own
+ * resolv.conf, with the NSS_UBDNS_CONFDIR environment variable. That is
+ * ignored in setuid and setgid programs.
+ */
+const char *
+nss_ubdns_confdir(void) {
+	const char *dir = secure_getenv("NSS_UBDNS_CONFDIR");
+
+	if (dir == NULL || dir[0] == '\0')
+		return (NSS_UBDNS_CONFDIR);
+	return (dir);
+}
+
+/*
+ * Whether this process uses a private configuration. nss-ubdns-cached and its
+ * shared cache answer from the system configuration, so such a process must
+ * resolve everything itself.
+ */
+bool
+nss_ubdns_confdir_private(void) {
+	static int private = -1;
+	int p;
+
+	p = __atomic_load_n(&private, __ATOMIC_RELAXED);
+	if (p == -1) {
+		p = strcmp(nss_ubdns_confdir(), NSS_UBDNS_CONFDIR) != 0;
+		__atomic_store_n(&private, p, __ATOMIC_RELAXED);
+	}
+	return (p);
+}
+
+void
+nss_ubdns_conf_path(char *path, size_t size, const char *fn) {
+	snprintf(path, size, "%s/%s", nss_ubdns_confdir(), fn);
+}
+
+static void
+nss_ubdns_resolvconf_path(char *path, size_t size) {
+	if (nss_ubdns_confdir_private())
+		nss_ubdns_conf_path(path, size, "resolv.conf");
+	else
+		snprintf(path, size, "%s", NSS_UBDNS_RESOLVCONF);
+}
+
+static void
+nss_ubdns_load_keys(struct ub_ctx *ctx) {
+	char path[PATH_MAX];
+	DIR *dirp;
+	int dir_fd;
+	struct dirent de;
+	struct dirent *res;
+
+	nss_ubdns_conf_path(path, sizeof(path), NSS_UBDNS_KEYDIR);
+	dirp = opendir(path);
+	if (dirp == NULL)
+		return;
+
+	dir_fd = dirfd(dirp);
+	if (dir_fd == -1)
+		return;
+
+	while (readdir_r(dirp, &de, &res) == 0 && res != NULL) {
+		FILE *fp;
+		int fd;
+		char *line = NULL;
+		char *fn;
+		size_t len = 0;
+		size_t fnlen;
+		ssize_t bytes_read;
+
+		fn = de.d_name;
+		fnlen = strlen(fn);
+		if (fnlen < 5 ||
+		     !(fn[fnlen - 4] == '.' &&
+		       fn[fnlen - 3] == 'k' &&
+		       fn[fnlen - 2] == 'e' &&
+		       fn[fnlen - 1] == 'y'))
+		{
+			continue;
+		}
+		if (!isalnum(fn[0]))
+			continue;
+
+		fd = openat(dir_fd, de.d_name, O_RDONLY);
+		if (fd == -1)
+			continue;
+
+		fp = fdopen(fd, "r");
+		if (fp == NULL) {
+			close(fd);
+			continue;
+		}
+
+		while ((bytes_read = getline(&line, &len, fp)) != -1) {
+			char *p = line;
+
+			while (isspace(*p))
+				p++;
+			if (*p == '\0' || *p == ';')
+				continue;
+
+			ub_ctx_add_ta(ctx, p);
+		}
+		free(line);
+		close(fd);
+	}
+	closedir(dirp);
+}
+
+static void
+nss_ubdns_load_cfg(struct ub_ctx *ctx) {
+	char path[PATH_MAX];
+
+	nss_ubdns_conf_path(path, sizeof(path), NSS_UBDNS_LUCONF);
+	ub_ctx_config(ctx, path);
+}
+
+static void
+nss_ubdns_load_resolvconf(struct ub_ctx *ctx) {
+	char path[PATH_MAX];
+	struct stat sb;
+
+	nss_ubdns_resolvconf_path(path, sizeof(path));
+	if (stat(path, &sb) == 0) {
+		ub_ctx_resolvconf(ctx, path);
+	} else {
+		ub_ctx_set_fwd(ctx, "127.0.0.1");
+	}
+}
+
+static void
+nss_ubdns_search_add(struct nss_ubdns_options *opts, size_t *len, const char *domain) {
+	size_t l = strlen(domain);
+
+	while (l > 0 && domain[l - 1] == '.')
+		l--;
+	if (l == 0 || opts->n_search == NSS_UBDNS_SEARCH_MAX ||
+	    *len + l + 1 > sizeof(opts->search))
+		return;
+	memcpy(opts->search + *len, domain, l);
+	opts->search[*len + l] = '\0';
+	*len += l + 1;
+	opts->n_search++;
+}
+
+/*
+ * Read the search list and the ndots option from resolv.conf, which
+ * libunbound has no use for. As in glibc, the last "search" or "domain" line
+ * wins, and without either the domain of the host name is searched.
+ */
+static void
+nss_ubdns_load_search(struct nss_ubdns_options *opts) {
+	char path[PATH_MAX], host[HOST_NAME_MAX + 1];
+	char *line = NULL, *word, *save, *dot;
+	bool have_search = false;
+	size_t len = 0, n = 0;
+	unsigned long v;
+	FILE *fp;
+
+	opts->ndots = 1;
+	opts->n_search = 0;
+
+	nss_ubdns_resolvconf_path(path, sizeof(path));
+	fp = fopen(path, "re");
+	while (fp != NULL && getline(&line, &n, fp) != -1) {
+		line[strcspn(line, ";#\n")] = '\0';
+		word = strtok_r(line, " \t", &save);
+		if (word == NULL)
+			continue;
+
+		if (strcmp(word, "search") == 0 || strcmp(word, "domain") == 0) {
+			bool domain = (word[0] == 'd');
+
+			have_search = true;
+			opts->n_search = 0;
+			len = 0;
+			while ((word = strtok_r(NULL, " \t", &save)) != NULL) {
+				nss_ubdns_search_add(opts, &len, word);
+				if (domain)
+					break;
+			}
+		} else if (strcmp(word, "options") == 0) {
+			while ((word = strtok_r(NULL, " \t", &save)) != NULL) {
+				if (strncmp(word, "ndots:", 6) != 0)
+					continue;
+				v = strtoul(word + 6, NULL, 10);
+				opts->ndots = v < NSS_UBDNS_NDOTS_MAX ? v : NSS_UBDNS_NDOTS_MAX;
+			}
+		}
+	}
+	free(line);
+	if (fp != NULL)
+		fclose(fp);
+
+	if (!have_search && gethostname(host, sizeof(host)) == 0) {
+		host[sizeof(host) - 1] = '\0';
+		dot = strchr(host, '.');
+		if (dot != NULL)
+			nss_ubdns_search_add(opts, &len, dot + 1);
+	}
+}
+
+static uint64_t
+nss_ubdns_sig_add(uint64_t sig, const struct stat *sb) {
+	const uint64_t v[] = {
+		sb->st_dev, sb->st_ino, sb->st_size,
+		sb->st_mtim.tv_sec, sb->st_mtim.tv_nsec,
+	};
+	unsigned i;
+
+	for (i = 0; i < sizeof(v) / sizeof(v[0]); i++)
+		sig = (sig ^ v[i]) * 1099511628211ull;
+	return (sig);
+}
+
+static uint64_t
+nss_ubdns_sig_file(uint64_t sig, int dir_fd, const char *fn) {
+	struct stat sb;
+
+	if (fstatat(dir_fd, fn, &sb, 0) == 0)
+		return (nss_ubdns_sig_add(sig, &sb));
+	return ((sig ^ 1) * 1099511628211ull);
+}
+
+/*
+ * Read the module options. Each line of nss-ubdns.conf is "name: value", and
+ * "#" starts a comment. Unknown names and malformed values are ignored, and
+ * anything not set keeps its default. The search list comes from resolv.conf.
+ */
+void
+nss_ubdns_options_load(struct nss_ubdns_options *opts) {
+	char path[PATH_MAX];
+	char *line = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	memset(opts, 0, sizeof(*opts));
+	opts->stale_ttl = 30;
+	opts->stale_threshold = 1800;
+	opts->prefetch_hits = 10;
+	opts->contexts = 1;
+	nss_ubdns_load_search(opts);
+
+	nss_ubdns_conf_path(path, sizeof(path), NSS_UBDNS_CONF);
+	fp = fopen(path, "re");
+	if (fp == NULL)
+		return;
+
+	while (getline(&line, &len, fp) != -1) {
+		char *name, *value, *end;
+		unsigned long v;
+
+		line[strcspn(line, "#\n")] = '\0';
+		name = line + strspn(line, " \t");
+		value = strchr(name, ':');
+		if (value == NULL)
+			continue;
+		*value++ = '\0';
+		name[strcspn(name, " \t")] = '\0';
+		value += strspn(value, " \t");
+
+		errno = 0;
+		v = strtoul(value, &end, 10);
+		if (end == value || errno != 0 || v > UINT_MAX ||
+		    end[strspn(end, " \t")] != '\0')
+			continue;
+
+		if (strcmp(name, "deadline") == 0)
+			opts->deadline = v;
+		else if (strcmp(name, "serve-stale") == 0)
+			opts->serve_stale = v;
+		else if (strcmp(name, "stale-ttl") == 0)
+			opts->stale_ttl = v;
+		else if (strcmp(name, "stale-threshold") == 0)
+			opts->stale_threshold = v;
+		else if (strcmp(name, "prefetch-hits") == 0)
+			opts->prefetch_hits = v;
+		else if (strcmp(name, "contexts") == 0)
+			opts->contexts = v;
+	}
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Summarize the identity and modification time of every file a context is
+ * configured from. Any edit, replacement, addition or removal changes it.
+ */
+uint64_t
+nss_ubdns_config_signature(void) {
+	uint64_t sig = 14695981039346656037ull;
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *dirp;
+
+	nss_ubdns_resolvconf_path(path, sizeof(path));
+	sig = nss_ubdns_sig_file(sig, AT_FDCWD, path);
+	nss_ubdns_conf_path(path, sizeof(path), NSS_UBDNS_CONF);
+	sig = nss_ubdns_sig_file(sig, AT_FDCWD, path);
+	nss_ubdns_conf_path(path, sizeof(path), NSS_UBDNS_LUCONF);
+	sig = nss_ubdns_sig_file(sig, AT_FDCWD, path);
+	nss_ubdns_conf_path(path, sizeof(path), NSS_UBDNS_KEYDIR);
+	sig = nss_ubdns_sig_file(sig, AT_FDCWD, path);
+
+	dirp = opendir(path);
+	if (dirp != NULL) {
+		/* order of entries is stable as long as the directory is unchanged */
+		while ((de = readdir(dirp)) != NULL) {
+			if (de->d_name[0] != '.')
+				sig = nss_ubdns_sig_file(sig, dirfd(dirp), de->d_name);
+		}
+		closedir(dirp);
+	}
+	return (sig);
+}
+
+/*
+ * Create a validating context configured from resolv.conf, the trust anchor
+ * directory and libunbound.conf. Shared by the module and nss-ubdns-cached.
+ */
+struct ub_ctx *
+nss_ubdns_ctx_new(void) {
+	struct ub_ctx *ctx;
+
+	ctx = ub_ctx_create();
+	if (ctx != NULL) {
+		/* disable logging to stderr */
+		/* the stub resolver must not generate any output to stdio */
+		ub_ctx_debugout(ctx, NULL);
+
+		/* async queries must be handled by a thread, never a fork */
+		ub_ctx_async(ctx, 1);
+
+		nss_ubdns_load_resolvconf(ctx);
+		nss_ubdns_load_keys(ctx);
+		nss_ubdns_load_cfg(ctx);
+	}
+	return (ctx);
+}
+
+/*
+ * Create a context for refreshing answers before they expire. Its message and
+ * rrset caches are disabled, so that every answer is fetched afresh instead
+ * of being the cached one that is about to expire; the key cache still saves
+ * validating the chain of trust each time.
+ */
+struct ub_ctx *
+nss_ubdns_prefetch_ctx_new(void) {
+	struct ub_ctx *ctx;
+
+	ctx = nss_ubdns_ctx_new();
+	if (ctx != NULL) {
+		ub_ctx_set_option(ctx, "msg-cache-size:", "0");
+		ub_ctx_set_option(ctx, "rrset-cache-size:", "0");
+	}
+	return (ctx);
+}
@@ -19,8 +19,8 @@
  */
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
-#include <stdio.h>
 
 /**
  * Convert a domain name to a human-readable string.
@@ -57,8 +57,10 @@ domain_to_str(const uint8_t *src, size_t src_len, char *dst) {
 			} else if (c >= '!' && c <= '~') {
 				*dst++ = c;
 			} else {
-				snprintf(dst, 5, "\\%.3d", c);
-				dst += 4;
+				*dst++ = '\\';
+				*dst++ = '0' + c / 100;
+				*dst++ = '0' + c / 10 % 10;
+				*dst++ = '0' + c % 10;
 			}
 		}
 		*dst++ = '.';
@@ -71,3 +73,46 @@ domain_to_str(const uint8_t *src, size_t src_len, char *dst) {
 	*dst = '\0';
 	return (bytes_read);
 }
+
+/**
+ * Compute the size of the human-readable string for a domain name.
+ *
+ * \param[in] src domain name in wire format
+ * \param[in] src_len length of domain name in bytes
+ *
+ * \return Number of bytes domain_to_str() writes to dst, including the
+ * terminating NUL.
+ */
+
+size_t
+domain_to_str_size(const uint8_t *src, size_t src_len) {
+	size_t size = 0;
+	size_t bytes_remaining = src_len;
+	uint8_t oclen;
+
+	assert(src != NULL);
+
+	oclen = *src;
+	while (bytes_remaining > 0 && oclen != 0) {
+		src++;
+		bytes_remaining--;
+
+		while (oclen-- && bytes_remaining > 0) {
+			uint8_t c = *src++;
+			bytes_remaining--;
+
+			if (c == '.')
+				size += 2;
+			else if (c >= '!' && c <= '~')
+				size += 1;
+			else
+				size += 4;
+		}
+		size++;
+		oclen = *src;
+	}
+	if (size == 0)
+		size++;
+
+	return (size + 1);
+}
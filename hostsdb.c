@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nss-ubdns.h"
+
+/*
+ * The static overrides in hosts.db, see nss-ubdns.h. The file is mapped by
+ * the first lookup, and whenever it has been replaced since, the new one is
+ * mapped and swapped in with a single pointer store. A lookup takes a
+ * reference to the current mapping, so it sees one version of the file
+ * throughout, and a mapping that has been replaced is only unmapped once the
+ * last lookup using it has let go. The mappings live in a fixed set of
+ * slots, which are only reused once unmapped, so a lookup can always take a
+ * reference to the slot it read, even one replaced in the meantime. The file
+ * must be replaced by renaming a new one over it, as nss-ubdns-compile does,
+ * never rewritten in place.
+ */
+#define HOSTSDB_MAPS		4	/* the current mapping and those still in use */
+
+struct hostsdb_map {
+	struct nss_ubdns_hostsdb_header *hdr;
+	unsigned refs;		/* lookups using it, and one more while it is current */
+};
+
+static struct hostsdb_map maps[HOSTSDB_MAPS];
+static struct hostsdb_map *hostsdb = NULL;
+static pthread_mutex_t hostsdb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the file that was last looked at, mapped or not */
+static dev_t hostsdb_dev;
+static ino_t hostsdb_ino;
+static off_t hostsdb_size;
+static struct timespec hostsdb_mtime;
+
+static const struct nss_ubdns_hostsdb_bucket *
+hostsdb_buckets(const struct nss_ubdns_hostsdb_header *hdr) {
+	return ((const struct nss_ubdns_hostsdb_bucket *) (hdr + 1));
+}
+
+static const struct nss_ubdns_hostsdb_record *
+hostsdb_record(const struct nss_ubdns_hostsdb_header *hdr, uint32_t off) {
+	return ((const struct nss_ubdns_hostsdb_record *) ((const uint8_t *) hdr + off));
+}
+
+static const uint8_t *
+hostsdb_value(const struct nss_ubdns_hostsdb_record *rec) {
+	return ((const uint8_t *) (rec + 1) + rec->key_len + 1);
+}
+
+/* The names at the end of a value, and their length, or -1 if they don't fit. */
+static ssize_t
+hostsdb_names(const uint8_t *val, size_t val_len, const char **names) {
+	uint16_t n;
+
+	if (val_len < sizeof(n))
+		return (-1);
+	memcpy(&n, val + val_len - sizeof(n), sizeof(n));
+	if (n > val_len - sizeof(n) || n > NSS_UBDNS_NAMES_MAX ||
+	    (n > 0 && val[val_len - sizeof(n) - 1] != '\0'))
+		return (-1);
+	*names = (const char *) val + val_len - sizeof(n) - n;
+	return (n);
+}
+
+/*
+ * Check the whole file once when it is mapped, so that lookups can trust
+ * every offset and length in it.
+ */
+static bool
+hostsdb_valid(const struct nss_ubdns_hostsdb_header *hdr, size_t size) {
+	const struct nss_ubdns_hostsdb_bucket *b = hostsdb_buckets(hdr);
+	const struct nss_ubdns_hostsdb_record *rec;
+	const char *names;
+	ssize_t names_len;
+	uint64_t end;
+	uint32_t i;
+
+	if (size < sizeof(*hdr) ||
+	    hdr->magic != NSS_UBDNS_HOSTSDB_MAGIC ||
+	    hdr->version != NSS_UBDNS_HOSTSDB_VERSION ||
+	    hdr->address_size != sizeof(struct address) ||
+	    hdr->size != size ||
+	    hdr->n_buckets == 0 || (hdr->n_buckets & (hdr->n_buckets - 1)) != 0 ||
+	    hdr->n_buckets > (size - sizeof(*hdr)) / sizeof(*b))
+		return (false);
+
+	for (i = 0; i < hdr->n_buckets; i++) {
+		if (b[i].off == 0)
+			continue;
+		if (b[i].off % 8 != 0 || (uint64_t) b[i].off + sizeof(*rec) > size)
+			return (false);
+		rec = hostsdb_record(hdr, b[i].off);
+		end = (uint64_t) b[i].off + sizeof(*rec) + rec->key_len + 1 + rec->val_len;
+		if (end > size || ((const char *) (rec + 1))[rec->key_len] != '\0')
+			return (false);
+		names_len = hostsdb_names(hostsdb_value(rec), rec->val_len, &names);
+		if (names_len < 0)
+			return (false);
+		if (rec->kind == NSS_UBDNS_HOSTSDB_FORWARD) {
+			if ((rec->val_len - sizeof(uint16_t) - names_len) % sizeof(struct address) != 0)
+				return (false);
+		} else if (rec->kind == NSS_UBDNS_HOSTSDB_REVERSE) {
+			if (names_len == 0 || rec->val_len != names_len + sizeof(uint16_t))
+				return (false);
+		} else {
+			return (false);
+		}
+	}
+	return (true);
+}
+
+static struct nss_ubdns_hostsdb_header *
+hostsdb_map(int fd, size_t size) {
+	void *p;
+
+	if (size < sizeof(struct nss_ubdns_hostsdb_header))
+		return (NULL);
+	p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return (NULL);
+	if (!hostsdb_valid(p, size)) {
+		munmap(p, size);
+		return (NULL);
+	}
+	return (p);
+}
+
+/* Take a reference to the current mapping, or return NULL if there is none. */
+static struct hostsdb_map *
+hostsdb_acquire(void) {
+	struct hostsdb_map *m;
+	unsigned refs;
+
+	for (;;) {
+		m = __atomic_load_n(&hostsdb, __ATOMIC_ACQUIRE);
+		if (m == NULL)
+			return (NULL);
+
+		/* an unused slot may be unmapped at any moment, so read the pointer again */
+		refs = __atomic_load_n(&m->refs, __ATOMIC_RELAXED);
+		while (refs > 0)
+			if (__atomic_compare_exchange_n(&m->refs, &refs, refs + 1, true,
+							__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return (m);
+	}
+}
+
+static void
+hostsdb_release(struct hostsdb_map *m) {
+	__atomic_sub_fetch(&m->refs, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Unmap the mappings that have been replaced and that no lookup is using,
+ * and return a free slot, or NULL if there is none. Called with the lock held.
+ */
+static struct hostsdb_map *
+hostsdb_free_slot(void) {
+	struct hostsdb_map *free_slot = NULL;
+	unsigned i;
+
+	for (i = 0; i < HOSTSDB_MAPS; i++) {
+		if (maps[i].hdr != NULL && __atomic_load_n(&maps[i].refs, __ATOMIC_ACQUIRE) == 0) {
+			munmap(maps[i].hdr, maps[i].hdr->size);
+			maps[i].hdr = NULL;
+		}
+		if (maps[i].hdr == NULL && free_slot == NULL)
+			free_slot = &maps[i];
+	}
+	return (free_slot);
+}
+
+/* Swap in a new mapping, or none, and drop the current one's reference. */
+static void
+hostsdb_swap(struct nss_ubdns_hostsdb_header *hdr, struct hostsdb_map *m) {
+	struct hostsdb_map *old = hostsdb;
+
+	if (hdr != NULL) {
+		m->hdr = hdr;
+		__atomic_store_n(&m->refs, 1, __ATOMIC_RELEASE);
+	} else {
+		m = NULL;
+	}
+	__atomic_store_n(&hostsdb, m, __ATOMIC_RELEASE);
+	if (old != NULL)
+		hostsdb_release(old);
+}
+
+/* See nss_ubdns_hostsdb_check(). Called with the lock held. */
+static void
+hostsdb_update(void) {
+	char path[PATH_MAX];
+	struct hostsdb_map *m;
+	struct stat sb;
+	int fd;
+
+	m = hostsdb_free_slot();
+
+	nss_ubdns_conf_path(path, sizeof(path), NSS_UBDNS_HOSTSDB);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &sb) != 0) {
+		if (fd != -1)
+			close(fd);
+		if (hostsdb != NULL)
+			hostsdb_swap(NULL, NULL);
+		hostsdb_ino = 0;
+		return;
+	}
+
+	/* with every slot still in use, a replacement waits for a later check */
+	if (m != NULL &&
+	    (sb.st_ino != hostsdb_ino || sb.st_dev != hostsdb_dev || sb.st_size != hostsdb_size ||
+	     sb.st_mtim.tv_sec != hostsdb_mtime.tv_sec ||
+	     sb.st_mtim.tv_nsec != hostsdb_mtime.tv_nsec))
+	{
+		hostsdb_swap(hostsdb_map(fd, sb.st_size), m);
+		hostsdb_dev = sb.st_dev;
+		hostsdb_ino = sb.st_ino;
+		hostsdb_size = sb.st_size;
+		hostsdb_mtime = sb.st_mtim;
+	}
+	close(fd);
+}
+
+/* Map hosts.db, if there is one. Called once, before the first lookup. */
+void
+nss_ubdns_hostsdb_init(void) {
+	pthread_mutex_lock(&hostsdb_lock);
+	hostsdb_update();
+	pthread_mutex_unlock(&hostsdb_lock);
+}
+
+/*
+ * Map hosts.db if it has been created or replaced since the last check, and
+ * drop it if it has been removed. Called from nss_ubdns_config_check(), so at
+ * most about once a second.
+ */
+void
+nss_ubdns_hostsdb_check(void) {
+	if (pthread_mutex_trylock(&hostsdb_lock) != 0)
+		return;
+	hostsdb_update();
+	pthread_mutex_unlock(&hostsdb_lock);
+}
+
+/*
+ * Called around fork(), see nss_ubdns_cache_fork(). The mappings are
+ * inherited, but not the lookups of the parent's other threads, so only the
+ * current mapping's own reference is left.
+ */
+void
+nss_ubdns_hostsdb_fork(int phase) {
+	unsigned i;
+
+	if (phase == NSS_UBDNS_FORK_PREPARE) {
+		pthread_mutex_lock(&hostsdb_lock);
+		return;
+	}
+	if (phase == NSS_UBDNS_FORK_CHILD)
+		for (i = 0; i < HOSTSDB_MAPS; i++)
+			maps[i].refs = (&maps[i] == hostsdb);
+	pthread_mutex_unlock(&hostsdb_lock);
+}
+
+static const struct nss_ubdns_hostsdb_record *
+hostsdb_find(const struct nss_ubdns_hostsdb_header *hdr, int kind, const char *key, size_t key_len) {
+	const struct nss_ubdns_hostsdb_bucket *b = hostsdb_buckets(hdr);
+	const struct nss_ubdns_hostsdb_record *rec;
+	uint32_t hash, mask = hdr->n_buckets - 1, i;
+
+	hash = nss_ubdns_qname_hash(key, kind);
+	for (i = 0; i <= mask; i++) {
+		const struct nss_ubdns_hostsdb_bucket *bk = &b[(hash + i) & mask];
+
+		if (bk->off == 0)
+			return (NULL);
+		if (bk->hash != hash)
+			continue;
+		rec = hostsdb_record(hdr, bk->off);
+		if (rec->kind == kind && rec->key_len == key_len &&
+		    memcmp(rec + 1, key, key_len) == 0)
+			return (rec);
+	}
+	return (NULL);
+}
+
+/*
+ * Look up a name in hosts.db. Returns false if it is not there, and true with
+ * its addresses of family af, if any, as described for
+ * nss_ubdns_lookup_forward() otherwise: a name in hosts.db is never looked up
+ * in the DNS.
+ */
+bool
+nss_ubdns_hostsdb_forward(const char *hn, int af, struct address *buf, unsigned buf_n,
+			  struct address **_list, unsigned *_n_list,
+			  char *names, size_t *_names_len, int32_t *ttlp)
+{
+	const struct nss_ubdns_hostsdb_header *hdr;
+	const struct nss_ubdns_hostsdb_record *rec;
+	const struct address *a;
+	struct address *list = buf;
+	struct hostsdb_map *m;
+	char key[NSS_UBDNS_PRESLEN_NAME];
+	unsigned i, n, n_list = 0;
+	const char *rec_names;
+	size_t key_len, names_len;
+
+	if (__atomic_load_n(&hostsdb, __ATOMIC_RELAXED) == NULL)
+		return (false);
+	key_len = nss_ubdns_qname_key(hn, key, sizeof(key));
+	if (key_len == 0)
+		return (false);
+	m = hostsdb_acquire();
+	if (m == NULL)
+		return (false);
+	hdr = m->hdr;
+	rec = hostsdb_find(hdr, NSS_UBDNS_HOSTSDB_FORWARD, key, key_len);
+	if (rec == NULL) {
+		hostsdb_release(m);
+		return (false);
+	}
+
+	names_len = hostsdb_names(hostsdb_value(rec), rec->val_len, &rec_names);
+	a = (const struct address *) hostsdb_value(rec);
+	n = (rec->val_len - sizeof(uint16_t) - names_len) / sizeof(struct address);
+
+	for (i = 0; i < n; i++)
+		if (af == AF_UNSPEC || a[i].family == af)
+			n_list++;
+	if (n_list > buf_n) {
+		list = malloc(n_list * sizeof(struct address));
+		if (list == NULL) {
+			list = buf;
+			n = 0;
+		}
+	}
+	for (i = 0, n_list = 0; i < n; i++)
+		if (af == AF_UNSPEC || a[i].family == af)
+			memcpy(&list[n_list++], &a[i], sizeof(struct address));
+
+	memcpy(names, rec_names, names_len);
+	*_names_len = names_len;
+	*_list = list;
+	*_n_list = n_list;
+	*ttlp = hdr->ttl;
+	hostsdb_release(m);
+	return (true);
+}
+
+/*
+ * Look up an address's arpa qname in hosts.db. Returns 0 if it is not there,
+ * and otherwise as described for nss_ubdns_lookup_reverse().
+ */
+int
+nss_ubdns_hostsdb_reverse(const char *qname, size_t qname_len, char *buf, size_t buf_len,
+			  size_t *_names_len, unsigned *_n_names, int32_t *ttlp)
+{
+	const struct nss_ubdns_hostsdb_record *rec;
+	struct hostsdb_map *m;
+	const char *names;
+	size_t names_len, i;
+	unsigned n_names = 0;
+	int32_t ttl;
+
+	m = hostsdb_acquire();
+	if (m == NULL)
+		return (0);
+	rec = hostsdb_find(m->hdr, NSS_UBDNS_HOSTSDB_REVERSE, qname, qname_len);
+	if (rec == NULL) {
+		hostsdb_release(m);
+		return (0);
+	}
+
+	names_len = hostsdb_names(hostsdb_value(rec), rec->val_len, &names);
+	if (names_len > buf_len) {
+		hostsdb_release(m);
+		return (-1);
+	}
+	memcpy(buf, names, names_len);
+	ttl = m->hdr->ttl;
+	hostsdb_release(m);
+	for (i = 0; i < names_len; i++)
+		if (buf[i] == '\0')
+			n_names++;
+	*_names_len = names_len;
+	*_n_names = n_names;
+	*ttlp = ttl;
+	return (1);
+}
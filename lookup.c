@@ -15,12 +15,13 @@
  */
 
 #include <sys/types.h>
-#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <assert.h>
-#include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
-#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -32,229 +33,2531 @@
 #include <unbound.h>
 
 #include "nss-ubdns.h"
+#include "probes.h"
 
-static struct ub_ctx *ctx = NULL;
+/*
+ * A resolver context and the state used to wait on its async queries.
+ * Lookups hold a reference while they use it, and the current pool holds
+ * one more, so a context that has been replaced by a reload is deleted once
+ * the last lookup using it has finished.
+ */
+struct nss_ubdns_context {
+	struct ub_ctx *ctx;
+	unsigned refs;
+
+	/* serializes ub_process() and delivery of async results to their waiters */
+	pthread_mutex_t wait_lock;
+	pthread_cond_t wait_cond;
+	bool wait_processing;
+
+	/* pipelines that found it busy, to be woken when it isn't */
+	struct nss_ubdns_pipeline **wait_pipelines;
+	unsigned n_wait_pipelines, size_wait_pipelines;
+};
+
+/*
+ * The current pool of identically configured contexts. Each has its own
+ * libunbound worker thread, so lookups that miss every cache don't all queue
+ * up behind one. A name is always resolved by the same context, so that its
+ * answer and the keys that validated it are in that context's caches.
+ */
+#define CONTEXTS_MAX		64
+
+static struct nss_ubdns_context *current[CONTEXTS_MAX];
+static unsigned n_current = 0;
+static pthread_mutex_t ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+static bool ctx_closing = false;
+
+/* configuration change detection, see nss_ubdns_config_check() */
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+static uint64_t config_sig = 0;
+static uint32_t config_shm_generation = 0;
+static int64_t config_checked = 0;
+static bool config_rebuilding = false;
+
+/* module options, reloaded along with the rest of the configuration */
+static struct nss_ubdns_options options;
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;	/* options.search */
+
+static void nss_ubdns_pipeline_check(struct nss_ubdns_lookup *l);
+static void nss_ubdns_pipeline_wake(struct nss_ubdns_pipeline *p);
+
+static struct nss_ubdns_context *
+nss_ubdns_context_new(bool prefetch) {
+	struct nss_ubdns_context *c;
+	pthread_condattr_t attr;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return (NULL);
+
+	c->ctx = prefetch ? nss_ubdns_prefetch_ctx_new() : nss_ubdns_ctx_new();
+	if (c->ctx == NULL) {
+		free(c);
+		return (NULL);
+	}
+	c->refs = 1;
+	pthread_mutex_init(&c->wait_lock, NULL);
+
+	/* waits are bounded by deadlines on the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&c->wait_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return (c);
+}
+
+static void
+nss_ubdns_ctx_release(struct nss_ubdns_context *c) {
+	if (c == NULL || __atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	ub_ctx_delete(c->ctx);
+	pthread_mutex_destroy(&c->wait_lock);
+	pthread_cond_destroy(&c->wait_cond);
+	free(c->wait_pipelines);
+	free(c);
+}
+
+/* Build a pool of as many contexts as configured, and return how many were built. */
+static unsigned
+nss_ubdns_pool_new(struct nss_ubdns_context **pool) {
+	unsigned i, n;
+
+	n = __atomic_load_n(&options.contexts, __ATOMIC_RELAXED);
+	if (n == 0)
+		n = 1;
+	if (n > CONTEXTS_MAX)
+		n = CONTEXTS_MAX;
+
+	for (i = 0; i < n; i++) {
+		pool[i] = nss_ubdns_context_new(false);
+		if (pool[i] == NULL)
+			break;
+	}
+	return (i);
+}
+
+static void
+nss_ubdns_pool_release(struct nss_ubdns_context **pool, unsigned n) {
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		nss_ubdns_ctx_release(pool[i]);
+}
+
+static void nss_ubdns_config_init(void);
+
+static void
+nss_ubdns_init(void) {
+	/* the pool's size is an option */
+	pthread_once(&config_once, nss_ubdns_config_init);
+	n_current = nss_ubdns_pool_new(current);
+}
+
+static void __attribute__((destructor))
+nss_ubdns_finish(void) {
+	struct nss_ubdns_context *pool[CONTEXTS_MAX];
+	unsigned n;
+
+	pthread_mutex_lock(&ctx_lock);
+	ctx_closing = true;
+	n = n_current;
+	memcpy(pool, current, n * sizeof(pool[0]));
+	n_current = 0;
+	pthread_mutex_unlock(&ctx_lock);
+
+	/* if a lookup is still using a context, it deletes it when done */
+	nss_ubdns_pool_release(pool, n);
+}
+
+/*
+ * The contexts are created by the first lookup rather than when the module is
+ * loaded, so that processes which never resolve a name don't pay for them.
+ * hash picks the context, see nss_ubdns_qname_hash().
+ */
+static struct nss_ubdns_context *
+nss_ubdns_ctx_acquire(uint32_t hash) {
+	struct nss_ubdns_context *c = NULL, *fresh = NULL;
+
+	pthread_once(&ctx_once, nss_ubdns_init);
+
+	pthread_mutex_lock(&ctx_lock);
+	while (n_current > 0) {
+		c = current[hash % n_current];
+		if (c == NULL && fresh != NULL) {
+			c = current[hash % n_current] = fresh;
+			fresh = NULL;
+		}
+		if (c != NULL) {
+			__atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+			break;
+		}
+
+		/*
+		 * One the child of a fork() has not built yet. Building it
+		 * reads the configuration and the trust anchors, so do that
+		 * without holding the lock every lookup takes, then look again:
+		 * the pool may have been replaced meanwhile.
+		 */
+		pthread_mutex_unlock(&ctx_lock);
+		fresh = nss_ubdns_context_new(false);
+		pthread_mutex_lock(&ctx_lock);
+		if (fresh == NULL)
+			break;
+	}
+	pthread_mutex_unlock(&ctx_lock);
+
+	/* another thread installed one first */
+	nss_ubdns_ctx_release(fresh);
+	return (c);
+}
+
+/* Start a detached helper thread, which the application's signals must not reach. */
+static bool
+nss_ubdns_thread_start(void *(*fn)(void *), void *arg) {
+	sigset_t all, old;
+	pthread_attr_t attr;
+	pthread_t thr;
+	int ret;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thr, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return (ret == 0);
+}
+
+static void
+nss_ubdns_ms_timespec(int64_t ms, struct timespec *ts) {
+	ts->tv_sec = ms / 1000;
+	ts->tv_nsec = (ms % 1000) * 1000000;
+}
+
+static void *
+nss_ubdns_rebuild(void *arg) {
+	struct nss_ubdns_context *pool[CONTEXTS_MAX], *old[CONTEXTS_MAX];
+	unsigned n, n_old = 0;
+
+	(void) arg;
+
+	n = nss_ubdns_pool_new(pool);
+	if (n > 0) {
+		pthread_mutex_lock(&ctx_lock);
+		if (!ctx_closing) {
+			n_old = n_current;
+			memcpy(old, current, n_old * sizeof(old[0]));
+			memcpy(current, pool, n * sizeof(pool[0]));
+			n_current = n;
+			n = 0;
+		}
+		pthread_mutex_unlock(&ctx_lock);
+
+		/* anything cached until now came from the old contexts */
+		nss_ubdns_cache_flush();
+	}
+	nss_ubdns_pool_release(old, n_old);
+	nss_ubdns_pool_release(pool, n);
+
+	__atomic_store_n(&config_rebuilding, false, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
+/* Load the options and the search list of the configuration whose signature is sig. */
+static void
+nss_ubdns_config_load(uint64_t sig) {
+	struct nss_ubdns_options opts;
+
+	__atomic_store_n(&config_sig, sig, __ATOMIC_RELAXED);
+	nss_ubdns_shmcache_set_config(sig);
+
+	nss_ubdns_options_load(&opts);
+	__atomic_store_n(&options.deadline, opts.deadline, __ATOMIC_RELAXED);
+	__atomic_store_n(&options.serve_stale, opts.serve_stale, __ATOMIC_RELAXED);
+	__atomic_store_n(&options.stale_ttl, opts.stale_ttl, __ATOMIC_RELAXED);
+	__atomic_store_n(&options.stale_threshold, opts.stale_threshold, __ATOMIC_RELAXED);
+	__atomic_store_n(&options.contexts, opts.contexts, __ATOMIC_RELAXED);
+	nss_ubdns_cache_set_prefetch(opts.prefetch_hits);
+	pthread_mutex_lock(&search_lock);
+	memcpy(options.search, opts.search, sizeof(options.search));
+	__atomic_store_n(&options.n_search, opts.n_search, __ATOMIC_RELAXED);
+	__atomic_store_n(&options.ndots, opts.ndots, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&search_lock);
+}
+
+/*
+ * The first lookup loads the configuration before it or any other lookup
+ * reads it, and the rest wait for it to finish. Only the checks for changes
+ * that follow are rate-limited.
+ */
+static void
+nss_ubdns_config_init(void) {
+	nss_ubdns_hostsdb_init();
+	config_shm_generation = nss_ubdns_shmcache_generation();
+	nss_ubdns_config_load(nss_ubdns_config_signature());
+	__atomic_store_n(&config_checked, nss_ubdns_now(), __ATOMIC_RELAXED);
+}
+
+/*
+ * libunbound can't be reconfigured once it has resolved anything, so a
+ * change to resolv.conf, the trust anchors or libunbound.conf is handled by
+ * building a new pool of contexts in the background and swapping it in.
+ * Lookups keep using the old pool until then, and the front cache is flushed
+ * once the new one is in place. At most one thread per second looks for
+ * changes.
+ */
+static void
+nss_ubdns_config_check(void) {
+	int64_t now, checked;
+	uint64_t sig;
+	uint32_t gen;
+
+	pthread_once(&config_once, nss_ubdns_config_init);
+
+	now = nss_ubdns_now();
+	checked = __atomic_load_n(&config_checked, __ATOMIC_RELAXED);
+	if (checked >= now ||
+	    !__atomic_compare_exchange_n(&config_checked, &checked, now, false,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+
+	nss_ubdns_hostsdb_check();
+
+	/* answers from nss-ubdns-cached are withdrawn when it reloads */
+	gen = nss_ubdns_shmcache_generation();
+	if (gen != config_shm_generation) {
+		config_shm_generation = gen;
+		nss_ubdns_cache_flush();
+	}
+
+	sig = nss_ubdns_config_signature();
+	if (sig == __atomic_load_n(&config_sig, __ATOMIC_RELAXED))
+		return;
+	nss_ubdns_config_load(sig);
+
+	/* nothing to rebuild if no context has been created yet */
+	pthread_mutex_lock(&ctx_lock);
+	if (n_current == 0) {
+		pthread_mutex_unlock(&ctx_lock);
+		nss_ubdns_cache_flush();
+		return;
+	}
+	if (__atomic_load_n(&config_rebuilding, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_unlock(&ctx_lock);
+		return;
+	}
+	config_rebuilding = true;
+	pthread_mutex_unlock(&ctx_lock);
+
+	if (!nss_ubdns_thread_start(nss_ubdns_rebuild, NULL))
+		__atomic_store_n(&config_rebuilding, false, __ATOMIC_RELEASE);
+}
+
+static bool
+nss_ubdns_check_result(const struct ub_result *res) {
+	if (res->havedata == 0)
+		return (false);
+
+	if (res->bogus)
+		return (false);
+
+	return (true);
+}
+
+static void
+nss_ubdns_callback(void *mydata, int err, struct ub_result *res) {
+	struct nss_ubdns_query *q = mydata;
+	struct nss_ubdns_context *c = q->context;
+
+	pthread_mutex_lock(&c->wait_lock);
+	q->err = err;
+	q->res = res;
+	q->done = true;
+	if (q->lookup != NULL)
+		nss_ubdns_pipeline_check(q->lookup);
+	pthread_mutex_unlock(&c->wait_lock);
+}
+
+static bool
+nss_ubdns_queries_done(struct nss_ubdns_query *q, unsigned n_q) {
+	unsigned i;
+
+	for (i = 0; i < n_q; i++)
+		if (!q[i].done)
+			return (false);
+	return (true);
+}
+
+/*
+ * Give up on the queries that have not completed, which fail with err. A
+ * query that libunbound no longer knows about is being delivered by
+ * ub_process() right now, and will be done as soon as we release the wait
+ * lock. Called with the wait lock held.
+ */
+static void
+nss_ubdns_cancel(struct nss_ubdns_context *c, struct nss_ubdns_query *q, unsigned n_q, int err) {
+	unsigned i;
+
+	for (i = 0; i < n_q; i++) {
+		if (q[i].done || ub_cancel(c->ctx, q[i].async_id) != 0)
+			continue;
+		q[i].err = err;
+		q[i].done = true;
+	}
+}
+
+/* Let the others use ub_process() again. Called with the wait lock held. */
+static void
+nss_ubdns_processing_done(struct nss_ubdns_context *c) {
+	unsigned i;
+
+	c->wait_processing = false;
+	pthread_cond_broadcast(&c->wait_cond);
+	for (i = 0; i < c->n_wait_pipelines; i++)
+		nss_ubdns_pipeline_wake(c->wait_pipelines[i]);
+	c->n_wait_pipelines = 0;
+}
+
+/*
+ * Wait for a set of async queries to complete, or until the deadline passes
+ * if there is one. ub_process() may deliver results belonging to any thread,
+ * so only one waiter at a time polls the context's fd and calls ub_process(),
+ * and the others sleep until it has finished a round.
+ */
+static void
+nss_ubdns_wait(struct nss_ubdns_context *c, struct nss_ubdns_query *q, unsigned n_q,
+	       int64_t deadline)
+{
+	struct pollfd pfd;
+	struct timespec ts;
+	int64_t timeout = -1;
+
+	pthread_mutex_lock(&c->wait_lock);
+	while (!nss_ubdns_queries_done(q, n_q)) {
+		if (deadline != 0) {
+			timeout = deadline - nss_ubdns_now_ms();
+			if (timeout <= 0) {
+				nss_ubdns_cancel(c, q, n_q, NSS_UBDNS_ERR_TIMEOUT);
+				deadline = 0;
+				timeout = -1;
+				continue;
+			}
+		}
+		if (c->wait_processing) {
+			if (deadline == 0) {
+				pthread_cond_wait(&c->wait_cond, &c->wait_lock);
+			} else {
+				nss_ubdns_ms_timespec(deadline, &ts);
+				pthread_cond_timedwait(&c->wait_cond, &c->wait_lock, &ts);
+			}
+			continue;
+		}
+		c->wait_processing = true;
+		pthread_mutex_unlock(&c->wait_lock);
+
+		pfd.fd = ub_fd(c->ctx);
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout) > 0)
+			ub_process(c->ctx);
+
+		pthread_mutex_lock(&c->wait_lock);
+		nss_ubdns_processing_done(c);
+	}
+	pthread_mutex_unlock(&c->wait_lock);
+}
+
+/*
+ * Start resolving one or more rrtypes for the same name, see nss_ubdns_wait().
+ * l is the pipelined lookup they belong to, if any.
+ */
+static void
+nss_ubdns_resolve_start(struct nss_ubdns_context *c, const char *hn,
+			struct nss_ubdns_query *q, unsigned n_q, struct nss_ubdns_lookup *l)
+{
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < n_q; i++) {
+		q[i].err = 0;
+		q[i].done = false;
+		q[i].cached = false;
+		q[i].res = NULL;
+		q[i].context = c;
+		q[i].lookup = l;
+
+		ret = ub_resolve_async(c->ctx, (char *) hn, q[i].rrtype, 1 /*IN*/,
+				       &q[i], nss_ubdns_callback, &q[i].async_id);
+		if (ret != 0) {
+			q[i].err = ret;
+			q[i].done = true;
+		}
+	}
+}
+
+/*
+ * Resolve one or more rrtypes for the same name concurrently. On return,
+ * every query has either err != 0 or a result which must be freed by the
+ * caller.
+ */
+static void
+nss_ubdns_resolve_parallel(struct nss_ubdns_context *c, const char *hn,
+			   struct nss_ubdns_query *q, unsigned n_q, int64_t deadline)
+{
+	nss_ubdns_resolve_start(c, hn, q, n_q, NULL);
+	nss_ubdns_wait(c, q, n_q, deadline);
+}
+
+/*
+ * Resolve the queries through nss-ubdns-cached if it is running, otherwise
+ * in-process. On return, every query has either err != 0 or a result which
+ * must be released with nss_ubdns_query_free(). Queries still unanswered at
+ * the deadline fail with NSS_UBDNS_ERR_TIMEOUT.
+ */
+static void
+nss_ubdns_resolve_uncached(const char *qname, struct nss_ubdns_query *q, unsigned n_q,
+			   int64_t deadline)
+{
+	struct nss_ubdns_context *c;
+	char key[NSS_UBDNS_PRESLEN_NAME];
+	unsigned i;
+
+	if (nss_ubdns_cached_resolve(qname, q, n_q, deadline, false) == 0)
+		return;
+
+	/* the same name always goes to the same context, whatever its case */
+	if (nss_ubdns_qname_key(qname, key, sizeof(key)) == 0)
+		key[0] = '\0';
+	c = nss_ubdns_ctx_acquire(nss_ubdns_qname_hash(key, 0));
+	if (c == NULL) {
+		for (i = 0; i < n_q; i++) {
+			q[i].err = UB_INITFAIL;
+			q[i].done = true;
+			q[i].cached = false;
+			q[i].res = NULL;
+		}
+		return;
+	}
+
+	/*
+	 * Even a single query is resolved asynchronously, since ub_resolve()
+	 * can't be interrupted when the deadline passes.
+	 */
+	nss_ubdns_resolve_parallel(c, qname, q, n_q, deadline);
+
+	nss_ubdns_ctx_release(c);
+}
+
+/*
+ * Single-flight: concurrent lookups of the same (qname, rrtype) within the
+ * process are coalesced, so that when a popular name expires only the first
+ * thread to ask resolves it and the others copy its answer. A flight lives
+ * on its leader's stack and is published in a small hash table until the
+ * answer is in; the leader then waits for its followers to take their
+ * copies before returning. Followers share the leader's fate, including a
+ * timeout at its deadline, which comes no later than their own.
+ */
+#define FLIGHT_BUCKETS		64
+
+struct flight {
+	struct flight *next;
+	uint32_t hash;
+	int rrtype;
+	const char *key;
+	bool done;
+	unsigned waiters;
+	const struct nss_ubdns_query *q;	/* the leader's answer, once done */
+};
+
+static struct flight_bucket {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct flight *head;
+} __attribute__((aligned(64))) flights[FLIGHT_BUCKETS] = {
+	[0 ... FLIGHT_BUCKETS - 1] = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	},
+};
+
+static struct flight *
+nss_ubdns_flight_join(struct flight_bucket *b, uint32_t hash, const char *key, int rrtype) {
+	struct flight *f;
+
+	for (f = b->head; f != NULL; f = f->next) {
+		if (f->hash == hash && f->rrtype == rrtype && !f->done &&
+		    strcmp(f->key, key) == 0)
+		{
+			f->waiters++;
+			return (f);
+		}
+	}
+	return (NULL);
+}
+
+static void
+nss_ubdns_flight_copy(const struct nss_ubdns_query *src, struct nss_ubdns_query *q) {
+	q->err = src->err;
+	q->res = NULL;
+	q->cached = true;
+	q->done = true;
+	if (q->err == 0) {
+		q->res = nss_ubdns_result_copy(src->res);
+		if (q->res == NULL)
+			q->err = UB_NOMEM;
+	}
+}
+
+static void
+nss_ubdns_resolve_coalesced(const char *qname, struct nss_ubdns_query *q, unsigned n_q,
+			    int64_t deadline)
+{
+	char key[NSS_UBDNS_PRESLEN_NAME];
+	struct flight own[n_q], *joined[n_q];
+	struct nss_ubdns_query lead[n_q];
+	struct flight_bucket *b;
+	unsigned i, n_lead = 0;
+	uint32_t hash;
+
+	if (nss_ubdns_qname_key(qname, key, sizeof(key)) == 0) {
+		nss_ubdns_resolve_uncached(qname, q, n_q, deadline);
+		return;
+	}
+
+	for (i = 0; i < n_q; i++) {
+		hash = nss_ubdns_qname_hash(key, q[i].rrtype);
+		b = &flights[hash % FLIGHT_BUCKETS];
+
+		pthread_mutex_lock(&b->lock);
+		joined[i] = nss_ubdns_flight_join(b, hash, key, q[i].rrtype);
+		if (joined[i] == NULL) {
+			own[i] = (struct flight) {
+				.next = b->head,
+				.hash = hash,
+				.rrtype = q[i].rrtype,
+				.key = key,
+			};
+			b->head = &own[i];
+			lead[n_lead++] = q[i];
+		}
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	if (n_lead > 0)
+		nss_ubdns_resolve_uncached(qname, lead, n_lead, deadline);
+
+	/* publish our answers before waiting for anyone else's */
+	for (i = 0, n_lead = 0; i < n_q; i++) {
+		struct flight **pp;
+
+		if (joined[i] != NULL)
+			continue;
+		q[i] = lead[n_lead++];
+
+		b = &flights[own[i].hash % FLIGHT_BUCKETS];
+		pthread_mutex_lock(&b->lock);
+		for (pp = &b->head; *pp != &own[i]; pp = &(*pp)->next)
+			;
+		*pp = own[i].next;
+		own[i].q = &q[i];
+		own[i].done = true;
+		pthread_cond_broadcast(&b->cond);
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	for (i = 0; i < n_q; i++) {
+		struct flight *f = joined[i];
+
+		if (f == NULL)
+			continue;
+
+		b = &flights[f->hash % FLIGHT_BUCKETS];
+		pthread_mutex_lock(&b->lock);
+		while (!f->done)
+			pthread_cond_wait(&b->cond, &b->lock);
+		nss_ubdns_flight_copy(f->q, &q[i]);
+		if (--f->waiters == 0)
+			pthread_cond_broadcast(&b->cond);
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	for (i = 0; i < n_q; i++) {
+		if (joined[i] != NULL)
+			continue;
+
+		b = &flights[own[i].hash % FLIGHT_BUCKETS];
+		pthread_mutex_lock(&b->lock);
+		while (own[i].waiters > 0)
+			pthread_cond_wait(&b->cond, &b->lock);
+		pthread_mutex_unlock(&b->lock);
+	}
+}
+
+/* Count resolved queries and how they were answered. */
+static void
+nss_ubdns_count_queries(const struct nss_ubdns_query *q, unsigned n_q) {
+	struct nss_ubdns_stats *s = nss_ubdns_stats();
+	unsigned i;
+
+	for (i = 0; i < n_q; i++) {
+		if (q[i].rrtype == NSS_UBDNS_TYPE_A)
+			nss_ubdns_stat_add(&s->queries[NSS_UBDNS_STAT_A], 1);
+		else if (q[i].rrtype == NSS_UBDNS_TYPE_AAAA)
+			nss_ubdns_stat_add(&s->queries[NSS_UBDNS_STAT_AAAA], 1);
+		else if (q[i].rrtype == NSS_UBDNS_TYPE_PTR)
+			nss_ubdns_stat_add(&s->queries[NSS_UBDNS_STAT_PTR], 1);
+
+		if (q[i].err != 0) {
+			if (q[i].err != NSS_UBDNS_ERR_TIMEOUT && q[i].err != NSS_UBDNS_ERR_CANCELLED)
+				nss_ubdns_stat_add(&s->errors, 1);
+		} else if (q[i].res->bogus) {
+			nss_ubdns_stat_add(&s->bogus, 1);
+		} else if (q[i].res->nxdomain) {
+			nss_ubdns_stat_add(&s->nxdomain, 1);
+		} else if (q[i].res->rcode == 2) {
+			nss_ubdns_stat_add(&s->servfail, 1);
+		}
+	}
+}
+
+/* Report and count the answers to a name's queries. */
+static void
+nss_ubdns_resolve_done(const char *qname, const struct nss_ubdns_query *q, unsigned n_q) {
+	unsigned i;
+
+	for (i = 0; i < n_q; i++) {
+		NSS_UBDNS_PROBE5(resolve__done, qname, q[i].rrtype, q[i].err,
+				 q[i].err == 0 ? q[i].res->rcode : -1);
+		if (q[i].err == 0)
+			NSS_UBDNS_PROBE6(validate, qname, q[i].rrtype, q[i].res->secure, q[i].res->bogus,
+					 q[i].res->why_bogus != NULL ? q[i].res->why_bogus : "");
+	}
+	nss_ubdns_count_queries(q, n_q);
+}
+
+/* As above, but answer what we can from the shared cache first. */
+static void
+nss_ubdns_resolve(const char *qname, struct nss_ubdns_query *q, unsigned n_q, int64_t deadline) {
+	struct nss_ubdns_query miss[n_q];
+	unsigned i, n_miss = 0;
+
+	for (i = 0; i < n_q; i++) {
+		NSS_UBDNS_PROBE3(resolve__start, qname, q[i].rrtype);
+		q[i].res = NULL;
+		q[i].done = false;
+		q[i].cached = false;
+		if (nss_ubdns_shmcache_lookup(qname, &q[i]) != 0)
+			miss[n_miss++] = q[i];
+	}
+	if (n_miss < n_q)
+		nss_ubdns_stat_add(&nss_ubdns_stats()->shm_hits, n_q - n_miss);
+
+	if (n_miss == n_q) {
+		nss_ubdns_resolve_coalesced(qname, q, n_q, deadline);
+	} else if (n_miss > 0) {
+		nss_ubdns_resolve_coalesced(qname, miss, n_miss, deadline);
+		for (i = 0, n_miss = 0; i < n_q; i++)
+			if (!q[i].done)
+				q[i] = miss[n_miss++];
+	}
+
+	nss_ubdns_resolve_done(qname, q, n_q);
+}
+
+/* When a lookup starting now must give up, or 0 if it never does. */
+static int64_t
+nss_ubdns_deadline(void) {
+	unsigned ms = __atomic_load_n(&options.deadline, __ATOMIC_RELAXED);
+
+	return (ms == 0 ? 0 : nss_ubdns_now_ms() + ms);
+}
+
+static bool
+nss_ubdns_timed_out(const struct nss_ubdns_query *q, unsigned n_q) {
+	unsigned i;
+
+	for (i = 0; i < n_q; i++)
+		if (q[i].err == NSS_UBDNS_ERR_TIMEOUT)
+			return (true);
+	return (false);
+}
+
+static void
+nss_ubdns_query_free(struct nss_ubdns_query *q) {
+	if (q->res == NULL)
+		return;
+	if (q->cached)
+		free(q->res);
+	else
+		ub_resolve_free(q->res);
+	q->res = NULL;
+}
+
+/*
+ * Fold one answer into the TTL reported to the caller: the minimum over all
+ * answers, including validated negative ones, since a name that has no AAAA
+ * records now may gain some once the negative answer expires. Answers that
+ * failed to resolve or validate must not be cached at all.
+ */
+static void
+nss_ubdns_min_ttl(int32_t *ttl, const struct nss_ubdns_query *q) {
+	int32_t t = 0;
+
+	if (q->err == 0 && !q->res->bogus && (q->res->rcode == 0 || q->res->nxdomain))
+		t = q->res->ttl > 0 ? q->res->ttl : 0;
+
+	if (*ttl < 0 || t < *ttl)
+		*ttl = t;
+}
+
+static unsigned
+nss_ubdns_count_addresses(const struct ub_result *res, int af) {
+	unsigned i, n = 0;
+
+	if (!nss_ubdns_check_result(res))
+		return (0);
+
+	for (i = 0; res->data[i] != NULL; i++)
+		if (res->len[i] == (int) PROTO_ADDRESS_SIZE(af))
+			n++;
+	return (n);
+}
+
+static unsigned
+nss_ubdns_add_addresses(struct address *list, const struct ub_result *res, int af) {
+	unsigned i, n = 0;
+
+	if (!nss_ubdns_check_result(res))
+		return (0);
+
+	for (i = 0; res->data[i] != NULL; i++) {
+		if (res->len[i] == (int) PROTO_ADDRESS_SIZE(af)) {
+			list[n].family = af;
+			list[n].scope = 0;
+			memcpy(list[n].address, res->data[i], PROTO_ADDRESS_SIZE(af));
+			n++;
+		}
+	}
+	return (n);
+}
+
+static bool
+nss_ubdns_any_bogus(const struct nss_ubdns_query *q, unsigned n_q) {
+	unsigned i;
+
+	for (i = 0; i < n_q; i++)
+		if (q[i].err == 0 && q[i].res->bogus)
+			return (true);
+	return (false);
+}
+
+/* Set up the queries for a lookup of the given kind, and return their number. */
+static unsigned
+nss_ubdns_queries_init(int kind, struct nss_ubdns_query *q) {
+	unsigned n_q = 0;
+
+	if (kind == NSS_UBDNS_CACHE_PTR)
+		q[n_q++].rrtype = NSS_UBDNS_TYPE_PTR;
+	if (kind == AF_INET || kind == AF_UNSPEC)
+		q[n_q++].rrtype = NSS_UBDNS_TYPE_A;
+	if (kind == AF_INET6 || kind == AF_UNSPEC)
+		q[n_q++].rrtype = NSS_UBDNS_TYPE_AAAA;
+	return (n_q);
+}
+
+/*
+ * A forward lookup's result is cached as its addresses, then the names of its
+ * CNAME chain, then the uint16_t length of the names.
+ */
+static void
+nss_ubdns_forward_put(int af, const char *key, size_t key_len,
+		      const struct address *list, unsigned n_list,
+		      const char *names, size_t names_len, int32_t ttl)
+{
+	uint8_t stack[NSS_UBDNS_ADDRESSES_STACK * sizeof(struct address) + NSS_UBDNS_NAMES_MAX + 2];
+	size_t len = n_list * sizeof(struct address) + names_len + sizeof(uint16_t);
+	uint16_t n = names_len;
+	uint8_t *val = stack;
+
+	if (len > sizeof(stack) && (val = malloc(len)) == NULL)
+		return;
+	memcpy(val, list, n_list * sizeof(struct address));
+	memcpy(val + n_list * sizeof(struct address), names, names_len);
+	memcpy(val + len - sizeof(n), &n, sizeof(n));
+	nss_ubdns_cache_put(af, key, key_len, val, len, ttl);
+	if (val != stack)
+		free(val);
+}
+
+/* Split a cached forward result, see above, and return the number of addresses. */
+static unsigned
+nss_ubdns_forward_get(const struct address *list, size_t val_len, char *names, size_t *_names_len) {
+	uint16_t n;
+
+	memcpy(&n, (const uint8_t *) list + val_len - sizeof(n), sizeof(n));
+	val_len -= sizeof(n) + n;
+	memcpy(names, (const uint8_t *) list + val_len, n);
+	*_names_len = n;
+	return (val_len / sizeof(struct address));
+}
+
+/*
+ * Turn the answers to a forward lookup's queries into its result, see
+ * nss_ubdns_lookup_forward(), cache it and free the answers. key is the
+ * name's cache key, or empty if it has none.
+ */
+static int
+nss_ubdns_forward_answer(int af, const char *key, size_t key_len,
+			 struct nss_ubdns_query *q, unsigned n_q,
+			 struct address *buf, unsigned buf_n,
+			 struct address **_list, unsigned *_n_list,
+			 char *names, size_t *_names_len, int32_t *ttlp)
+{
+	struct address *list = buf;
+	unsigned n_list = 0;
+	unsigned i, n_ok, n_names;
+	size_t names_len = 0;
+	int32_t ttl = -1;
+	int r = 1;
+
+	/* a partial answer would look like the name has fewer addresses */
+	if (nss_ubdns_timed_out(q, n_q)) {
+		for (i = 0; i < n_q; i++)
+			nss_ubdns_query_free(&q[i]);
+		*_list = buf;
+		*_n_list = 0;
+		*_names_len = 0;
+		*ttlp = 0;
+		return (NSS_UBDNS_TIMEDOUT);
+	}
+
+	/* an answer that fails validation must not be served stale either */
+	if (key_len > 0 && nss_ubdns_any_bogus(q, n_q))
+		nss_ubdns_cache_drop(af, key, key_len);
+
+	/* size the list before copying anything into it */
+	for (n_ok = 0; n_ok < n_q; n_ok++) {
+		nss_ubdns_min_ttl(&ttl, &q[n_ok]);
+		if (q[n_ok].err != 0) {
+			r = 0;
+			break;
+		}
+		n_list += nss_ubdns_count_addresses(q[n_ok].res,
+			q[n_ok].rrtype == NSS_UBDNS_TYPE_A ? AF_INET : AF_INET6);
+	}
+
+	if (n_list > buf_n) {
+		list = malloc(n_list * sizeof(struct address));
+		if (list == NULL) {
+			list = buf;
+			n_list = 0;
+			n_ok = 0;
+			r = 0;
+		}
+	}
+
+	for (i = 0, n_list = 0; i < n_ok; i++)
+		n_list += nss_ubdns_add_addresses(list + n_list, q[i].res,
+			q[i].rrtype == NSS_UBDNS_TYPE_A ? AF_INET : AF_INET6);
+
+	/* the A and AAAA answers follow the same chain */
+	for (i = 0; i < n_ok && names_len == 0; i++)
+		names_len = nss_ubdns_result_names(q[i].res, names, NSS_UBDNS_NAMES_MAX, &n_names);
+
+	for (i = 0; i < n_q; i++)
+		nss_ubdns_query_free(&q[i]);
+
+	/* ttl is 0 unless every answer was validated, negative or not */
+	if (r == 1 && key_len > 0)
+		nss_ubdns_forward_put(af, key, key_len, list, n_list, names, names_len, ttl);
+
+	*_list = list;
+	*_n_list = n_list;
+	*_names_len = names_len;
+	*ttlp = ttl > 0 ? ttl : 0;
+
+	return r;
+}
+
+/* Resolve the addresses of a name and cache them. */
+static int
+nss_ubdns_resolve_forward(const char *hn, int af, const char *key, size_t key_len,
+			  struct address *buf, unsigned buf_n,
+			  struct address **_list, unsigned *_n_list,
+			  char *names, size_t *_names_len, int32_t *ttlp)
+{
+	struct nss_ubdns_query q[2];
+	unsigned n_q;
+
+	n_q = nss_ubdns_queries_init(af, q);
+	nss_ubdns_resolve(hn, q, n_q, nss_ubdns_deadline());
+
+	return (nss_ubdns_forward_answer(af, key, key_len, q, n_q, buf, buf_n,
+					 _list, _n_list, names, _names_len, ttlp));
+}
+
+/*
+ * Turn the answer to a reverse lookup's query into its result, see
+ * nss_ubdns_lookup_reverse(), cache it and free the answer.
+ */
+static int
+nss_ubdns_reverse_answer(const char *qname, size_t qname_len, struct nss_ubdns_query *q,
+			 char *buf, size_t buf_len,
+			 size_t *_names_len, unsigned *_n_names, int32_t *ttlp)
+{
+	struct ub_result *res;
+	size_t names_len = 0, i;
+	unsigned n_names = 0;
+	int r = 0;
+
+	if (nss_ubdns_timed_out(q, 1)) {
+		*ttlp = 0;
+		return (NSS_UBDNS_TIMEDOUT);
+	}
+	if (nss_ubdns_any_bogus(q, 1))
+		nss_ubdns_cache_drop(NSS_UBDNS_CACHE_PTR, qname, qname_len);
+
+	*ttlp = -1;
+	nss_ubdns_min_ttl(ttlp, q);
+
+	res = q->res;
+	if (q->err == 0 && nss_ubdns_check_result(res)) {
+		for (i = 0; res->data[i] != NULL; i++) {
+			const uint8_t *rdata = (const uint8_t *) res->data[i];
+			size_t size;
+
+			if (res->len[i] == 0)
+				continue;
+			size = domain_to_str_size(rdata, res->len[i]);
+			if (size > buf_len - names_len) {
+				r = -1;
+				break;
+			}
+			domain_to_str(rdata, res->len[i], buf + names_len);
+			names_len += size;
+			n_names++;
+		}
+	}
+	nss_ubdns_query_free(q);
+
+	if (r == 0) {
+		r = (n_names > 0);
+		if (*ttlp > 0)
+			nss_ubdns_cache_put(NSS_UBDNS_CACHE_PTR, qname, qname_len,
+					    buf, names_len, *ttlp);
+	}
+
+	*_names_len = names_len;
+	*_n_names = n_names;
+	return (r);
+}
+
+/* Resolve the names of an address and cache them. */
+static int
+nss_ubdns_resolve_reverse(const char *qname, size_t qname_len, char *buf, size_t buf_len,
+			  size_t *_names_len, unsigned *_n_names, int32_t *ttlp)
+{
+	struct nss_ubdns_query q = { .rrtype = NSS_UBDNS_TYPE_PTR };
+
+	nss_ubdns_resolve(qname, &q, 1, nss_ubdns_deadline());
+
+	return (nss_ubdns_reverse_answer(qname, qname_len, &q, buf, buf_len,
+					 _names_len, _n_names, ttlp));
+}
+
+/*
+ * Serve-stale (RFC 8767). When a cached answer has expired, the lookup
+ * refreshes it in a background thread and waits for at most stale-threshold
+ * milliseconds. If the refresh fails or is still running by then, the expired
+ * answer is returned with a TTL of stale-ttl seconds instead, for up to
+ * serve-stale seconds after it expired, and the refresh carries on and caches
+ * its answer when it arrives. After a failed refresh no other is started for
+ * stale-ttl seconds, and lookups meanwhile get the stale answer straight
+ * away. An answer that comes back bogus removes the expired one from the
+ * cache, so it is never papered over.
+ */
+#define REFRESH_BUCKETS		64
+#define REFRESH_THREADS		16	/* refreshes running at once */
+
+struct refresh {
+	struct refresh *next;
+	uint32_t hash;
+	int kind;
+	unsigned refs;		/* the table, the refresh thread and waiters */
+	bool linked;
+	bool done;
+	int64_t wait_until;	/* ms: lookups wait for the refresh until then */
+	int64_t retry;		/* ms: after a failure, when to try again */
+	size_t key_len;
+	char key[];		/* NUL terminated */
+};
+
+static struct refresh *refreshes[REFRESH_BUCKETS];
+static unsigned refresh_threads = 0;
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_cond;
+static pthread_once_t refresh_once = PTHREAD_ONCE_INIT;
+
+static void
+nss_ubdns_refresh_init(void) {
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&refresh_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/* Called with refresh_lock held. */
+static void
+nss_ubdns_refresh_release(struct refresh *rf) {
+	if (--rf->refs == 0)
+		free(rf);
+}
+
+static void
+nss_ubdns_refresh_unlink(struct refresh **pp) {
+	struct refresh *rf = *pp;
+
+	*pp = rf->next;
+	rf->linked = false;
+	nss_ubdns_refresh_release(rf);
+}
+
+static void *
+nss_ubdns_refresh_run(void *arg) {
+	struct refresh *rf = arg;
+	struct refresh **pp;
+	int32_t ttl = 0;
+	bool fresh;
+	int r;
+
+	if (rf->kind == NSS_UBDNS_CACHE_PTR) {
+		char names[NSS_UBDNS_CACHED_MAXMSG];
+		size_t names_len;
+		unsigned n_names;
+
+		r = nss_ubdns_resolve_reverse(rf->key, rf->key_len, names, sizeof(names),
+					      &names_len, &n_names, &ttl);
+		fresh = (r >= 0 && ttl > 0);
+	} else {
+		struct address buf[NSS_UBDNS_ADDRESSES_STACK], *list;
+		char names[NSS_UBDNS_NAMES_MAX];
+		size_t names_len;
+		unsigned n_list;
+
+		r = nss_ubdns_resolve_forward(rf->key, rf->kind, rf->key, rf->key_len,
+					      buf, NSS_UBDNS_ADDRESSES_STACK, &list, &n_list,
+					      names, &names_len, &ttl);
+		if (list != buf)
+			free(list);
+		fresh = (r == 1 && ttl > 0);
+	}
+
+	pthread_mutex_lock(&refresh_lock);
+	rf->done = true;
+	if (fresh && rf->linked) {
+		/* the answer is cached, and its expiry will start a new refresh */
+		for (pp = &refreshes[rf->hash % REFRESH_BUCKETS]; *pp != rf; pp = &(*pp)->next)
+			;
+		nss_ubdns_refresh_unlink(pp);
+	} else {
+		rf->retry = nss_ubdns_now_ms() +
+			__atomic_load_n(&options.stale_ttl, __ATOMIC_RELAXED) * 1000LL;
+	}
+	refresh_threads--;
+	pthread_cond_broadcast(&refresh_cond);
+	nss_ubdns_refresh_release(rf);
+	pthread_mutex_unlock(&refresh_lock);
+
+	return (NULL);
+}
+
+/*
+ * Answer from an expired cache entry, as described above. Returns false if
+ * there is none, or if the refresh's fresh answer could not be cached, and
+ * the lookup should resolve as usual.
+ */
+static bool
+nss_ubdns_stale_get(int kind, const char *key, size_t key_len, void *buf, size_t buf_len,
+		    void **val, size_t *val_len, int32_t *ttl)
+{
+	int64_t max_stale, now, until, deadline;
+	struct refresh **pp, *rf;
+	struct timespec ts;
+	uint32_t hash;
+
+	max_stale = __atomic_load_n(&options.serve_stale, __ATOMIC_RELAXED);
+	if (max_stale == 0 ||
+	    !nss_ubdns_cache_get_stale(kind, key, key_len, NULL, 0, NULL, NULL, max_stale))
+		return (false);
+
+	pthread_once(&refresh_once, nss_ubdns_refresh_init);
+
+	now = nss_ubdns_now_ms();
+	until = now + __atomic_load_n(&options.stale_threshold, __ATOMIC_RELAXED);
+	deadline = nss_ubdns_deadline();
+	if (deadline != 0 && deadline < until)
+		until = deadline;
+	hash = nss_ubdns_qname_hash(key, kind);
+
+	pthread_mutex_lock(&refresh_lock);
+	pp = &refreshes[hash % REFRESH_BUCKETS];
+	while ((rf = *pp) != NULL) {
+		if (rf->done && rf->retry <= now) {
+			nss_ubdns_refresh_unlink(pp);
+			continue;
+		}
+		if (rf->hash == hash && rf->kind == kind && strcmp(rf->key, key) == 0)
+			break;
+		pp = &rf->next;
+	}
+	if (rf == NULL && refresh_threads < REFRESH_THREADS) {
+		rf = malloc(sizeof(*rf) + key_len + 1);
+		if (rf != NULL) {
+			*rf = (struct refresh) {
+				.next = refreshes[hash % REFRESH_BUCKETS],
+				.hash = hash,
+				.kind = kind,
+				.refs = 2,
+				.linked = true,
+				.wait_until = until,
+				.key_len = key_len,
+			};
+			memcpy(rf->key, key, key_len);
+			rf->key[key_len] = '\0';
+			if (nss_ubdns_thread_start(nss_ubdns_refresh_run, rf)) {
+				refreshes[hash % REFRESH_BUCKETS] = rf;
+				refresh_threads++;
+			} else {
+				free(rf);
+				rf = NULL;
+			}
+		}
+	}
+	if (rf != NULL) {
+		/* once a refresh has taken too long, nobody waits for it */
+		if (rf->wait_until < until)
+			until = rf->wait_until;
+		nss_ubdns_ms_timespec(until, &ts);
+		rf->refs++;
+		while (!rf->done && nss_ubdns_now_ms() < until)
+			pthread_cond_timedwait(&refresh_cond, &refresh_lock, &ts);
+		nss_ubdns_refresh_release(rf);
+	}
+	pthread_mutex_unlock(&refresh_lock);
+
+	if (nss_ubdns_cache_get(kind, key, key_len, buf, buf_len, val, val_len, ttl))
+		return (true);
+	if (nss_ubdns_cache_get_stale(kind, key, key_len, buf, buf_len, val, val_len, max_stale)) {
+		*ttl = __atomic_load_n(&options.stale_ttl, __ATOMIC_RELAXED);
+		return (true);
+	}
+	return (false);
+}
+
+/*
+ * Prefetch. A popular answer that is hit in the last tenth of its TTL is
+ * queued for a dedicated thread to refresh, so that lookups keep finding a
+ * fresh answer in the cache instead of the first one after it expires paying
+ * for a full resolution. The thread takes the queue in batches. It asks
+ * nss-ubdns-cached if that is running, which refreshes the shared cache as
+ * well, and otherwise resolves the whole batch at once with
+ * ub_resolve_async() on a context of its own. That context's answer caches
+ * are disabled, since the lookups' context would just return the answer
+ * that is about to expire.
+ */
+#define PREFETCH_QUEUE		1024	/* names waiting at most */
+#define PREFETCH_BATCH		32
+
+struct prefetch {
+	struct prefetch *next;
+	int kind;
+	size_t key_len;
+	char key[];		/* NUL terminated */
+};
+
+static struct prefetch *prefetch_head = NULL, **prefetch_tail = &prefetch_head;
+static unsigned prefetch_queued = 0;
+static bool prefetch_running = false;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+/* only used by the prefetch thread */
+static struct nss_ubdns_context *prefetch_ctx = NULL;
+static uint64_t prefetch_sig = 0;
+
+static struct nss_ubdns_context *
+nss_ubdns_prefetch_context(void) {
+	uint64_t sig = __atomic_load_n(&config_sig, __ATOMIC_RELAXED);
+
+	/* the configuration changed since the context was built */
+	if (prefetch_ctx != NULL && prefetch_sig != sig) {
+		nss_ubdns_ctx_release(prefetch_ctx);
+		prefetch_ctx = NULL;
+	}
+	if (prefetch_ctx == NULL) {
+		prefetch_ctx = nss_ubdns_context_new(true);
+		prefetch_sig = sig;
+	}
+	return (prefetch_ctx);
+}
+
+static void
+nss_ubdns_prefetch_batch(struct prefetch **pf, unsigned n) {
+	struct nss_ubdns_query q[2 * PREFETCH_BATCH];
+	unsigned first[PREFETCH_BATCH + 1];
+	struct nss_ubdns_context *c;
+	int64_t deadline = nss_ubdns_deadline();
+	unsigned i, j, n_q = 0;
+	int32_t ttl;
+
+	for (i = 0; i < n; i++) {
+		first[i] = n_q;
+		n_q += nss_ubdns_queries_init(pf[i]->kind, &q[n_q]);
+	}
+	first[n] = n_q;
+
+	for (i = 0; i < n; i++)
+		if (nss_ubdns_cached_resolve(pf[i]->key, &q[first[i]], first[i + 1] - first[i],
+					     deadline, true) != 0)
+			break;
+
+	/* the daemon is unavailable, resolve the rest ourselves */
+	if (i < n) {
+		c = nss_ubdns_prefetch_context();
+		for (j = first[i]; c == NULL && j < n_q; j++) {
+			q[j].err = UB_INITFAIL;
+			q[j].done = true;
+			q[j].cached = false;
+			q[j].res = NULL;
+		}
+		if (c != NULL) {
+			for (j = i; j < n; j++)
+				nss_ubdns_resolve_start(c, pf[j]->key, &q[first[j]],
+							first[j + 1] - first[j], NULL);
+			nss_ubdns_wait(c, &q[first[i]], n_q - first[i], deadline);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (pf[i]->kind == NSS_UBDNS_CACHE_PTR) {
+			char names[NSS_UBDNS_CACHED_MAXMSG];
+			size_t names_len;
+			unsigned n_names;
+
+			nss_ubdns_reverse_answer(pf[i]->key, pf[i]->key_len, &q[first[i]],
+						 names, sizeof(names), &names_len, &n_names, &ttl);
+		} else {
+			struct address buf[NSS_UBDNS_ADDRESSES_STACK], *list;
+			char names[NSS_UBDNS_NAMES_MAX];
+			size_t names_len;
+			unsigned n_list;
+
+			nss_ubdns_forward_answer(pf[i]->kind, pf[i]->key, pf[i]->key_len,
+						 &q[first[i]], first[i + 1] - first[i],
+						 buf, NSS_UBDNS_ADDRESSES_STACK, &list, &n_list,
+						 names, &names_len, &ttl);
+			if (list != buf)
+				free(list);
+		}
+	}
+}
+
+static void *
+nss_ubdns_prefetch_run(void *arg) {
+	struct prefetch *pf[PREFETCH_BATCH];
+	unsigned i, n;
+
+	(void) arg;
+
+	for (;;) {
+		pthread_mutex_lock(&prefetch_lock);
+		while (prefetch_head == NULL)
+			pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+		for (n = 0; n < PREFETCH_BATCH && prefetch_head != NULL; n++) {
+			pf[n] = prefetch_head;
+			prefetch_head = pf[n]->next;
+		}
+		if (prefetch_head == NULL)
+			prefetch_tail = &prefetch_head;
+		prefetch_queued -= n;
+		pthread_mutex_unlock(&prefetch_lock);
+
+		nss_ubdns_prefetch_batch(pf, n);
+		for (i = 0; i < n; i++)
+			free(pf[i]);
+	}
+	return (NULL);
+}
+
+/* Queue an answer for refreshing. Names beyond the queue's capacity are dropped. */
+static void
+nss_ubdns_prefetch(int kind, const char *key, size_t key_len) {
+	struct prefetch *pf;
+
+	pthread_mutex_lock(&prefetch_lock);
+	if (prefetch_queued < PREFETCH_QUEUE &&
+	    (pf = malloc(sizeof(*pf) + key_len + 1)) != NULL)
+	{
+		pf->next = NULL;
+		pf->kind = kind;
+		pf->key_len = key_len;
+		memcpy(pf->key, key, key_len);
+		pf->key[key_len] = '\0';
+		*prefetch_tail = pf;
+		prefetch_tail = &pf->next;
+		prefetch_queued++;
+
+		/* the thread is started by the first prefetch, and stays */
+		if (!prefetch_running)
+			prefetch_running = nss_ubdns_thread_start(nss_ubdns_prefetch_run, NULL);
+		pthread_cond_signal(&prefetch_cond);
+	}
+	pthread_mutex_unlock(&prefetch_lock);
+}
+
+/*
+ * fork(). libunbound's worker threads stay with the parent, along with the
+ * pipes to them, and so do our own helper threads, so the child can't go on
+ * as before. Nor can it use the contexts it inherited: a worker thread goes
+ * on resolving a query after it has been cancelled, and may have been
+ * holding a lock on the context's caches when the process forked, with no
+ * thread left in the child to release it. So the child builds new contexts
+ * the first time it needs them, and leaves the inherited ones alone, since
+ * ub_ctx_delete() would tell the parent's worker threads to exit. It keeps
+ * the front cache, copy-on-write like the rest of its memory.
+ */
+static void
+nss_ubdns_fork_prepare(void) {
+	unsigned i;
+
+	pthread_mutex_lock(&ctx_lock);
+	for (i = 0; i < FLIGHT_BUCKETS; i++)
+		pthread_mutex_lock(&flights[i].lock);
+	pthread_mutex_lock(&refresh_lock);
+	pthread_mutex_lock(&prefetch_lock);
+	pthread_mutex_lock(&search_lock);
+	nss_ubdns_cache_fork(NSS_UBDNS_FORK_PREPARE);
+	nss_ubdns_hostsdb_fork(NSS_UBDNS_FORK_PREPARE);
+	nss_ubdns_shmcache_fork(NSS_UBDNS_FORK_PREPARE);
+	nss_ubdns_stats_fork(NSS_UBDNS_FORK_PREPARE);
+}
+
+static void
+nss_ubdns_fork_parent(void) {
+	unsigned i;
+
+	nss_ubdns_stats_fork(NSS_UBDNS_FORK_PARENT);
+	nss_ubdns_shmcache_fork(NSS_UBDNS_FORK_PARENT);
+	nss_ubdns_hostsdb_fork(NSS_UBDNS_FORK_PARENT);
+	nss_ubdns_cache_fork(NSS_UBDNS_FORK_PARENT);
+	pthread_mutex_unlock(&search_lock);
+	pthread_mutex_unlock(&prefetch_lock);
+	pthread_mutex_unlock(&refresh_lock);
+	for (i = 0; i < FLIGHT_BUCKETS; i++)
+		pthread_mutex_unlock(&flights[i].lock);
+	pthread_mutex_unlock(&ctx_lock);
+}
+
+static void
+nss_ubdns_fork_child(void) {
+	unsigned i;
+
+	nss_ubdns_stats_fork(NSS_UBDNS_FORK_CHILD);
+	nss_ubdns_shmcache_fork(NSS_UBDNS_FORK_CHILD);
+	nss_ubdns_hostsdb_fork(NSS_UBDNS_FORK_CHILD);
+	nss_ubdns_cache_fork(NSS_UBDNS_FORK_CHILD);
+	pthread_mutex_unlock(&search_lock);
+
+	/* whatever the parent's threads were doing, nobody is waiting for it here */
+	prefetch_running = false;
+	prefetch_ctx = NULL;
+	pthread_mutex_unlock(&prefetch_lock);
+	memset(refreshes, 0, sizeof(refreshes));
+	refresh_threads = 0;
+	pthread_mutex_unlock(&refresh_lock);
+	for (i = 0; i < FLIGHT_BUCKETS; i++) {
+		flights[i].head = NULL;
+		pthread_mutex_unlock(&flights[i].lock);
+	}
+
+	for (i = 0; i < n_current; i++)
+		current[i] = NULL;
+
+	/* a reload was under way, look for the change again */
+	if (config_rebuilding) {
+		config_rebuilding = false;
+		config_sig = 0;
+		config_checked = 0;
+	}
+	pthread_mutex_unlock(&ctx_lock);
+}
 
-static void
-nss_ubdns_load_keys(void) {
-	DIR *dirp;
-	int dir_fd;
-	struct dirent de;
-	struct dirent *res;
+static void __attribute__((constructor))
+nss_ubdns_start(void) {
+	pthread_atfork(nss_ubdns_fork_prepare, nss_ubdns_fork_parent, nss_ubdns_fork_child);
+}
 
-	dirp = opendir(NSS_UBDNS_KEYDIR);
-	if (dirp == NULL)
-		return;
+/*
+ * Look up the addresses of a single name, see nss_ubdns_lookup_forward().
+ * Unless the name is answered from the cache, *start is set to when it
+ * started to take longer than that.
+ */
+static int
+nss_ubdns_lookup_name(const char *hn, int af, struct address *buf, unsigned buf_n,
+		      struct address **_list, unsigned *_n_list,
+		      char *names, size_t *_names_len, int32_t *ttlp, int64_t *start)
+{
+	struct nss_ubdns_stats *s = nss_ubdns_stats();
+	struct address *list = buf;
+	char key[NSS_UBDNS_PRESLEN_NAME];
+	size_t key_len, val_len;
+	int hit;
 
-	dir_fd = dirfd(dirp);
-	if (dir_fd == -1)
-		return;
+	key_len = nss_ubdns_qname_key(hn, key, sizeof(key));
+	if (key_len > 0) {
+		hit = nss_ubdns_cache_get(af, key, key_len, buf, buf_n * sizeof(struct address),
+					  (void **) &list, &val_len, ttlp);
+		if (hit == NSS_UBDNS_CACHE_PREFETCH)
+			nss_ubdns_prefetch(af, key, key_len);
+		if (hit) {
+			nss_ubdns_stat_add(&s->cache_hits, 1);
+		} else {
+			*start = nss_ubdns_now_ns();
+			if (nss_ubdns_stale_get(af, key, key_len, buf, buf_n * sizeof(struct address),
+						(void **) &list, &val_len, ttlp))
+			{
+				nss_ubdns_stat_add(&s->cache_stale, 1);
+				hit = NSS_UBDNS_CACHE_STALE;
+			}
+		}
+		NSS_UBDNS_PROBE4(cache__lookup, hn, nss_ubdns_probe_qtype(af), hit);
+		if (hit) {
+			*_list = list;
+			*_n_list = nss_ubdns_forward_get(list, val_len, names, _names_len);
+			return (1);
+		}
+	}
+	nss_ubdns_stat_add(&s->cache_misses, 1);
+	if (key_len == 0)
+		*start = nss_ubdns_now_ns();
 
-	while (readdir_r(dirp, &de, &res) == 0 && res != NULL) {
-		FILE *fp;
-		int fd;
-		char *line = NULL;
-		char *fn;
-		size_t len = 0;
-		size_t fnlen;
-		ssize_t bytes_read;
-
-		fn = de.d_name;
-		fnlen = strlen(fn);
-		if (fnlen < 5 ||
-		     !(fn[fnlen - 4] == '.' &&
-		       fn[fnlen - 3] == 'k' &&
-		       fn[fnlen - 2] == 'e' &&
-		       fn[fnlen - 1] == 'y'))
-		{
+	return (nss_ubdns_resolve_forward(hn, af, key, key_len, buf, buf_n, _list, _n_list,
+					  names, _names_len, ttlp));
+}
+
+/*
+ * Search list. A name with fewer dots than ndots is tried in each of the
+ * search domains and then as is, and one with more in the search domains
+ * after it failed as is, see nss_ubdns_lookup_forward(). Rather than one
+ * after the other, as the libc resolver does, the candidate names are
+ * resolved all at once, and the answer is that of the first candidate in
+ * search order to have addresses, as soon as it and all those before it are
+ * in. The queries still outstanding then are cancelled. The answers of the
+ * candidates that failed, mostly NXDOMAIN, are cached like any other, so the
+ * next lookup of the name skips them without asking.
+ */
+#define SEARCH_CANDIDATES	(NSS_UBDNS_SEARCH_MAX + 1)
+
+/*
+ * Advance *i past the candidates, n_per queries each, that have failed.
+ * Returns false if candidate *i is still resolving, and true once the search
+ * is decided: by candidate *i, which timed out or has addresses, or, if *i
+ * is n_cand, by all of them failing.
+ */
+static bool
+nss_ubdns_search_next(const struct nss_ubdns_query *q, unsigned n_cand, unsigned n_per,
+		      unsigned *i)
+{
+	const struct nss_ubdns_query *cq;
+	unsigned j, n_addresses;
+
+	for (; *i < n_cand; (*i)++) {
+		cq = q + *i * n_per;
+		n_addresses = 0;
+		for (j = 0; j < n_per; j++) {
+			if (!cq[j].done)
+				return (false);
+			if (cq[j].err == NSS_UBDNS_ERR_TIMEOUT)
+				return (true);
+			if (cq[j].err == 0)
+				n_addresses += nss_ubdns_count_addresses(cq[j].res,
+					cq[j].rrtype == NSS_UBDNS_TYPE_A ? AF_INET : AF_INET6);
+		}
+		if (n_addresses > 0)
+			return (true);
+	}
+	return (true);
+}
+
+static bool
+nss_ubdns_search_decided(const struct nss_ubdns_query *q, unsigned n_q, void *arg) {
+	unsigned n_per = *(unsigned *) arg, i = 0;
+
+	return (nss_ubdns_search_next(q, n_q / n_per, n_per, &i));
+}
+
+/*
+ * Resolve the candidates' queries, n_per for each, until the search is
+ * decided, and return the candidate that decided it as above. Queries left
+ * unanswered then fail with NSS_UBDNS_ERR_CANCELLED. Each candidate is
+ * resolved by the context that would resolve it on its own.
+ */
+static unsigned
+nss_ubdns_search_resolve(char (*qnames)[NSS_UBDNS_PRESLEN_NAME], unsigned n_cand,
+			 struct nss_ubdns_query *q, unsigned n_per, int64_t deadline)
+{
+	struct nss_ubdns_context *ctx[n_cand];
+	const char *qname[n_cand * n_per];
+	char key[NSS_UBDNS_PRESLEN_NAME];
+	unsigned i, j, n_q = n_cand * n_per, n_shm = 0;
+
+	for (i = 0; i < n_q; i++) {
+		qname[i] = qnames[i / n_per];
+		NSS_UBDNS_PROBE3(resolve__start, qname[i], q[i].rrtype);
+		q[i].err = 0;
+		q[i].res = NULL;
+		q[i].done = false;
+		q[i].cached = false;
+		if (nss_ubdns_shmcache_lookup(qname[i], &q[i]) == 0)
+			n_shm++;
+	}
+	if (n_shm > 0)
+		nss_ubdns_stat_add(&nss_ubdns_stats()->shm_hits, n_shm);
+
+	i = 0;
+	if (nss_ubdns_cached_resolve_names(qname, q, n_q, deadline,
+					   nss_ubdns_search_decided, &n_per) == 0)
+	{
+		nss_ubdns_search_next(q, n_cand, n_per, &i);
+		goto done;
+	}
+
+	for (j = 0; j < n_cand; j++) {
+		if (nss_ubdns_qname_key(qnames[j], key, sizeof(key)) == 0)
+			key[0] = '\0';
+		ctx[j] = nss_ubdns_ctx_acquire(nss_ubdns_qname_hash(key, 0));
+		for (i = j * n_per; i < (j + 1) * n_per; i++) {
+			if (q[i].done)
+				continue;
+			if (ctx[j] == NULL) {
+				q[i].err = UB_INITFAIL;
+				q[i].done = true;
+			} else {
+				nss_ubdns_resolve_start(ctx[j], qnames[j], &q[i], 1, NULL);
+			}
+		}
+	}
+
+	i = 0;
+	while (!nss_ubdns_search_next(q, n_cand, n_per, &i))
+		nss_ubdns_wait(ctx[i], q + i * n_per, n_per, deadline);
+
+	for (j = 0; j < n_cand; j++) {
+		if (ctx[j] == NULL)
 			continue;
+		if (j > i) {
+			pthread_mutex_lock(&ctx[j]->wait_lock);
+			nss_ubdns_cancel(ctx[j], q + j * n_per, n_per, NSS_UBDNS_ERR_CANCELLED);
+			pthread_mutex_unlock(&ctx[j]->wait_lock);
+			nss_ubdns_wait(ctx[j], q + j * n_per, n_per, 0);
 		}
-		if (!isalnum(fn[0]))
+		nss_ubdns_ctx_release(ctx[j]);
+	}
+
+done:
+	for (j = 0; j < n_cand; j++)
+		nss_ubdns_resolve_done(qnames[j], q + j * n_per, n_per);
+	return (i);
+}
+
+/* A name found through the search list is canonically the one that was found. */
+static void
+nss_ubdns_search_canon(const char *qname, char *names, size_t *_names_len) {
+	size_t len = strlen(qname) + 1;
+
+	if (*_names_len == 0 && len <= NSS_UBDNS_NAMES_MAX) {
+		memcpy(names, qname, len);
+		*_names_len = len;
+	}
+}
+
+/* Answer a search with the candidate that hosts.db has addresses for. */
+static int
+nss_ubdns_search_pinned(const char *qname, int af, struct address *buf, unsigned buf_n,
+			struct address **_list, unsigned *_n_list,
+			char *names, size_t *_names_len, int32_t *ttlp, int64_t *start)
+{
+	*_list = buf;
+	*_n_list = 0;
+	*_names_len = 0;
+
+	/* hosts.db may have been replaced since, and the candidate gone from it */
+	if (!nss_ubdns_hostsdb_forward(qname, af, buf, buf_n, _list, _n_list,
+				       names, _names_len, ttlp))
+		return (1);
+	if (*start == 0)
+		nss_ubdns_stat_add(&nss_ubdns_stats()->overrides, 1);
+	if (*_n_list > 0)
+		nss_ubdns_search_canon(qname, names, _names_len);
+	return (1);
+}
+
+/*
+ * Look up the addresses of a name through the search list, as described
+ * above, and as is last if as_is. A candidate in hosts.db is answered from
+ * it alone, as the name itself is: one without addresses is skipped, and
+ * the first with addresses ends the search. See nss_ubdns_lookup_name() for
+ * start.
+ */
+static int
+nss_ubdns_lookup_search(const char *hn, int af, bool as_is,
+			struct address *buf, unsigned buf_n,
+			struct address **_list, unsigned *_n_list,
+			char *names, size_t *_names_len, int32_t *ttlp, int64_t *start)
+{
+	struct nss_ubdns_stats *s = nss_ubdns_stats();
+	char qnames[SEARCH_CANDIDATES][NSS_UBDNS_PRESLEN_NAME];
+	char search[NSS_UBDNS_SEARCH_LEN], key[NSS_UBDNS_PRESLEN_NAME];
+	char other_names[NSS_UBDNS_NAMES_MAX];
+	struct nss_ubdns_query q[SEARCH_CANDIDATES * 2], *cq;
+	struct address other[NSS_UBDNS_ADDRESSES_STACK], *list = buf;
+	size_t hn_len = strlen(hn), len, key_len, val_len, other_names_len;
+	unsigned i, n, n_search, n_cand = 0, first, decided, n_per, n_list;
+	const char *domain, *pinned = NULL;
+	int32_t other_ttl;
+	int hit, r = 1;
+
+	pthread_mutex_lock(&search_lock);
+	n_search = options.n_search;
+	memcpy(search, options.search, sizeof(search));
+	pthread_mutex_unlock(&search_lock);
+
+	for (i = 0, domain = search; i < n_search; i++, domain += len + 1) {
+		len = strlen(domain);
+		if (hn_len + 1 + len + 1 > NSS_UBDNS_PRESLEN_NAME)
 			continue;
+		memcpy(qnames[n_cand], hn, hn_len);
+		qnames[n_cand][hn_len] = '.';
+		memcpy(qnames[n_cand] + hn_len + 1, domain, len + 1);
+		n_cand++;
+	}
+	if (as_is && hn_len < NSS_UBDNS_PRESLEN_NAME)
+		memcpy(qnames[n_cand++], hn, hn_len + 1);
 
-		fd = openat(dir_fd, de.d_name, O_RDONLY);
-		if (fd == -1)
+	/* only the candidates before the first pinned one are left to resolve */
+	for (i = 0, n = 0; i < n_cand; i++) {
+		if (nss_ubdns_hostsdb_forward(qnames[i], af, other, NSS_UBDNS_ADDRESSES_STACK,
+					      &list, &n_list, other_names, &other_names_len,
+					      &other_ttl))
+		{
+			if (list != other)
+				free(list);
+			if (n_list > 0) {
+				pinned = qnames[i];
+				break;
+			}
 			continue;
+		}
+		if (n != i)
+			memcpy(qnames[n], qnames[i], sizeof(qnames[i]));
+		n++;
+	}
+	n_cand = n;
+
+	*_list = buf;
+	*_n_list = 0;
+	*_names_len = 0;
+	*ttlp = 0;
+
+	/* skip the candidates the cache knows have no addresses */
+	for (first = 0; first < n_cand; first++) {
+		key_len = nss_ubdns_qname_key(qnames[first], key, sizeof(key));
+		if (key_len == 0)
+			break;
+		hit = nss_ubdns_cache_get(af, key, key_len, buf, buf_n * sizeof(struct address),
+					  (void **) &list, &val_len, ttlp);
+		if (hit == NSS_UBDNS_CACHE_PREFETCH)
+			nss_ubdns_prefetch(af, key, key_len);
+		NSS_UBDNS_PROBE4(cache__lookup, qnames[first], nss_ubdns_probe_qtype(af), hit);
+		if (!hit)
+			break;
+
+		n_list = nss_ubdns_forward_get(list, val_len, names, _names_len);
+		if (n_list > 0) {
+			if (*start == 0)
+				nss_ubdns_stat_add(&s->cache_hits, 1);
+			*_list = list;
+			*_n_list = n_list;
+			nss_ubdns_search_canon(qnames[first], names, _names_len);
+			return (1);
+		}
+		if (list != buf)
+			free(list);
+		*_names_len = 0;
+	}
+	if (first == n_cand && pinned != NULL)
+		return (nss_ubdns_search_pinned(pinned, af, buf, buf_n, _list, _n_list,
+						names, _names_len, ttlp, start));
+	if (first == n_cand) {
+		if (*start == 0)
+			nss_ubdns_stat_add(&s->cache_hits, 1);
+		return (1);
+	}
+	if (*start == 0) {
+		nss_ubdns_stat_add(&s->cache_misses, 1);
+		*start = nss_ubdns_now_ns();
+	}
+
+	n_per = nss_ubdns_queries_init(af, q);
+	for (i = n_per; i < (n_cand - first) * n_per; i++)
+		q[i].rrtype = q[i % n_per].rrtype;
+	decided = first + nss_ubdns_search_resolve(qnames + first, n_cand - first, q, n_per,
+						   nss_ubdns_deadline());
+	if (decided == n_cand && pinned == NULL)
+		decided = n_cand - 1;
 
-		fp = fdopen(fd, "r");
-		if (fp == NULL) {
-			close(fd);
+	for (i = first; i < n_cand; i++) {
+		cq = q + (i - first) * n_per;
+		key_len = nss_ubdns_qname_key(qnames[i], key, sizeof(key));
+		if (i == decided) {
+			r = nss_ubdns_forward_answer(af, key, key_len, cq, n_per, buf, buf_n,
+						     _list, _n_list, names, _names_len, ttlp);
+			if (*_n_list > 0)
+				nss_ubdns_search_canon(qnames[i], names, _names_len);
 			continue;
 		}
+		nss_ubdns_forward_answer(af, key, key_len, cq, n_per, other, NSS_UBDNS_ADDRESSES_STACK,
+					 &list, &n_list, other_names, &other_names_len, &other_ttl);
+		if (list != other)
+			free(list);
+	}
+	if (decided == n_cand)
+		return (nss_ubdns_search_pinned(pinned, af, buf, buf_n, _list, _n_list,
+						names, _names_len, ttlp, start));
+	return (r);
+}
 
-		while ((bytes_read = getline(&line, &len, fp)) != -1) {
-			char *p = line;
+/*
+ * Look up the addresses of a name, in hosts.db first, see hostsdb.c. The
+ * list is returned in buf if it has room for them, which it does for all but
+ * very large answers, and in a malloc()ed array otherwise; the caller frees
+ * *_list if it is not buf. IPv4 addresses come first, each family in the
+ * order the answer listed them. If the name is an alias, or was found through
+ * the search list, its canonical name and the names of its CNAME chain are
+ * written to names, which has room for NSS_UBDNS_NAMES_MAX bytes, as
+ * described for nss_ubdns_result_names(), and *_names_len is set to their
+ * size, else to 0. Returns 1 on success, 0 on failure and NSS_UBDNS_TIMEDOUT
+ * if the deadline passed.
+ */
+int
+nss_ubdns_lookup_forward(const char *hn, int af, struct address *buf, unsigned buf_n,
+			 struct address **_list, unsigned *_n_list,
+			 char *names, size_t *_names_len, int32_t *ttlp)
+{
+	struct nss_ubdns_stats *s = nss_ubdns_stats();
+	size_t hn_len = strlen(hn), i;
+	unsigned ndots, dots = 0;
+	int64_t start = 0;
+	int r;
 
-			while (isspace(*p))
-				p++;
-			if (*p == '\0' || *p == ';')
-				continue;
+	nss_ubdns_config_check();
+
+	if (nss_ubdns_hostsdb_forward(hn, af, buf, buf_n, _list, _n_list, names, _names_len, ttlp)) {
+		nss_ubdns_stat_add(&s->overrides, 1);
+		nss_ubdns_stat_add(&s->latency[0], 1);
+		return (1);
+	}
+
+	/* absolute names are never searched */
+	if (__atomic_load_n(&options.n_search, __ATOMIC_RELAXED) == 0 ||
+	    hn_len == 0 || hn[hn_len - 1] == '.')
+	{
+		r = nss_ubdns_lookup_name(hn, af, buf, buf_n, _list, _n_list,
+					  names, _names_len, ttlp, &start);
+		goto out;
+	}
+
+	ndots = __atomic_load_n(&options.ndots, __ATOMIC_RELAXED);
+	for (i = 0; i < hn_len; i++)
+		if (hn[i] == '.')
+			dots++;
+	if (dots >= ndots) {
+		r = nss_ubdns_lookup_name(hn, af, buf, buf_n, _list, _n_list,
+					  names, _names_len, ttlp, &start);
+		if (r == NSS_UBDNS_TIMEDOUT || *_n_list > 0)
+			goto out;
+		if (*_list != buf)
+			free(*_list);
+	}
+	r = nss_ubdns_lookup_search(hn, af, dots < ndots, buf, buf_n, _list, _n_list,
+				    names, _names_len, ttlp, &start);
+out:
+	if (start == 0)
+		nss_ubdns_stat_add(&s->latency[0], 1);
+	else
+		nss_ubdns_stats_latency(s, start);
+	return (r);
+}
+
+/*
+ * Look up the names of an address, in hosts.db first. They are written to
+ * buf one after the other, each terminated by a NUL, and their number and
+ * total size are returned in *_n_names and *_names_len. Returns 1 if the
+ * address has a name, 0 if it has none, -1 if the names do not fit in
+ * buf_len bytes, and NSS_UBDNS_TIMEDOUT if the deadline passed.
+ */
+int
+nss_ubdns_lookup_reverse(const void *addr, int af, char *buf, size_t buf_len,
+			 size_t *_names_len, unsigned *_n_names, int32_t *ttlp)
+{
+	struct nss_ubdns_stats *s = nss_ubdns_stats();
+	char qname[NSS_UBDNS_ARPA_QNAME_MAX];
+	size_t qname_len, val_len, i;
+	unsigned n_names = 0;
+	int64_t start = 0;
+	void *val;
+	int hit, r;
+
+	if (af == AF_INET) {
+		qname_len = arpa_qname_ip4(addr, qname);
+	} else if (af == AF_INET6) {
+		qname_len = arpa_qname_ip6(addr, qname);
+	} else {
+		return (0);
+	}
+
+	nss_ubdns_config_check();
+
+	r = nss_ubdns_hostsdb_reverse(qname, qname_len, buf, buf_len, _names_len, _n_names, ttlp);
+	if (r != 0) {
+		nss_ubdns_stat_add(&s->overrides, 1);
+		nss_ubdns_stat_add(&s->latency[0], 1);
+		return (r);
+	}
+
+	hit = nss_ubdns_cache_get(NSS_UBDNS_CACHE_PTR, qname, qname_len, buf, buf_len,
+				  &val, &val_len, ttlp);
+	if (hit == NSS_UBDNS_CACHE_PREFETCH)
+		nss_ubdns_prefetch(NSS_UBDNS_CACHE_PTR, qname, qname_len);
+	if (hit) {
+		nss_ubdns_stat_add(&s->cache_hits, 1);
+		nss_ubdns_stat_add(&s->latency[0], 1);
+	} else {
+		start = nss_ubdns_now_ns();
+		if (nss_ubdns_stale_get(NSS_UBDNS_CACHE_PTR, qname, qname_len, buf, buf_len,
+					&val, &val_len, ttlp))
+		{
+			nss_ubdns_stat_add(&s->cache_stale, 1);
+			nss_ubdns_stats_latency(s, start);
+			hit = NSS_UBDNS_CACHE_STALE;
+		}
+	}
+	NSS_UBDNS_PROBE4(cache__lookup, qname, NSS_UBDNS_TYPE_PTR, hit);
+	if (hit) {
+		if (val != buf) {
+			free(val);
+			return (-1);
+		}
+		for (i = 0; i < val_len; i++)
+			if (buf[i] == '\0')
+				n_names++;
+		*_names_len = val_len;
+		*_n_names = n_names;
+		return (n_names > 0);
+	}
+	nss_ubdns_stat_add(&s->cache_misses, 1);
+
+	r = nss_ubdns_resolve_reverse(qname, qname_len, buf, buf_len,
+				      _names_len, _n_names, ttlp);
+	nss_ubdns_stats_latency(s, start);
+	return (r);
+}
+
+/*
+ * Pipelines, for callers with many names or addresses to look up at once,
+ * see ubdns_resolve_batch(). A lookup added to a pipeline is answered at once
+ * if hosts.db, the front cache or the shared cache can; otherwise its queries
+ * are started with ub_resolve_async() on the context its name hashes to, and
+ * the caller carries on without waiting for them. The pipeline's fd, an
+ * epoll set of those contexts' fds and an eventfd, becomes readable when
+ * there is something to do. nss_ubdns_pipeline_next() then reads whatever
+ * answers have arrived and returns the complete lookups one at a time, in
+ * the order they completed. Answers delivered by another thread's
+ * ub_process() are signalled through the eventfd.
+ *
+ * Names are looked up as given, without the search list, and neither stale
+ * answers nor nss-ubdns-cached are used, since both could block the caller.
+ * A pipeline is used by one thread at a time.
+ */
+struct nss_ubdns_pipeline {
+	int epfd;
+	int evfd;
+
+	/* complete lookups, appended by whichever thread completes them */
+	pthread_mutex_t lock;
+	struct nss_ubdns_lookup *ready, **ready_tail;
+
+	struct nss_ubdns_lookup *head, *tail;	/* unfinished, in the order added */
+
+	/* the contexts unfinished lookups use, each holding one reference */
+	struct pipeline_context {
+		struct nss_ubdns_context *c;
+		unsigned n;
+		bool parked;	/* its fd is not watched, see nss_ubdns_pipeline_park() */
+	} *contexts;
+	unsigned n_contexts, size_contexts;
+};
+
+struct nss_ubdns_pipeline *
+nss_ubdns_pipeline_new(void) {
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	struct nss_ubdns_pipeline *p;
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return (NULL);
+	p->epfd = epoll_create1(EPOLL_CLOEXEC);
+	p->evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (p->epfd == -1 || p->evfd == -1 ||
+	    epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->evfd, &ev) != 0)
+	{
+		if (p->epfd != -1)
+			close(p->epfd);
+		if (p->evfd != -1)
+			close(p->evfd);
+		free(p);
+		return (NULL);
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	p->ready_tail = &p->ready;
+	return (p);
+}
+
+int
+nss_ubdns_pipeline_fd(const struct nss_ubdns_pipeline *p) {
+	return (p->epfd);
+}
+
+/* Take the context's reference for the pipeline, see nss_ubdns_pipeline_unuse(). */
+static bool
+nss_ubdns_pipeline_use(struct nss_ubdns_pipeline *p, struct nss_ubdns_context *c) {
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+	struct pipeline_context *pc;
+	unsigned i;
 
-			ub_ctx_add_ta(ctx, p);
+	for (i = 0; i < p->n_contexts; i++) {
+		if (p->contexts[i].c == c) {
+			p->contexts[i].n++;
+			nss_ubdns_ctx_release(c);
+			return (true);
 		}
-		free(line);
-		close(fd);
 	}
-	closedir(dirp);
+
+	if (p->n_contexts == p->size_contexts) {
+		pc = realloc(p->contexts, (p->size_contexts + 8) * sizeof(*pc));
+		if (pc == NULL)
+			return (false);
+		p->contexts = pc;
+		p->size_contexts += 8;
+	}
+
+	if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, ub_fd(c->ctx), &ev) != 0)
+		return (false);
+	p->contexts[p->n_contexts].c = c;
+	p->contexts[p->n_contexts].n = 1;
+	p->contexts[p->n_contexts].parked = false;
+	p->n_contexts++;
+	return (true);
 }
 
 static void
-nss_ubdns_load_cfg(void) {
-	ub_ctx_config(ctx, NSS_UBDNS_LUCONF);
+nss_ubdns_pipeline_unuse(struct nss_ubdns_pipeline *p, struct nss_ubdns_context *c) {
+	unsigned i, j;
+
+	for (i = 0; p->contexts[i].c != c; i++)
+		;
+	if (--p->contexts[i].n > 0)
+		return;
+	if (p->contexts[i].parked) {
+		pthread_mutex_lock(&c->wait_lock);
+		for (j = 0; j < c->n_wait_pipelines; j++) {
+			if (c->wait_pipelines[j] == p) {
+				c->wait_pipelines[j] = c->wait_pipelines[--c->n_wait_pipelines];
+				break;
+			}
+		}
+		pthread_mutex_unlock(&c->wait_lock);
+	}
+	epoll_ctl(p->epfd, EPOLL_CTL_DEL, ub_fd(c->ctx), NULL);
+	nss_ubdns_ctx_release(c);
+	p->contexts[i] = p->contexts[--p->n_contexts];
 }
 
 static void
-nss_ubdns_load_resolvconf(void) {
-	struct stat sb;
+nss_ubdns_pipeline_ready(struct nss_ubdns_lookup *l) {
+	struct nss_ubdns_pipeline *p = l->pipeline;
+	uint64_t one = 1;
 
-	if (stat(NSS_UBDNS_RESOLVCONF, &sb) == 0) {
-		ub_ctx_resolvconf(ctx, NSS_UBDNS_RESOLVCONF);
-	} else {
-		ub_ctx_set_fwd(ctx, "127.0.0.1");
+	__atomic_store_n(&l->ready, true, __ATOMIC_RELAXED);
+	l->ready_next = NULL;
+	pthread_mutex_lock(&p->lock);
+	if (p->ready == NULL && write(p->evfd, &one, sizeof(one)) < 0)
+		;	/* already readable */
+	*p->ready_tail = l;
+	p->ready_tail = &l->ready_next;
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Another thread is running ub_process() on c, and delivers our answers too,
+ * but c's fd stays readable until it has read them. Stop watching the fd
+ * rather than spin on it, until that thread wakes us through the eventfd.
+ * Called with c's wait lock held.
+ */
+static void
+nss_ubdns_pipeline_park(struct nss_ubdns_pipeline *p, struct nss_ubdns_context *c) {
+	struct epoll_event ev = { .events = 0, .data.ptr = c };
+	struct nss_ubdns_pipeline **wp;
+	unsigned i;
+
+	for (i = 0; p->contexts[i].c != c; i++)
+		;
+	if (p->contexts[i].parked)
+		return;
+
+	if (c->n_wait_pipelines == c->size_wait_pipelines) {
+		wp = realloc(c->wait_pipelines, (c->size_wait_pipelines + 8) * sizeof(*wp));
+		if (wp == NULL)
+			return;
+		c->wait_pipelines = wp;
+		c->size_wait_pipelines += 8;
 	}
+	if (epoll_ctl(p->epfd, EPOLL_CTL_MOD, ub_fd(c->ctx), &ev) != 0)
+		return;
+	c->wait_pipelines[c->n_wait_pipelines++] = p;
+	p->contexts[i].parked = true;
 }
 
-static void __attribute__((constructor))
-nss_ubdns_init(void) {
-	ctx = ub_ctx_create();
-	if (ctx != NULL) {
-		/* disable logging to stderr */
-		/* the stub resolver must not generate any output to stdio */
-		ub_ctx_debugout(ctx, NULL);
+/* Watch the fds of the parked contexts again, once the eventfd has been read. */
+static void
+nss_ubdns_pipeline_unpark(struct nss_ubdns_pipeline *p) {
+	struct epoll_event ev = { .events = EPOLLIN };
+	unsigned i;
 
-		nss_ubdns_load_resolvconf();
-		nss_ubdns_load_keys();
-		nss_ubdns_load_cfg();
+	for (i = 0; i < p->n_contexts; i++) {
+		if (!p->contexts[i].parked)
+			continue;
+		ev.data.ptr = p->contexts[i].c;
+		epoll_ctl(p->epfd, EPOLL_CTL_MOD, ub_fd(p->contexts[i].c->ctx), &ev);
+		p->contexts[i].parked = false;
 	}
 }
 
-static void __attribute__((destructor))
-nss_ubdns_finish(void) {
-	ub_ctx_delete(ctx);
-	ctx = NULL;
+static void
+nss_ubdns_pipeline_wake(struct nss_ubdns_pipeline *p) {
+	uint64_t one = 1;
+
+	if (write(p->evfd, &one, sizeof(one)) < 0)
+		;	/* already readable */
+}
+
+/* A lookup whose queries are all answered is ready. Called with the wait lock held. */
+static void
+nss_ubdns_pipeline_check(struct nss_ubdns_lookup *l) {
+	if (!l->ready && nss_ubdns_queries_done(l->q, l->n_q))
+		nss_ubdns_pipeline_ready(l);
+}
+
+/* Give up on the queries of an unfinished lookup, which fail with err. */
+static void
+nss_ubdns_pipeline_cancel(struct nss_ubdns_lookup *l, int err) {
+	struct nss_ubdns_context *c = l->context;
+
+	if (c == NULL)
+		return;
+	pthread_mutex_lock(&c->wait_lock);
+	nss_ubdns_cancel(c, l->q, l->n_q, err);
+	nss_ubdns_pipeline_check(l);
+	pthread_mutex_unlock(&c->wait_lock);
+}
+
+/*
+ * Make room for a reverse lookup's names, in its own buffer or else an
+ * allocated one. Return the room, which falls short only if out of memory.
+ */
+static size_t
+nss_ubdns_lookup_names_room(struct nss_ubdns_lookup *l, size_t names_len) {
+	char *names;
+
+	if (names_len <= sizeof(l->names_buf))
+		return (sizeof(l->names_buf));
+	names = malloc(names_len);
+	if (names == NULL)
+		return (sizeof(l->names_buf));
+	l->names = names;
+	return (names_len);
+}
+
+/* The room nss_ubdns_reverse_answer() needs for the names in a query's answer. */
+static size_t
+nss_ubdns_reverse_size(const struct nss_ubdns_query *q) {
+	const struct ub_result *res = q->res;
+	size_t size = 0, i;
+
+	if (q->err != 0 || res == NULL || !nss_ubdns_check_result(res))
+		return (0);
+	for (i = 0; res->data[i] != NULL; i++)
+		if (res->len[i] != 0)
+			size += domain_to_str_size((const uint8_t *) res->data[i], res->len[i]);
+	return (size);
 }
 
+/*
+ * Answer a lookup from hosts.db or the front cache if possible, see
+ * nss_ubdns_lookup_forward() and nss_ubdns_lookup_reverse().
+ */
 static bool
-nss_ubdns_check_result(struct ub_result *res) {
-	if (res->havedata == 0)
-		return (false);
+nss_ubdns_pipeline_cached(struct nss_ubdns_lookup *l) {
+	struct nss_ubdns_stats *s = nss_ubdns_stats();
+	int kind = l->reverse ? NSS_UBDNS_CACHE_PTR : l->af;
+	size_t val_len, i;
+	void *val;
+	int hit = 0;
 
-	if (res->bogus)
+	if (l->reverse) {
+		/* nss-ubdns-compile keeps at most NSS_UBDNS_NAMES_MAX of names */
+		l->r = nss_ubdns_hostsdb_reverse(l->key, l->key_len, l->names, sizeof(l->names_buf),
+						 &l->names_len, &l->n_names, &l->ttl);
+		if (l->r != 0)
+			goto override;
+		hit = nss_ubdns_cache_get(kind, l->key, l->key_len, l->names, sizeof(l->names_buf),
+					  &val, &val_len, &l->ttl);
+		NSS_UBDNS_PROBE4(cache__lookup, l->key, NSS_UBDNS_TYPE_PTR, hit);
+		if (hit) {
+			l->names = val;	/* allocated if too long */
+			for (i = 0; i < val_len; i++)
+				if (l->names[i] == '\0')
+					l->n_names++;
+			l->names_len = val_len;
+			l->r = (l->n_names > 0);
+		}
+	} else {
+		if (nss_ubdns_hostsdb_forward(l->name, l->af, l->buf, NSS_UBDNS_ADDRESSES_STACK,
+					      &l->list, &l->n_list, l->names, &l->names_len, &l->ttl))
+		{
+			l->r = 1;
+			goto override;
+		}
+		if (l->key_len > 0) {
+			hit = nss_ubdns_cache_get(kind, l->key, l->key_len, l->buf, sizeof(l->buf),
+						  (void **) &l->list, &val_len, &l->ttl);
+			NSS_UBDNS_PROBE4(cache__lookup, l->name, nss_ubdns_probe_qtype(l->af), hit);
+		}
+		if (hit) {
+			l->n_list = nss_ubdns_forward_get(l->list, val_len, l->names, &l->names_len);
+			l->r = 1;
+		}
+	}
+
+	if (hit == NSS_UBDNS_CACHE_PREFETCH)
+		nss_ubdns_prefetch(kind, l->key, l->key_len);
+	if (!hit) {
+		nss_ubdns_stat_add(&s->cache_misses, 1);
 		return (false);
+	}
+	nss_ubdns_stat_add(&s->cache_hits, 1);
+	nss_ubdns_stat_add(&s->latency[0], 1);
+	return (true);
 
+override:
+	nss_ubdns_stat_add(&s->overrides, 1);
+	nss_ubdns_stat_add(&s->latency[0], 1);
 	return (true);
 }
 
-static int
-nss_ubdns_add_result(struct address **_list, unsigned *_n_list, struct ub_result *res, int af) {
-	struct address *list = *_list;
-	unsigned n_list = *_n_list;
-	int i;
+/*
+ * Start a lookup, whose query the caller has filled in. It is returned by
+ * nss_ubdns_pipeline_next() once it is complete, possibly straight away.
+ */
+void
+nss_ubdns_pipeline_add(struct nss_ubdns_pipeline *p, struct nss_ubdns_lookup *l) {
+	struct nss_ubdns_context *c;
+	const char *qname;
+	unsigned i, n_hit = 0;
 
-	if (!nss_ubdns_check_result(res))
-		return (0);
+	nss_ubdns_config_check();
 
-	for (i = 0; res->data[i] != NULL; i++) {
-		if (res->len[i] == PROTO_ADDRESS_SIZE(af)) {
-			list = realloc(list, (n_list + 1) * sizeof(struct address));
-			if (!list)
-				return (-1);
+	l->pipeline = p;
+	l->context = NULL;
+	l->ready = false;
+	l->expired = false;
+	l->deadline = 0;
+	l->r = 0;
+	l->ttl = 0;
+	l->list = l->buf;
+	l->n_list = 0;
+	l->n_names = 0;
+	l->names_len = 0;
+	l->names = l->names_buf;
+	l->n_q = 0;
+
+	l->next = NULL;
+	l->prev = p->tail;
+	if (p->tail != NULL)
+		p->tail->next = l;
+	else
+		p->head = l;
+	p->tail = l;
+
+	if (l->reverse) {
+		if (l->af == AF_INET)
+			l->key_len = arpa_qname_ip4(l->addr, l->key);
+		else
+			l->key_len = arpa_qname_ip6(l->addr, l->key);
+		qname = l->key;
+	} else {
+		l->key_len = nss_ubdns_qname_key(l->name, l->key, sizeof(l->key));
+		if (l->key_len == 0)
+			l->key[0] = '\0';
+		qname = l->name;
+	}
+
+	if (nss_ubdns_pipeline_cached(l)) {
+		nss_ubdns_pipeline_ready(l);
+		return;
+	}
+
+	l->start = nss_ubdns_now_ns();
+	l->deadline = nss_ubdns_deadline();
+	l->n_q = nss_ubdns_queries_init(l->reverse ? NSS_UBDNS_CACHE_PTR : l->af, l->q);
+	for (i = 0; i < l->n_q; i++) {
+		NSS_UBDNS_PROBE3(resolve__start, qname, l->q[i].rrtype);
+		l->q[i].res = NULL;
+		l->q[i].done = false;
+		l->q[i].cached = false;
+		l->q[i].lookup = l;
+		if (nss_ubdns_shmcache_lookup(qname, &l->q[i]) == 0)
+			n_hit++;
+	}
+	if (n_hit > 0)
+		nss_ubdns_stat_add(&nss_ubdns_stats()->shm_hits, n_hit);
+	if (n_hit == l->n_q) {
+		nss_ubdns_pipeline_ready(l);
+		return;
+	}
 
-			list[n_list].family = af;
-			list[n_list].scope = 0;
-			memcpy(list[n_list].address, res->data[i], PROTO_ADDRESS_SIZE(af));
-			n_list += 1;
+	/* the same name always goes to the same context, as for any other lookup */
+	c = nss_ubdns_ctx_acquire(nss_ubdns_qname_hash(l->key, 0));
+	if (c != NULL && !nss_ubdns_pipeline_use(p, c)) {
+		nss_ubdns_ctx_release(c);
+		c = NULL;
+	}
+	if (c == NULL) {
+		for (i = 0; i < l->n_q; i++) {
+			if (l->q[i].done)
+				continue;
+			l->q[i].err = UB_INITFAIL;
+			l->q[i].done = true;
 		}
+		nss_ubdns_pipeline_ready(l);
+		return;
 	}
 
-	*_list = list;
-	*_n_list = n_list;
-	return (0);
+	l->context = c;
+	for (i = 0; i < l->n_q; i++)
+		if (!l->q[i].done)
+			nss_ubdns_resolve_start(c, qname, &l->q[i], 1, l);
+
+	/* an answer may be in already, or a query may have failed to start */
+	pthread_mutex_lock(&c->wait_lock);
+	nss_ubdns_pipeline_check(l);
+	pthread_mutex_unlock(&c->wait_lock);
+}
+
+/* Give up on the unfinished lookups whose deadline has passed. */
+static void
+nss_ubdns_pipeline_expire(struct nss_ubdns_pipeline *p) {
+	struct nss_ubdns_lookup *l;
+	int64_t now = 0;
+
+	for (l = p->head; l != NULL; l = l->next) {
+		if (l->deadline == 0 || l->expired || __atomic_load_n(&l->ready, __ATOMIC_RELAXED))
+			continue;
+		if (now == 0)
+			now = nss_ubdns_now_ms();
+		if (l->deadline > now)
+			break;
+		l->expired = true;
+		nss_ubdns_pipeline_cancel(l, NSS_UBDNS_ERR_TIMEOUT);
+	}
 }
 
+/*
+ * Milliseconds until the next deadline of an unfinished lookup, for
+ * waiting on the pipeline's fd, or -1 if there is none.
+ */
 int
-nss_ubdns_lookup_forward(const char *hn, int af, struct address **_list, unsigned *_n_list) {
-	struct address *list = NULL;
-	unsigned n_list = 0;
-	int r = 1;
-	int ret;
+nss_ubdns_pipeline_timeout(const struct nss_ubdns_pipeline *p) {
+	const struct nss_ubdns_lookup *l;
+	int64_t ms;
 
-	struct ub_result *res;
+	for (l = p->head; l != NULL; l = l->next) {
+		if (l->deadline == 0 || l->expired || __atomic_load_n(&l->ready, __ATOMIC_RELAXED))
+			continue;
+		ms = l->deadline - nss_ubdns_now_ms();
+		return (ms > 0 ? ms : 0);
+	}
+	return (-1);
+}
+
+/* Read the answers that have arrived, and give up on the lookups that are late. */
+static void
+nss_ubdns_pipeline_process(struct nss_ubdns_pipeline *p) {
+	struct epoll_event ev[16];
+	struct nss_ubdns_context *c;
+	uint64_t n;
+	int i, n_ev;
 
-	if (ctx == NULL)
-		goto err;
+	n_ev = epoll_wait(p->epfd, ev, sizeof(ev) / sizeof(ev[0]), 0);
+	for (i = 0; i < n_ev; i++) {
+		c = ev[i].data.ptr;
+		if (c == NULL) {
+			if (read(p->evfd, &n, sizeof(n)) < 0)
+				;	/* drained by a previous call */
+			nss_ubdns_pipeline_unpark(p);
+			continue;
+		}
 
-	if (af == AF_INET || af == AF_UNSPEC) {
-		ret = ub_resolve(ctx, (char *) hn, NSS_UBDNS_TYPE_A, 1 /*IN*/, &res);
-		if (ret != 0)
-			goto err;
+		pthread_mutex_lock(&c->wait_lock);
+		if (c->wait_processing) {
+			nss_ubdns_pipeline_park(p, c);
+			pthread_mutex_unlock(&c->wait_lock);
+			continue;
+		}
+		c->wait_processing = true;
+		pthread_mutex_unlock(&c->wait_lock);
 
-		ret = nss_ubdns_add_result(&list, &n_list, res, AF_INET);
-		if (ret != 0)
-			goto err;
+		ub_process(c->ctx);
 
-		ub_resolve_free(res);
+		pthread_mutex_lock(&c->wait_lock);
+		nss_ubdns_processing_done(c);
+		pthread_mutex_unlock(&c->wait_lock);
 	}
 
-	if (af == AF_INET6 || af == AF_UNSPEC) {
-		ret = ub_resolve(ctx, (char *) hn, NSS_UBDNS_TYPE_AAAA, 1 /*IN*/, &res);
-		if (ret != 0)
-			goto err;
+	nss_ubdns_pipeline_expire(p);
+}
 
-		ret = nss_ubdns_add_result(&list, &n_list, res, AF_INET6);
-		if (ret != 0)
-			goto err;
+static struct nss_ubdns_lookup *
+nss_ubdns_pipeline_pop(struct nss_ubdns_pipeline *p) {
+	struct nss_ubdns_lookup *l;
 
-		ub_resolve_free(res);
+	pthread_mutex_lock(&p->lock);
+	l = p->ready;
+	if (l != NULL) {
+		p->ready = l->ready_next;
+		if (p->ready == NULL)
+			p->ready_tail = &p->ready;
 	}
+	pthread_mutex_unlock(&p->lock);
+	return (l);
+}
 
-finish:
-	if (r < 0) {
-		free(list);
-	} else {
-		qsort(list, n_list, sizeof(struct address), address_compare);
+/*
+ * Return the next complete lookup, or NULL if there is none yet, without
+ * waiting. Its result must be released with nss_ubdns_lookup_release().
+ */
+struct nss_ubdns_lookup *
+nss_ubdns_pipeline_next(struct nss_ubdns_pipeline *p) {
+	struct nss_ubdns_lookup *l;
 
-		*_list = list;
-		*_n_list = n_list;
+	l = nss_ubdns_pipeline_pop(p);
+	if (l == NULL) {
+		nss_ubdns_pipeline_process(p);
+		l = nss_ubdns_pipeline_pop(p);
+		if (l == NULL)
+			return (NULL);
 	}
 
-	return r;
-err:
-	r = 0;
-	goto finish;
+	if (l->prev != NULL)
+		l->prev->next = l->next;
+	else
+		p->head = l->next;
+	if (l->next != NULL)
+		l->next->prev = l->prev;
+	else
+		p->tail = l->prev;
+
+	if (l->n_q > 0) {
+		nss_ubdns_resolve_done(l->reverse ? l->key : l->name, l->q, l->n_q);
+		if (l->reverse) {
+			size_t room = nss_ubdns_lookup_names_room(l, nss_ubdns_reverse_size(l->q));
+
+			l->r = nss_ubdns_reverse_answer(l->key, l->key_len, l->q,
+							l->names, room,
+							&l->names_len, &l->n_names, &l->ttl);
+		} else
+			l->r = nss_ubdns_forward_answer(l->af, l->key, l->key_len, l->q, l->n_q,
+							l->buf, NSS_UBDNS_ADDRESSES_STACK,
+							&l->list, &l->n_list,
+							l->names, &l->names_len, &l->ttl);
+		nss_ubdns_stats_latency(nss_ubdns_stats(), l->start);
+	}
+	if (l->context != NULL) {
+		nss_ubdns_pipeline_unuse(p, l->context);
+		l->context = NULL;
+	}
+	return (l);
 }
 
-char *
-nss_ubdns_lookup_reverse(const void *addr, int af) {
-	struct ub_result *res = NULL;
-	char *qname = NULL;
-	int ret;
+/*
+ * Give up on an unfinished lookup, which fails with NSS_UBDNS_ERR_CANCELLED.
+ * It is still returned by nss_ubdns_pipeline_next(), and may have completed
+ * before it could be cancelled.
+ */
+void
+nss_ubdns_lookup_cancel(struct nss_ubdns_lookup *l) {
+	nss_ubdns_pipeline_cancel(l, NSS_UBDNS_ERR_CANCELLED);
+}
 
-	if (ctx == NULL)
-		return (NULL);
+void
+nss_ubdns_lookup_release(struct nss_ubdns_lookup *l) {
+	if (l->list != l->buf)
+		free(l->list);
+	l->list = l->buf;
+	if (l->names != l->names_buf)
+		free(l->names);
+	l->names = l->names_buf;
+}
 
-	if (af == AF_INET) {
-		arpa_qname_ip4(addr, &qname);
-	} else if (af == AF_INET6) {
-		arpa_qname_ip6(addr, &qname);
-	} else {
-		return (NULL);
-	}
+/* Cancel the unfinished lookups, and free the pipeline once they are done. */
+void
+nss_ubdns_pipeline_free(struct nss_ubdns_pipeline *p) {
+	struct nss_ubdns_lookup *l;
+	struct pollfd pfd;
 
-	ret = ub_resolve(ctx, qname, NSS_UBDNS_TYPE_PTR, 1 /*IN*/, &res);
+	for (l = p->head; l != NULL; l = l->next)
+		nss_ubdns_pipeline_cancel(l, NSS_UBDNS_ERR_CANCELLED);
 
-	if (ret == 0 &&
-	    nss_ubdns_check_result(res) &&
-	    res->data[0] != NULL)
-	{
-		char name[NSS_UBDNS_PRESLEN_NAME];
-		domain_to_str((const uint8_t *) res->data[0], res->len[0], name);
-		ub_resolve_free(res);
-		return (strdup(name));
+	/* answers being delivered as we cancelled still point into the lookups */
+	pfd.fd = p->epfd;
+	pfd.events = POLLIN;
+	while (p->head != NULL) {
+		l = nss_ubdns_pipeline_next(p);
+		if (l != NULL)
+			nss_ubdns_lookup_release(l);
+		else
+			poll(&pfd, 1, -1);
 	}
 
-	if (res != NULL)
-		ub_resolve_free(res);
-
-	return (NULL);
+	close(p->epfd);
+	close(p->evfd);
+	pthread_mutex_destroy(&p->lock);
+	free(p->contexts);
+	free(p);
 }
@@ -0,0 +1,614 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* nss-ubdns-bench - time lookups made directly through the module's entry points */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <netdb.h>
+#include <nss.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_MODULE	"./libnss_ubdns.so.2"
+
+typedef enum nss_status (*gethostbyname4_r_fn)(
+		const char *name,
+		struct gaih_addrtuple **pat,
+		char *buffer, size_t buflen,
+		int *errnop, int *h_errnop,
+		int32_t *ttlp);
+
+typedef enum nss_status (*gethostbyname3_r_fn)(
+		const char *name,
+		int af,
+		struct hostent *result,
+		char *buffer, size_t buflen,
+		int *errnop, int *h_errnop,
+		int32_t *ttlp,
+		char **canonp);
+
+typedef enum nss_status (*gethostbyaddr2_r_fn)(
+		const void *addr, socklen_t len,
+		int af,
+		struct hostent *result,
+		char *buffer, size_t buflen,
+		int *errnop, int *h_errnop,
+		int32_t *ttlp);
+
+static gethostbyname4_r_fn gethostbyname4_r;
+static gethostbyname3_r_fn gethostbyname3_r;
+static gethostbyaddr2_r_fn gethostbyaddr2_r;
+
+enum entry {
+	ENTRY_GETHOSTBYNAME4,
+	ENTRY_GETHOSTBYNAME3,
+	ENTRY_GETHOSTBYADDR2,
+};
+
+static const char *entry_names[] = {
+	[ENTRY_GETHOSTBYNAME4] = "gethostbyname4_r",
+	[ENTRY_GETHOSTBYNAME3] = "gethostbyname3_r",
+	[ENTRY_GETHOSTBYADDR2] = "gethostbyaddr2_r",
+};
+
+enum workload {
+	WORKLOAD_COLD,
+	WORKLOAD_WARM,
+	WORKLOAD_MIXED,
+};
+
+static const char *workload_names[] = {
+	[WORKLOAD_COLD] = "cold",
+	[WORKLOAD_WARM] = "warm",
+	[WORKLOAD_MIXED] = "mixed",
+};
+
+/* a name to look up, or for gethostbyaddr2_r an address */
+struct query {
+	char *name;
+	int af;
+	uint8_t addr[16];
+};
+
+struct thread {
+	pthread_t tid;
+	const struct query **queries;
+	size_t n_queries;
+	uint64_t *samples;
+	size_t n_found;
+	uint64_t allocs;
+};
+
+#define HISTOGRAM_BUCKETS	32	/* powers of two, in microseconds */
+
+static enum entry entry = ENTRY_GETHOSTBYNAME4;
+static pthread_barrier_t start_barrier;
+
+/*
+ * Count the heap allocations made by each thread, including those made inside
+ * the module and libunbound, by interposing on the allocator.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static __thread uint64_t n_allocs;
+
+void *
+malloc(size_t size) {
+	n_allocs++;
+	return (__libc_malloc(size));
+}
+
+void *
+calloc(size_t nmemb, size_t size) {
+	n_allocs++;
+	return (__libc_calloc(nmemb, size));
+}
+
+void *
+realloc(void *ptr, size_t size) {
+	n_allocs++;
+	return (__libc_realloc(ptr, size));
+}
+
+static uint64_t
+now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static int
+cmp_u64(const void *_a, const void *_b) {
+	uint64_t a = *(const uint64_t *) _a, b = *(const uint64_t *) _b;
+
+	return (a < b ? -1 : a > b);
+}
+
+static double
+percentile_us(uint64_t *v, size_t n, double p) {
+	size_t i;
+
+	if (n == 0)
+		return (0.0);
+	i = (size_t) (p * (n - 1) + 0.5);
+	return (v[i] / 1000.0);
+}
+
+static void
+usage(void) {
+	fprintf(stderr,
+		"Usage: nss-ubdns-bench [-m MODULE] [-e ENTRY] [-W WORKLOAD] [-t THREADS]\n"
+		"                       [-z ZONE [-n NAMES]] [-N LOOKUPS] [-x PERCENT]\n"
+		"                       [-j] [-H] [-L LABEL]\n"
+		"       nss-ubdns-bench [-m MODULE] -s COUNT\n"
+		"\n"
+		"Calls one of the module's entry points from THREADS threads (default 1)\n"
+		"and reports throughput, latency percentiles and heap allocations per\n"
+		"call. ENTRY is gethostbyname4_r (the default), gethostbyname3_r or\n"
+		"gethostbyaddr2_r.\n"
+		"\n"
+		"Names, or addresses for gethostbyaddr2_r, are read from stdin one per\n"
+		"line, or with -z generated: NAMES (default 1000) distinct names under\n"
+		"ZONE, or addresses in 10.0.0.0/8.\n"
+		"\n"
+		"WORKLOAD is one of:\n"
+		"  cold   every name is looked up once (the default)\n"
+		"  warm   the names are looked up once, then each thread performs\n"
+		"         LOOKUPS (default 100000) timed lookups of them\n"
+		"  mixed  as warm, but PERCENT (default 10) of the timed lookups are of\n"
+		"         names never seen before; requires -z\n"
+		"\n"
+		"With -j, the results are printed as a single JSON object. With -H,\n"
+		"they include a histogram of the latencies, and with -L LABEL, the\n"
+		"given label.\n"
+		"\n"
+		"With -s, instead times COUNT executions of a process that loads\n"
+		"the module and exits without performing any lookups.\n");
+	exit(EXIT_FAILURE);
+}
+
+static void
+print_samples(const char *what, uint64_t *samples, size_t n_samples) {
+	qsort(samples, n_samples, sizeof(*samples), cmp_u64);
+	printf("%s %zu p50 %.1fus p99 %.1fus max %.1fus\n",
+	       what, n_samples,
+	       percentile_us(samples, n_samples, 0.50),
+	       percentile_us(samples, n_samples, 0.99),
+	       n_samples > 0 ? samples[n_samples - 1] / 1000.0 : 0.0);
+}
+
+static enum nss_status
+lookup(const struct query *q) {
+	char buf[16384];
+	int errnop, h_errnop;
+	int32_t ttl;
+
+	switch (entry) {
+	case ENTRY_GETHOSTBYNAME4: {
+		struct gaih_addrtuple *pat = NULL;
+
+		return (gethostbyname4_r(q->name, &pat, buf, sizeof(buf),
+					 &errnop, &h_errnop, &ttl));
+	}
+	case ENTRY_GETHOSTBYNAME3: {
+		struct hostent he;
+
+		return (gethostbyname3_r(q->name, AF_INET, &he, buf, sizeof(buf),
+					 &errnop, &h_errnop, &ttl, NULL));
+	}
+	case ENTRY_GETHOSTBYADDR2: {
+		struct hostent he;
+
+		return (gethostbyaddr2_r(q->addr, q->af == AF_INET ? 4 : 16, q->af,
+					 &he, buf, sizeof(buf),
+					 &errnop, &h_errnop, &ttl));
+	}
+	}
+	return (NSS_STATUS_UNAVAIL);
+}
+
+static bool
+query_init(struct query *q, const char *name) {
+	q->name = strdup(name);
+	if (q->name == NULL)
+		return (false);
+	q->af = AF_UNSPEC;
+	if (entry != ENTRY_GETHOSTBYADDR2)
+		return (true);
+	if (inet_pton(AF_INET, name, q->addr) == 1) {
+		q->af = AF_INET;
+	} else if (inet_pton(AF_INET6, name, q->addr) == 1) {
+		q->af = AF_INET6;
+	} else {
+		fprintf(stderr, "nss-ubdns-bench: invalid address %s\n", name);
+		return (false);
+	}
+	return (true);
+}
+
+/* Generate the n'th distinct name under zone, or address in 10.0.0.0/8. */
+static bool
+query_generate(struct query *q, const char *zone, size_t n) {
+	char name[300];
+
+	if (entry == ENTRY_GETHOSTBYADDR2)
+		snprintf(name, sizeof(name), "10.%zu.%zu.%zu",
+			 (n >> 16) & 0xff, (n >> 8) & 0xff, n & 0xff);
+	else
+		snprintf(name, sizeof(name), "n%zu.%s", n, zone);
+	return (query_init(q, name));
+}
+
+static void *
+thread_run(void *arg) {
+	struct thread *t = arg;
+	uint64_t t0, allocs;
+	size_t i;
+
+	pthread_barrier_wait(&start_barrier);
+
+	allocs = n_allocs;
+	for (i = 0; i < t->n_queries; i++) {
+		t0 = now_ns();
+		if (lookup(t->queries[i]) == NSS_STATUS_SUCCESS)
+			t->n_found++;
+		t->samples[i] = now_ns() - t0;
+	}
+	t->allocs = n_allocs - allocs;
+	return (NULL);
+}
+
+static void
+report(bool json, bool histogram, const char *label, enum workload workload,
+       size_t n_threads, struct thread *threads, uint64_t elapsed)
+{
+	uint64_t *samples, allocs = 0;
+	size_t buckets[HISTOGRAM_BUCKETS] = { 0 };
+	size_t i, n_samples = 0, n_found = 0, last = 0;
+	double seconds = elapsed / 1e9;
+
+	for (i = 0; i < n_threads; i++)
+		n_samples += threads[i].n_queries;
+	samples = calloc(n_samples > 0 ? n_samples : 1, sizeof(*samples));
+	if (samples == NULL)
+		exit(EXIT_FAILURE);
+	for (i = 0, n_samples = 0; i < n_threads; i++) {
+		memcpy(samples + n_samples, threads[i].samples,
+		       threads[i].n_queries * sizeof(*samples));
+		n_samples += threads[i].n_queries;
+		n_found += threads[i].n_found;
+		allocs += threads[i].allocs;
+	}
+	qsort(samples, n_samples, sizeof(*samples), cmp_u64);
+
+	/* bucket b counts latencies below 2^b microseconds */
+	for (i = 0; i < n_samples; i++) {
+		uint64_t us = samples[i] / 1000;
+		size_t b = 0;
+
+		while (b < HISTOGRAM_BUCKETS - 1 && us >= ((uint64_t) 1 << b))
+			b++;
+		buckets[b]++;
+		last = b;
+	}
+
+	if (json) {
+		printf("{");
+		if (label != NULL)
+			printf("\"label\": \"%s\", ", label);
+		printf("\"workload\": \"%s\", \"entry\": \"%s\", \"threads\": %zu, "
+		       "\"calls\": %zu, \"found\": %zu, \"seconds\": %.6f, \"qps\": %.1f, "
+		       "\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f, "
+		       "\"allocs_per_call\": %.3f",
+		       workload_names[workload], entry_names[entry], n_threads,
+		       n_samples, n_found, seconds,
+		       seconds > 0 ? n_samples / seconds : 0.0,
+		       percentile_us(samples, n_samples, 0.50),
+		       percentile_us(samples, n_samples, 0.99),
+		       percentile_us(samples, n_samples, 0.999),
+		       n_samples > 0 ? samples[n_samples - 1] / 1000.0 : 0.0,
+		       n_samples > 0 ? (double) allocs / n_samples : 0.0);
+		if (histogram) {
+			printf(", \"histogram_us\": {");
+			for (i = 0; i <= last; i++)
+				printf("%s\"%llu\": %zu", i > 0 ? ", " : "",
+				       1ULL << i, buckets[i]);
+			printf("}");
+		}
+		printf("}\n");
+	} else {
+		if (label != NULL)
+			printf("%s: ", label);
+		printf("%s %s threads %zu\n",
+		       workload_names[workload], entry_names[entry], n_threads);
+		printf("calls %zu found %zu seconds %.3f qps %.0f\n",
+		       n_samples, n_found, seconds,
+		       seconds > 0 ? n_samples / seconds : 0.0);
+		printf("p50 %.1fus p99 %.1fus p999 %.1fus max %.1fus\n",
+		       percentile_us(samples, n_samples, 0.50),
+		       percentile_us(samples, n_samples, 0.99),
+		       percentile_us(samples, n_samples, 0.999),
+		       n_samples > 0 ? samples[n_samples - 1] / 1000.0 : 0.0);
+		printf("allocs %.2f/call\n",
+		       n_samples > 0 ? (double) allocs / n_samples : 0.0);
+		for (i = 0; histogram && i <= last; i++)
+			printf("  < %7lluus %zu\n", 1ULL << i, buckets[i]);
+	}
+	free(samples);
+}
+
+static int
+bench_startup(const char *self, const char *module, size_t count) {
+	uint64_t *samples;
+	size_t i;
+
+	samples = calloc(count, sizeof(*samples));
+	if (samples == NULL)
+		return (EXIT_FAILURE);
+
+	for (i = 0; i < count; i++) {
+		uint64_t t0 = now_ns();
+		int status;
+		pid_t pid;
+
+		pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			return (EXIT_FAILURE);
+		}
+		if (pid == 0) {
+			execl(self, self, "-m", module, "-l", (char *) NULL);
+			_exit(127);
+		}
+		if (waitpid(pid, &status, 0) == -1 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			fprintf(stderr, "nss-ubdns-bench: child failed to load %s\n", module);
+			return (EXIT_FAILURE);
+		}
+		samples[i] = now_ns() - t0;
+	}
+
+	print_samples("execs", samples, count);
+	free(samples);
+	return (EXIT_SUCCESS);
+}
+
+int
+main(int argc, char **argv) {
+	const char *module = DEFAULT_MODULE;
+	const char *zone = NULL, *label = NULL;
+	enum workload workload = WORKLOAD_COLD;
+	void *handle;
+	struct query *names = NULL, *fresh = NULL;
+	struct thread *threads;
+	size_t n_names = 0, n_fresh = 0, n_generate = 1000;
+	size_t n_threads = 1, n_lookups = 100000, cold_percent = 10;
+	size_t startup_count = 0;
+	size_t i, j, k;
+	bool load_only = false, json = false, histogram = false;
+	uint64_t t0;
+	int c;
+
+	while ((c = getopt(argc, argv, "e:jlm:n:s:t:x:z:HL:N:W:")) != -1) {
+		switch (c) {
+		case 'e':
+			for (i = 0; i < sizeof(entry_names) / sizeof(entry_names[0]); i++)
+				if (strcmp(optarg, entry_names[i]) == 0)
+					break;
+			if (i == sizeof(entry_names) / sizeof(entry_names[0]))
+				usage();
+			entry = i;
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'l':
+			load_only = true;
+			break;
+		case 'm':
+			module = optarg;
+			break;
+		case 'n':
+			n_generate = strtoul(optarg, NULL, 10);
+			if (n_generate == 0)
+				usage();
+			break;
+		case 's':
+			startup_count = strtoul(optarg, NULL, 10);
+			if (startup_count == 0)
+				usage();
+			break;
+		case 't':
+			n_threads = strtoul(optarg, NULL, 10);
+			if (n_threads == 0)
+				usage();
+			break;
+		case 'x':
+			cold_percent = strtoul(optarg, NULL, 10);
+			if (cold_percent > 100)
+				usage();
+			break;
+		case 'z':
+			zone = optarg;
+			break;
+		case 'H':
+			histogram = true;
+			break;
+		case 'L':
+			label = optarg;
+			break;
+		case 'N':
+			n_lookups = strtoul(optarg, NULL, 10);
+			if (n_lookups == 0)
+				usage();
+			break;
+		case 'W':
+			for (i = 0; i < sizeof(workload_names) / sizeof(workload_names[0]); i++)
+				if (strcmp(optarg, workload_names[i]) == 0)
+					break;
+			if (i == sizeof(workload_names) / sizeof(workload_names[0]))
+				usage();
+			workload = i;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (workload == WORKLOAD_MIXED && zone == NULL)
+		usage();
+
+	if (startup_count > 0)
+		return (bench_startup(argv[0], module, startup_count));
+
+	handle = dlopen(module, RTLD_NOW);
+	if (handle == NULL) {
+		fprintf(stderr, "nss-ubdns-bench: %s\n", dlerror());
+		return (EXIT_FAILURE);
+	}
+	if (load_only)
+		return (EXIT_SUCCESS);
+	gethostbyname4_r = (gethostbyname4_r_fn) dlsym(handle, "_nss_ubdns_gethostbyname4_r");
+	gethostbyname3_r = (gethostbyname3_r_fn) dlsym(handle, "_nss_ubdns_gethostbyname3_r");
+	gethostbyaddr2_r = (gethostbyaddr2_r_fn) dlsym(handle, "_nss_ubdns_gethostbyaddr2_r");
+	if (gethostbyname4_r == NULL || gethostbyname3_r == NULL || gethostbyaddr2_r == NULL) {
+		fprintf(stderr, "nss-ubdns-bench: %s\n", dlerror());
+		return (EXIT_FAILURE);
+	}
+
+	if (zone != NULL) {
+		names = calloc(n_generate, sizeof(*names));
+		if (names == NULL)
+			return (EXIT_FAILURE);
+		for (n_names = 0; n_names < n_generate; n_names++)
+			if (!query_generate(&names[n_names], zone, n_names))
+				return (EXIT_FAILURE);
+	} else {
+		char *line = NULL;
+		size_t len = 0;
+		ssize_t bytes_read;
+
+		while ((bytes_read = getline(&line, &len, stdin)) != -1) {
+			if (bytes_read > 0 && line[bytes_read - 1] == '\n')
+				line[--bytes_read] = '\0';
+			if (bytes_read == 0)
+				continue;
+
+			names = realloc(names, (n_names + 1) * sizeof(*names));
+			if (names == NULL || !query_init(&names[n_names], line))
+				return (EXIT_FAILURE);
+			n_names++;
+		}
+		free(line);
+	}
+	if (n_names == 0)
+		usage();
+
+	threads = calloc(n_threads, sizeof(*threads));
+	if (threads == NULL)
+		return (EXIT_FAILURE);
+
+	if (workload == WORKLOAD_COLD) {
+		/* deal the names out to the threads */
+		for (i = 0; i < n_threads; i++) {
+			threads[i].queries = calloc(n_names / n_threads + 1, sizeof(struct query *));
+			if (threads[i].queries == NULL)
+				return (EXIT_FAILURE);
+		}
+		for (i = 0; i < n_names; i++) {
+			struct thread *t = &threads[i % n_threads];
+			t->queries[t->n_queries++] = &names[i];
+		}
+	} else {
+		/* look every name up once, untimed, so that the cache is warm */
+		for (i = 0; i < n_names; i++)
+			lookup(&names[i]);
+
+		if (workload == WORKLOAD_MIXED) {
+			n_fresh = n_threads * (n_lookups * cold_percent / 100 + 1);
+			fresh = calloc(n_fresh, sizeof(*fresh));
+			if (fresh == NULL)
+				return (EXIT_FAILURE);
+			for (i = 0; i < n_fresh; i++)
+				if (!query_generate(&fresh[i], zone, n_names + i))
+					return (EXIT_FAILURE);
+		}
+
+		for (i = 0, k = 0; i < n_threads; i++) {
+			struct thread *t = &threads[i];
+
+			t->queries = calloc(n_lookups, sizeof(struct query *));
+			if (t->queries == NULL)
+				return (EXIT_FAILURE);
+			for (j = 0; j < n_lookups; j++) {
+				if (workload == WORKLOAD_MIXED &&
+				    (j + 1) * cold_percent / 100 != j * cold_percent / 100)
+					t->queries[j] = &fresh[k++];
+				else
+					t->queries[j] = &names[(i * n_names / n_threads + j) % n_names];
+			}
+			t->n_queries = n_lookups;
+		}
+	}
+
+	for (i = 0; i < n_threads; i++) {
+		threads[i].samples = calloc(threads[i].n_queries + 1, sizeof(uint64_t));
+		if (threads[i].samples == NULL)
+			return (EXIT_FAILURE);
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, n_threads + 1);
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&threads[i].tid, NULL, thread_run, &threads[i]) != 0) {
+			perror("pthread_create");
+			return (EXIT_FAILURE);
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	t0 = now_ns();
+	for (i = 0; i < n_threads; i++)
+		pthread_join(threads[i].tid, NULL);
+
+	report(json, histogram, label, workload, n_threads, threads, now_ns() - t0);
+
+	for (i = 0; i < n_threads; i++) {
+		free(threads[i].queries);
+		free(threads[i].samples);
+	}
+	free(threads);
+	for (i = 0; i < n_names; i++)
+		free(names[i].name);
+	free(names);
+	for (i = 0; i < n_fresh; i++)
+		free(fresh[i].name);
+	free(fresh);
+	dlclose(handle);
+	return (EXIT_SUCCESS);
+}
@@ -0,0 +1,705 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * nss-ubdns-cached - shared validating resolver for the nss-ubdns module
+ *
+ * Owns one long-lived libunbound context, so that its message, rrset and key
+ * caches are shared by every process on the host instead of being rebuilt by
+ * each one. Identical queries from different clients that are in flight at
+ * the same time are merged into a single resolution.
+ *
+ * Clients refresh popular answers shortly before they expire with prefetch
+ * requests. Those are resolved on a second context whose answer caches are
+ * disabled, so that the answer is fetched afresh rather than being the one
+ * about to expire, and it replaces the old one in the shared cache.
+ *
+ * The shared cache is saved to a snapshot every few minutes and on exit, and
+ * reloaded from it on start, so that the answers and the work of validating
+ * them survive a restart or a reboot for as long as their TTLs allow.
+ * libunbound has no way to save its own caches, key cache included, so a
+ * restarted daemon still validates afresh whatever is not in the snapshot.
+ * Processes that start while the daemon is down are answered from the
+ * snapshot too. The periodic snapshots are written by a helper thread, so
+ * that copying the cache and waiting for fsync() don't hold up clients.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <unbound.h>
+
+#include "nss-ubdns.h"
+
+#define INFLIGHT_BUCKETS	4096
+
+/*
+ * The socket is open to every user, so prefetch requests are rate limited:
+ * a name is refetched at most once every PREFETCH_INTERVAL seconds, and
+ * prefetches of it in between are answered from the cache like any other
+ * request. Names sharing a bucket share the limit.
+ */
+#define PREFETCH_BUCKETS	4096
+#define PREFETCH_INTERVAL	10
+
+/* drop clients that stop reading their replies */
+#define CLIENT_MAX_WBUF		(1024 * 1024)
+
+struct client {
+	int fd;
+	bool dead;
+	unsigned refs;		/* waiters still pointing at this client */
+	uint8_t rbuf[sizeof(struct nss_ubdns_cached_request) + NSS_UBDNS_PRESLEN_NAME];
+	size_t rlen;
+	uint8_t *wbuf;
+	size_t wlen, wsize;
+	struct client *next;
+};
+
+struct waiter {
+	struct client *client;
+	uint32_t id;
+	struct waiter *next;
+};
+
+/*
+ * A context and the number of queries outstanding on it. When the
+ * configuration changes, a new context takes over and the old one is
+ * deleted once its outstanding queries have completed.
+ */
+struct resolver {
+	struct ub_ctx *ctx;
+	struct ub_ctx *prefetch_ctx;	/* created by the first prefetch request */
+	unsigned n_inflight;
+};
+
+struct inflight {
+	char qname[NSS_UBDNS_PRESLEN_NAME];	/* lowercased, no trailing dot */
+	int rrtype;
+	bool prefetch;
+	struct resolver *resolver;
+	unsigned bucket;
+	struct waiter *waiters;
+	struct inflight *next;
+};
+
+static struct resolver *current, *retiring;
+static uint64_t config_sig;
+static struct nss_ubdns_shmcache_header *shmcache;
+static struct client *clients;
+static unsigned n_clients;
+static struct inflight *inflight[INFLIGHT_BUCKETS];
+static int64_t prefetched[PREFETCH_BUCKETS];	/* when a bucket's name was last refetched */
+static volatile sig_atomic_t stop;
+
+/* the snapshot being written in the background, see snapshot_start() */
+static pthread_t snapshot_thread;
+static bool snapshot_started, snapshot_finished;
+static const char *snapshot_file;
+static uint64_t snapshot_sig;
+
+static void
+on_signal(int sig) {
+	(void) sig;
+	stop = 1;
+}
+
+static unsigned
+inflight_hash(const char *key, int rrtype) {
+	return (nss_ubdns_qname_hash(key, rrtype) % INFLIGHT_BUCKETS);
+}
+
+static void
+client_flush(struct client *c) {
+	ssize_t r;
+
+	while (c->wlen > 0 && !c->dead) {
+		r = send(c->fd, c->wbuf, c->wlen, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				c->dead = true;
+			return;
+		}
+		memmove(c->wbuf, c->wbuf + r, c->wlen - r);
+		c->wlen -= r;
+	}
+}
+
+static void
+client_append(struct client *c, const void *data, size_t len) {
+	if (c->dead)
+		return;
+
+	if (c->wlen + len > CLIENT_MAX_WBUF) {
+		c->dead = true;
+		return;
+	}
+	if (c->wlen + len > c->wsize) {
+		size_t wsize = c->wsize ? c->wsize : 4096;
+		uint8_t *wbuf;
+
+		while (wsize < c->wlen + len)
+			wsize *= 2;
+		wbuf = realloc(c->wbuf, wsize);
+		if (wbuf == NULL) {
+			c->dead = true;
+			return;
+		}
+		c->wbuf = wbuf;
+		c->wsize = wsize;
+	}
+	memcpy(c->wbuf + c->wlen, data, len);
+	c->wlen += len;
+}
+
+static void
+client_reply(struct client *c, uint32_t id, struct nss_ubdns_cached_reply *rep,
+	     const uint8_t *rdata)
+{
+	rep->id = id;
+	client_append(c, rep, sizeof(*rep));
+	client_append(c, rdata, rep->len);
+	client_flush(c);
+}
+
+static void
+client_reply_error(struct client *c, uint32_t id, int err) {
+	struct nss_ubdns_cached_reply rep;
+
+	memset(&rep, 0, sizeof(rep));
+	rep.err = err;
+	client_reply(c, id, &rep, NULL);
+}
+
+static void
+resolve_callback(void *mydata, int err, struct ub_result *res) {
+	struct inflight *inf = mydata, **pp;
+	struct nss_ubdns_cached_reply rep;
+	struct waiter *w, *next;
+	uint8_t *rdata = NULL;
+	int i;
+
+	memset(&rep, 0, sizeof(rep));
+	rep.err = err;
+
+	if (err == 0) {
+		size_t size = 0;
+		unsigned n_data = 0, n_names;
+
+		for (i = 0; res->data[i] != NULL; i++)
+			size += sizeof(uint16_t) + res->len[i];
+		if (size > NSS_UBDNS_CACHED_MAXMSG ||
+		    (rdata = malloc(size + NSS_UBDNS_NAMES_MAX)) == NULL)
+		{
+			rep.err = UB_NOMEM;
+		} else {
+			rep.len = nss_ubdns_result_rdata(res, rdata, size, &n_data);
+			rep.n_data = n_data;
+			rep.names_len = nss_ubdns_result_names(res, (char *) rdata + rep.len,
+							       NSS_UBDNS_NAMES_MAX, &n_names);
+			rep.len += rep.names_len;
+			rep.havedata = res->havedata;
+			rep.nxdomain = res->nxdomain;
+			rep.secure = res->secure;
+			rep.bogus = res->bogus;
+			rep.rcode = res->rcode;
+			rep.ttl = res->ttl;
+
+			if (shmcache != NULL)
+				nss_ubdns_shmcache_store(shmcache, inf->qname, inf->rrtype, res);
+		}
+		ub_resolve_free(res);
+	}
+
+	for (w = inf->waiters; w != NULL; w = next) {
+		next = w->next;
+		client_reply(w->client, w->id, &rep, rdata);
+		w->client->refs--;
+		free(w);
+	}
+	free(rdata);
+
+	for (pp = &inflight[inf->bucket]; *pp != inf; pp = &(*pp)->next)
+		;
+	*pp = inf->next;
+	inf->resolver->n_inflight--;
+	free(inf);
+}
+
+/* Whether a prefetch request may bypass the cache, see PREFETCH_INTERVAL. */
+static bool
+prefetch_allowed(const char *key, int rrtype) {
+	unsigned b = nss_ubdns_qname_hash(key, rrtype) % PREFETCH_BUCKETS;
+	int64_t now = nss_ubdns_now();
+
+	if (prefetched[b] != 0 && now - prefetched[b] < PREFETCH_INTERVAL)
+		return (false);
+	prefetched[b] = now;
+	return (true);
+}
+
+static void
+handle_request(struct client *c, const struct nss_ubdns_cached_request *req, const char *qname) {
+	struct inflight *inf;
+	struct waiter *w;
+	struct ub_ctx *ctx = current->ctx;
+	char key[NSS_UBDNS_PRESLEN_NAME];
+	bool prefetch = (req->rrtype & NSS_UBDNS_CACHED_PREFETCH) != 0;
+	int rrtype = req->rrtype & ~NSS_UBDNS_CACHED_PREFETCH;
+	size_t len;
+	int ret;
+
+	if (rrtype != NSS_UBDNS_TYPE_A &&
+	    rrtype != NSS_UBDNS_TYPE_AAAA &&
+	    rrtype != NSS_UBDNS_TYPE_PTR)
+	{
+		client_reply_error(c, req->id, UB_SYNTAX);
+		return;
+	}
+
+	len = nss_ubdns_qname_key(qname, key, sizeof(key));
+	if (len == 0) {
+		client_reply_error(c, req->id, UB_SYNTAX);
+		return;
+	}
+
+	if (prefetch)
+		prefetch = prefetch_allowed(key, rrtype);
+	if (prefetch) {
+		if (current->prefetch_ctx == NULL)
+			current->prefetch_ctx = nss_ubdns_prefetch_ctx_new();
+		ctx = current->prefetch_ctx;
+		if (ctx == NULL) {
+			client_reply_error(c, req->id, UB_NOMEM);
+			return;
+		}
+	}
+
+	w = malloc(sizeof(*w));
+	if (w == NULL) {
+		client_reply_error(c, req->id, UB_NOMEM);
+		return;
+	}
+	w->client = c;
+	w->id = req->id;
+
+	ret = 0;
+	for (inf = inflight[inflight_hash(key, rrtype)]; inf != NULL; inf = inf->next)
+		if (inf->rrtype == rrtype && inf->prefetch == prefetch &&
+		    inf->resolver == current && strcmp(inf->qname, key) == 0)
+			break;
+
+	if (inf == NULL) {
+		inf = calloc(1, sizeof(*inf));
+		if (inf == NULL) {
+			free(w);
+			client_reply_error(c, req->id, UB_NOMEM);
+			return;
+		}
+		memcpy(inf->qname, key, len + 1);
+		inf->rrtype = rrtype;
+		inf->prefetch = prefetch;
+		inf->bucket = inflight_hash(key, rrtype);
+		inf->resolver = current;
+
+		ret = ub_resolve_async(ctx, qname, rrtype, 1 /*IN*/,
+				       inf, resolve_callback, NULL);
+		if (ret != 0) {
+			free(inf);
+			free(w);
+			client_reply_error(c, req->id, ret);
+			return;
+		}
+		inf->next = inflight[inf->bucket];
+		inflight[inf->bucket] = inf;
+		current->n_inflight++;
+	}
+
+	w->next = inf->waiters;
+	inf->waiters = w;
+	c->refs++;
+}
+
+static void
+client_read(struct client *c) {
+	const size_t hlen = sizeof(struct nss_ubdns_cached_request);
+	struct nss_ubdns_cached_request req;
+	ssize_t r;
+
+	r = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen, MSG_DONTWAIT);
+	if (r < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if (r <= 0) {
+		c->dead = true;
+		return;
+	}
+	c->rlen += r;
+
+	while (c->rlen >= hlen && !c->dead) {
+		memcpy(&req, c->rbuf, hlen);
+		if (req.qname_len == 0 || req.qname_len > NSS_UBDNS_PRESLEN_NAME) {
+			c->dead = true;
+			return;
+		}
+		if (c->rlen < hlen + req.qname_len)
+			return;
+		if (c->rbuf[hlen + req.qname_len - 1] != '\0') {
+			c->dead = true;
+			return;
+		}
+
+		handle_request(c, &req, (const char *) c->rbuf + hlen);
+
+		c->rlen -= hlen + req.qname_len;
+		memmove(c->rbuf, c->rbuf + hlen + req.qname_len, c->rlen);
+	}
+}
+
+static void
+accept_clients(int lfd) {
+	struct client *c;
+	int fd;
+
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		c = calloc(1, sizeof(*c));
+		if (c == NULL) {
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->next = clients;
+		clients = c;
+		n_clients++;
+	}
+}
+
+static void
+reap_clients(void) {
+	struct client **pp, *c;
+
+	for (pp = &clients; (c = *pp) != NULL; ) {
+		if (c->dead && c->fd != -1) {
+			close(c->fd);
+			c->fd = -1;
+		}
+		if (c->dead && c->refs == 0) {
+			*pp = c->next;
+			free(c->wbuf);
+			free(c);
+			n_clients--;
+		} else {
+			pp = &c->next;
+		}
+	}
+}
+
+static struct resolver *
+resolver_new(void) {
+	struct resolver *r;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return (NULL);
+	r->ctx = nss_ubdns_ctx_new();
+	if (r->ctx == NULL) {
+		free(r);
+		return (NULL);
+	}
+	return (r);
+}
+
+static void
+resolver_free(struct resolver *r) {
+	ub_ctx_delete(r->ctx);
+	if (r->prefetch_ctx != NULL)
+		ub_ctx_delete(r->prefetch_ctx);
+	free(r);
+}
+
+/*
+ * Switch to a freshly configured context when resolv.conf, the trust anchors
+ * or libunbound.conf change. Queries already running on the old context are
+ * allowed to finish, but answers cached under the old configuration are
+ * withdrawn from the shared cache.
+ */
+static void
+check_config(void) {
+	struct resolver *r;
+	uint64_t sig;
+
+	if (retiring != NULL) {
+		if (retiring->n_inflight > 0)
+			return;
+		resolver_free(retiring);
+		retiring = NULL;
+	}
+
+	sig = nss_ubdns_config_signature();
+	if (sig == config_sig)
+		return;
+
+	r = resolver_new();
+	if (r == NULL)
+		return;
+	config_sig = sig;
+
+	retiring = current;
+	current = r;
+	if (shmcache != NULL)
+		nss_ubdns_shmcache_flush(shmcache);
+}
+
+static void *
+snapshot_run(void *arg) {
+	(void) arg;
+
+	if (!nss_ubdns_shmcache_snapshot(shmcache, snapshot_file, snapshot_sig))
+		fprintf(stderr, "nss-ubdns-cached: %s: %s\n", snapshot_file, strerror(errno));
+	__atomic_store_n(&snapshot_finished, true, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
+/* Wait for the snapshot being written, if there is one. */
+static void
+snapshot_wait(void) {
+	if (snapshot_started) {
+		pthread_join(snapshot_thread, NULL);
+		snapshot_started = false;
+	}
+}
+
+/*
+ * Start writing a snapshot to path on a thread of its own, which the signals
+ * that stop the daemon must not reach, unless the last one is still being
+ * written.
+ */
+static void
+snapshot_start(const char *path) {
+	sigset_t all, old;
+
+	if (snapshot_started && !__atomic_load_n(&snapshot_finished, __ATOMIC_ACQUIRE))
+		return;
+	snapshot_wait();
+
+	snapshot_file = path;
+	snapshot_sig = config_sig;
+	snapshot_finished = false;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	snapshot_started = (pthread_create(&snapshot_thread, NULL, snapshot_run, NULL) == 0);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (!snapshot_started)
+		snapshot_run(NULL);
+}
+
+static int
+listen_socket(const char *path) {
+	struct sockaddr_un sa;
+	char *dir;
+	int fd;
+
+	dir = strdup(path);
+	if (dir == NULL)
+		return (-1);
+	mkdir(dirname(dir), 0755);
+	free(dir);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	strcpy(sa.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return (-1);
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) != 0 ||
+	    chmod(path, 0666) != 0 ||
+	    listen(fd, SOMAXCONN) != 0)
+	{
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+static void
+usage(void) {
+	fprintf(stderr, "Usage: nss-ubdns-cached [-c CACHEFILE] [-S SNAPSHOT] [-s SOCKET]\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv) {
+	const char *path = NSS_UBDNS_CACHED_SOCKET;
+	const char *cache_path = NSS_UBDNS_SHMCACHE;
+	const char *snapshot_path = NSS_UBDNS_SNAPSHOT;
+	struct pollfd *pfds = NULL;
+	struct ub_ctx *ctxs[4];
+	struct sigaction sa;
+	struct client *c;
+	unsigned n_pfds = 0, n_fixed, n_ctxs, i;
+	int64_t checked = 0, saved;
+	char *dir;
+	int lfd, opt;
+
+	while ((opt = getopt(argc, argv, "c:S:s:")) != -1) {
+		switch (opt) {
+		case 'c':
+			cache_path = optarg;
+			break;
+		case 'S':
+			snapshot_path = optarg;
+			break;
+		case 's':
+			path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	config_sig = nss_ubdns_config_signature();
+	current = resolver_new();
+	if (current == NULL) {
+		fprintf(stderr, "nss-ubdns-cached: unable to create resolver context\n");
+		return (EXIT_FAILURE);
+	}
+
+	/* the daemon still works without the shared cache, just slower */
+	shmcache = nss_ubdns_shmcache_create(cache_path);
+	if (shmcache == NULL)
+		fprintf(stderr, "nss-ubdns-cached: %s: %s\n", cache_path, strerror(errno));
+	else
+		nss_ubdns_shmcache_restore(shmcache, snapshot_path, config_sig);
+	saved = nss_ubdns_now();
+
+	dir = strdup(snapshot_path);
+	if (dir != NULL) {
+		mkdir(dirname(dir), 0755);
+		free(dir);
+	}
+
+	lfd = listen_socket(path);
+	if (lfd == -1) {
+		fprintf(stderr, "nss-ubdns-cached: %s: %s\n", path, strerror(errno));
+		return (EXIT_FAILURE);
+	}
+
+	while (!stop) {
+		if (n_pfds < n_clients + 5) {
+			n_pfds = n_clients + 64;
+			pfds = realloc(pfds, n_pfds * sizeof(*pfds));
+			if (pfds == NULL)
+				return (EXIT_FAILURE);
+		}
+
+		n_ctxs = 0;
+		ctxs[n_ctxs++] = current->ctx;
+		if (current->prefetch_ctx != NULL)
+			ctxs[n_ctxs++] = current->prefetch_ctx;
+		if (retiring != NULL) {
+			ctxs[n_ctxs++] = retiring->ctx;
+			if (retiring->prefetch_ctx != NULL)
+				ctxs[n_ctxs++] = retiring->prefetch_ctx;
+		}
+
+		pfds[0].fd = lfd;
+		pfds[0].events = POLLIN;
+		for (i = 0; i < n_ctxs; i++) {
+			pfds[1 + i].fd = ub_fd(ctxs[i]);
+			pfds[1 + i].events = POLLIN;
+		}
+		n_fixed = 1 + n_ctxs;
+		for (c = clients, i = n_fixed; c != NULL; c = c->next, i++) {
+			pfds[i].fd = c->fd;
+			pfds[i].events = c->wlen > 0 ? POLLIN | POLLOUT : POLLIN;
+		}
+
+		if (poll(pfds, i, 1000) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* pfds[] matches the list as it was before any of these run */
+		for (c = clients, i = n_fixed; c != NULL; c = c->next, i++) {
+			if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				client_read(c);
+			if (pfds[i].revents & POLLOUT)
+				client_flush(c);
+		}
+		for (i = 0; i < n_ctxs; i++)
+			if (pfds[1 + i].revents & POLLIN)
+				ub_process(ctxs[i]);
+		if (pfds[0].revents & POLLIN)
+			accept_clients(lfd);
+
+		reap_clients();
+
+		if (nss_ubdns_now() != checked) {
+			checked = nss_ubdns_now();
+			check_config();
+		}
+		if (shmcache != NULL && checked - saved >= NSS_UBDNS_SNAPSHOT_INTERVAL) {
+			saved = checked;
+			snapshot_start(snapshot_path);
+		}
+	}
+
+	unlink(path);
+	close(lfd);
+	snapshot_wait();
+	if (shmcache != NULL) {
+		if (!nss_ubdns_shmcache_snapshot(shmcache, snapshot_path, config_sig))
+			fprintf(stderr, "nss-ubdns-cached: %s: %s\n", snapshot_path, strerror(errno));
+		nss_ubdns_shmcache_close(shmcache);
+	}
+	resolver_free(current);
+	if (retiring != NULL)
+		resolver_free(retiring);
+	free(pfds);
+	return (EXIT_SUCCESS);
+}
@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * nss-ubdns-compile - build the static override table of the nss-ubdns module
+ *
+ * Reads a file in the format of hosts(5), "address name [alias...]" per
+ * line, and writes the hash table described in nss-ubdns.h. As with the
+ * files module, a name listed on several lines has the addresses of all of
+ * them, and is returned with the names of the first; an address listed on
+ * several lines has the names of the first. The table is written next to its
+ * destination and renamed over it, so that processes using the module switch
+ * from the old table to the new one between two lookups.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nss-ubdns.h"
+
+struct entry {
+	int kind;
+	uint32_t hash;
+	char *key;
+	size_t key_len;
+	char *names;		/* consecutive NUL-terminated names */
+	size_t names_len;
+	struct address *addresses;
+	unsigned n_addresses;
+	unsigned size_addresses;
+};
+
+static struct entry *entries;
+static unsigned n_entries, size_entries;
+static uint32_t *index_;		/* entries + 1 by hash, 0 if empty */
+static uint32_t index_size;
+
+static const char *source;
+static unsigned lineno;
+
+static void __attribute__((noreturn))
+fail(const char *msg) {
+	if (lineno > 0)
+		fprintf(stderr, "nss-ubdns-compile: %s:%u: %s\n", source, lineno, msg);
+	else
+		fprintf(stderr, "nss-ubdns-compile: %s\n", msg);
+	exit(EXIT_FAILURE);
+}
+
+static void *
+xrealloc(void *p, size_t size) {
+	p = realloc(p, size);
+	if (p == NULL)
+		fail(strerror(ENOMEM));
+	return (p);
+}
+
+static void
+index_add(unsigned idx) {
+	uint32_t i = entries[idx].hash & (index_size - 1);
+
+	while (index_[i] != 0)
+		i = (i + 1) & (index_size - 1);
+	index_[i] = idx + 1;
+}
+
+static void
+index_grow(void) {
+	unsigned i;
+
+	index_size = index_size == 0 ? 1024 : index_size * 2;
+	free(index_);
+	index_ = calloc(index_size, sizeof(*index_));
+	if (index_ == NULL)
+		fail(strerror(ENOMEM));
+	for (i = 0; i < n_entries; i++)
+		index_add(i);
+}
+
+/* The entry for a key, created with the given names if there is none. */
+static struct entry *
+entry_get(int kind, const char *key, size_t key_len, const char *names, size_t names_len) {
+	uint32_t hash = nss_ubdns_qname_hash(key, kind), i;
+	struct entry *e;
+
+	for (i = hash & (index_size - 1); index_size > 0 && index_[i] != 0;
+	     i = (i + 1) & (index_size - 1))
+	{
+		e = &entries[index_[i] - 1];
+		if (e->hash == hash && e->kind == kind && e->key_len == key_len &&
+		    memcmp(e->key, key, key_len) == 0)
+			return (e);
+	}
+
+	if (n_entries == size_entries) {
+		size_entries = size_entries == 0 ? 1024 : size_entries * 2;
+		entries = xrealloc(entries, size_entries * sizeof(*entries));
+	}
+	e = &entries[n_entries];
+	memset(e, 0, sizeof(*e));
+	e->kind = kind;
+	e->hash = hash;
+	e->key = xrealloc(NULL, key_len + 1);
+	memcpy(e->key, key, key_len + 1);
+	e->key_len = key_len;
+	e->names = xrealloc(NULL, names_len);
+	memcpy(e->names, names, names_len);
+	e->names_len = names_len;
+	n_entries++;
+
+	if (n_entries * 2 > index_size)
+		index_grow();
+	else
+		index_add(n_entries - 1);
+	return (e);
+}
+
+static void
+entry_add_address(struct entry *e, const struct address *a) {
+	unsigned i;
+
+	for (i = 0; i < e->n_addresses; i++)
+		if (memcmp(&e->addresses[i], a, sizeof(*a)) == 0)
+			return;
+	if (e->n_addresses == e->size_addresses) {
+		e->size_addresses = e->size_addresses == 0 ? 4 : e->size_addresses * 2;
+		e->addresses = xrealloc(e->addresses, e->size_addresses * sizeof(*a));
+	}
+	e->addresses[e->n_addresses++] = *a;
+}
+
+static void
+parse_line(char *line) {
+	char key[NSS_UBDNS_PRESLEN_NAME], qname[NSS_UBDNS_ARPA_QNAME_MAX];
+	char names[NSS_UBDNS_NAMES_MAX], *word, *save;
+	size_t names_len = 0, len, key_len;
+	struct address a;
+
+	line[strcspn(line, "#\n")] = '\0';
+	word = strtok_r(line, " \t", &save);
+	if (word == NULL)
+		return;
+
+	memset(&a, 0, sizeof(a));
+	if (inet_pton(AF_INET, word, a.address) == 1)
+		a.family = AF_INET;
+	else if (inet_pton(AF_INET6, word, a.address) == 1)
+		a.family = AF_INET6;
+	else
+		fail("not an address");
+
+	/* the canonical name, then the aliases that fit */
+	while ((word = strtok_r(NULL, " \t", &save)) != NULL) {
+		len = strlen(word) + 1;
+		if (nss_ubdns_qname_key(word, key, sizeof(key)) == 0)
+			fail("name too long");
+		if (names_len + len > sizeof(names))
+			break;
+		memcpy(names + names_len, word, len);
+		names_len += len;
+	}
+	if (names_len == 0)
+		fail("no name");
+
+	for (word = names; word < names + names_len; word += strlen(word) + 1) {
+		key_len = nss_ubdns_qname_key(word, key, sizeof(key));
+		entry_add_address(entry_get(NSS_UBDNS_HOSTSDB_FORWARD, key, key_len,
+					    names, names_len), &a);
+	}
+
+	if (a.family == AF_INET)
+		len = arpa_qname_ip4(a.address, qname);
+	else
+		len = arpa_qname_ip6(a.address, qname);
+	entry_get(NSS_UBDNS_HOSTSDB_REVERSE, qname, len, names, names_len);
+}
+
+static size_t
+record_size(const struct entry *e) {
+	size_t len;
+
+	len = sizeof(struct nss_ubdns_hostsdb_record) + e->key_len + 1 +
+		e->n_addresses * sizeof(struct address) + e->names_len + sizeof(uint16_t);
+	return ((len + 7) & ~(size_t) 7);
+}
+
+static uint8_t *
+record_write(uint8_t *p, const struct entry *e) {
+	struct nss_ubdns_hostsdb_record rec;
+	uint16_t n = e->names_len;
+	uint8_t *start = p;
+	unsigned i;
+	int af;
+
+	rec.kind = e->kind;
+	rec.key_len = e->key_len;
+	rec.val_len = e->n_addresses * sizeof(struct address) + e->names_len + sizeof(n);
+	memcpy(p, &rec, sizeof(rec));
+	p += sizeof(rec);
+	memcpy(p, e->key, e->key_len + 1);
+	p += e->key_len + 1;
+
+	/* IPv4 first, each family in the order it was listed */
+	for (af = AF_INET; af != 0; af = af == AF_INET ? AF_INET6 : 0) {
+		for (i = 0; i < e->n_addresses; i++) {
+			if (e->addresses[i].family != af)
+				continue;
+			memcpy(p, &e->addresses[i], sizeof(struct address));
+			p += sizeof(struct address);
+		}
+	}
+	memcpy(p, e->names, e->names_len);
+	p += e->names_len;
+	memcpy(p, &n, sizeof(n));
+
+	return (start + record_size(e));
+}
+
+static void
+usage(void) {
+	fprintf(stderr, "Usage: nss-ubdns-compile [-o OUTPUT] [-t TTL] SOURCE\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv) {
+	struct nss_ubdns_hostsdb_header hdr;
+	struct nss_ubdns_hostsdb_bucket *buckets;
+	char output[PATH_MAX], tmp[PATH_MAX + 8];
+	uint32_t n_buckets, i;
+	char *line = NULL, *end;
+	size_t size, off, n = 0;
+	uint8_t *file, *p;
+	unsigned e;
+	long ttl = 60;
+	FILE *fp;
+	int fd, opt;
+
+	snprintf(output, sizeof(output), "%s/%s", NSS_UBDNS_CONFDIR, NSS_UBDNS_HOSTSDB);
+	while ((opt = getopt(argc, argv, "o:t:")) != -1) {
+		switch (opt) {
+		case 'o':
+			snprintf(output, sizeof(output), "%s", optarg);
+			break;
+		case 't':
+			ttl = strtol(optarg, &end, 10);
+			if (*end != '\0' || ttl < 0 || ttl > INT32_MAX)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 1 != argc)
+		usage();
+
+	source = argv[optind];
+	fp = fopen(source, "r");
+	if (fp == NULL)
+		fail(strerror(errno));
+	for (lineno = 1; getline(&line, &n, fp) != -1; lineno++)
+		parse_line(line);
+	if (ferror(fp))
+		fail(strerror(errno));
+	fclose(fp);
+	free(line);
+	lineno = 0;
+
+	/* at most half full, so that probes for absent names stop early */
+	for (n_buckets = 8; n_buckets < 2 * n_entries; n_buckets *= 2)
+		;
+	size = sizeof(hdr) + n_buckets * sizeof(*buckets);
+	size = (size + 7) & ~(size_t) 7;
+	for (e = 0; e < n_entries; e++)
+		size += record_size(&entries[e]);
+	if (size > UINT32_MAX)
+		fail("too many names");
+
+	file = calloc(1, size);
+	if (file == NULL)
+		fail(strerror(ENOMEM));
+	buckets = (struct nss_ubdns_hostsdb_bucket *) (file + sizeof(hdr));
+	off = (sizeof(hdr) + n_buckets * sizeof(*buckets) + 7) & ~(size_t) 7;
+	p = file + off;
+	for (e = 0; e < n_entries; e++) {
+		for (i = entries[e].hash & (n_buckets - 1); buckets[i].off != 0;
+		     i = (i + 1) & (n_buckets - 1))
+			;
+		buckets[i].hash = entries[e].hash;
+		buckets[i].off = p - file;
+		p = record_write(p, &entries[e]);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = NSS_UBDNS_HOSTSDB_MAGIC;
+	hdr.version = NSS_UBDNS_HOSTSDB_VERSION;
+	hdr.address_size = sizeof(struct address);
+	hdr.n_buckets = n_buckets;
+	hdr.n_records = n_entries;
+	hdr.ttl = ttl;
+	hdr.size = size;
+	memcpy(file, &hdr, sizeof(hdr));
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", output);
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		fprintf(stderr, "nss-ubdns-compile: %s: %s\n", tmp, strerror(errno));
+		return (EXIT_FAILURE);
+	}
+	if (fchmod(fd, 0644) != 0 ||
+	    write(fd, file, size) != (ssize_t) size ||
+	    fsync(fd) != 0 ||
+	    close(fd) != 0 ||
+	    rename(tmp, output) != 0)
+	{
+		fprintf(stderr, "nss-ubdns-compile: %s: %s\n", output, strerror(errno));
+		unlink(tmp);
+		return (EXIT_FAILURE);
+	}
+	return (EXIT_SUCCESS);
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * nss-ubdns-stat - sum the runtime statistics of the nss-ubdns module
+ *
+ * Every process using the module keeps its counters in a file of its own,
+ * see nss_ubdns_stats_slot(). The files of processes that are still running
+ * are summed, or just one process's with -p; those of processes that have
+ * gone without removing theirs are skipped, and deleted with -c.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nss-ubdns.h"
+
+#define STATS_SIZE	(sizeof(struct nss_ubdns_stats_header) + \
+			 NSS_UBDNS_STATS_SLOTS * sizeof(struct nss_ubdns_stats))
+
+static const char *entry_names[NSS_UBDNS_STAT_ENTRIES] = {
+	"gethostbyname4_r", "gethostbyname3_r", "gethostbyaddr2_r", "batch", "async",
+};
+
+static const char *qtype_names[NSS_UBDNS_STAT_QTYPES] = { "A", "AAAA", "PTR" };
+
+static void
+stats_sum(struct nss_ubdns_stats *sum, const struct nss_ubdns_stats *s) {
+	unsigned i;
+
+	for (i = 0; i < NSS_UBDNS_STAT_ENTRIES; i++)
+		sum->lookups[i] += __atomic_load_n(&s->lookups[i], __ATOMIC_RELAXED);
+	for (i = 0; i < NSS_UBDNS_STAT_QTYPES; i++)
+		sum->queries[i] += __atomic_load_n(&s->queries[i], __ATOMIC_RELAXED);
+	for (i = 0; i < NSS_UBDNS_STATS_BUCKETS; i++)
+		sum->latency[i] += __atomic_load_n(&s->latency[i], __ATOMIC_RELAXED);
+	sum->erange += __atomic_load_n(&s->erange, __ATOMIC_RELAXED);
+	sum->timeouts += __atomic_load_n(&s->timeouts, __ATOMIC_RELAXED);
+	sum->cache_hits += __atomic_load_n(&s->cache_hits, __ATOMIC_RELAXED);
+	sum->cache_stale += __atomic_load_n(&s->cache_stale, __ATOMIC_RELAXED);
+	sum->cache_misses += __atomic_load_n(&s->cache_misses, __ATOMIC_RELAXED);
+	sum->overrides += __atomic_load_n(&s->overrides, __ATOMIC_RELAXED);
+	sum->shm_hits += __atomic_load_n(&s->shm_hits, __ATOMIC_RELAXED);
+	sum->errors += __atomic_load_n(&s->errors, __ATOMIC_RELAXED);
+	sum->bogus += __atomic_load_n(&s->bogus, __ATOMIC_RELAXED);
+	sum->servfail += __atomic_load_n(&s->servfail, __ATOMIC_RELAXED);
+	sum->nxdomain += __atomic_load_n(&s->nxdomain, __ATOMIC_RELAXED);
+}
+
+/* Add one process's counters to sum. Returns false if the file isn't one. */
+static bool
+stats_read(const char *path, pid_t pid, struct nss_ubdns_stats *sum) {
+	const struct nss_ubdns_stats_header *hdr;
+	const struct nss_ubdns_stats *slots;
+	struct stat sb;
+	unsigned i;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return (false);
+	if (fstat(fd, &sb) != 0 || (size_t) sb.st_size != STATS_SIZE) {
+		close(fd);
+		return (false);
+	}
+	p = mmap(NULL, STATS_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return (false);
+
+	hdr = p;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != NSS_UBDNS_STATS_MAGIC ||
+	    hdr->version != NSS_UBDNS_STATS_VERSION ||
+	    hdr->n_slots != NSS_UBDNS_STATS_SLOTS ||
+	    hdr->slot_size != sizeof(struct nss_ubdns_stats) ||
+	    hdr->pid != pid)
+	{
+		munmap(p, STATS_SIZE);
+		return (false);
+	}
+
+	slots = (const struct nss_ubdns_stats *) (hdr + 1);
+	for (i = 0; i < NSS_UBDNS_STATS_SLOTS; i++)
+		stats_sum(sum, &slots[i]);
+	munmap(p, STATS_SIZE);
+	return (true);
+}
+
+static void
+stats_print(const struct nss_ubdns_stats *s, unsigned n_processes) {
+	unsigned i, last;
+
+	printf("processes %u\n", n_processes);
+	for (i = 0; i < NSS_UBDNS_STAT_ENTRIES; i++)
+		printf("lookups.%s %" PRIu64 "\n", entry_names[i], s->lookups[i]);
+	printf("lookups.erange %" PRIu64 "\n", s->erange);
+	printf("lookups.timeout %" PRIu64 "\n", s->timeouts);
+	printf("cache.hit %" PRIu64 "\n", s->cache_hits);
+	printf("cache.stale %" PRIu64 "\n", s->cache_stale);
+	printf("cache.miss %" PRIu64 "\n", s->cache_misses);
+	printf("cache.override %" PRIu64 "\n", s->overrides);
+	for (i = 0; i < NSS_UBDNS_STAT_QTYPES; i++)
+		printf("queries.%s %" PRIu64 "\n", qtype_names[i], s->queries[i]);
+	printf("queries.shm_hit %" PRIu64 "\n", s->shm_hits);
+	printf("answers.error %" PRIu64 "\n", s->errors);
+	printf("answers.bogus %" PRIu64 "\n", s->bogus);
+	printf("answers.servfail %" PRIu64 "\n", s->servfail);
+	printf("answers.nxdomain %" PRIu64 "\n", s->nxdomain);
+
+	/* the histogram up to its last non-empty bucket */
+	for (last = 0, i = 0; i < NSS_UBDNS_STATS_BUCKETS; i++)
+		if (s->latency[i] != 0)
+			last = i;
+	for (i = 0; i <= last; i++)
+		printf("latency.lt_%" PRIu64 "us %" PRIu64 "\n", (uint64_t) 1 << i, s->latency[i]);
+}
+
+static void
+usage(void) {
+	fprintf(stderr, "Usage: nss-ubdns-stat [-c] [-p PID]\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv) {
+	struct nss_ubdns_stats sum;
+	struct dirent *de;
+	char path[PATH_MAX];
+	unsigned n_processes = 0;
+	bool clean = false;
+	pid_t only = 0, pid;
+	size_t prefix_len;
+	char *end;
+	DIR *dir;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "cp:")) != -1) {
+		switch (opt) {
+		case 'c':
+			clean = true;
+			break;
+		case 'p':
+			only = strtol(optarg, &end, 10);
+			if (*end != '\0' || only <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	dir = opendir(NSS_UBDNS_STATS_DIR);
+	if (dir == NULL) {
+		fprintf(stderr, "nss-ubdns-stat: %s: %s\n", NSS_UBDNS_STATS_DIR, strerror(errno));
+		return (EXIT_FAILURE);
+	}
+
+	memset(&sum, 0, sizeof(sum));
+	prefix_len = strlen(NSS_UBDNS_STATS_PREFIX);
+	while ((de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, NSS_UBDNS_STATS_PREFIX, prefix_len) != 0)
+			continue;
+		pid = strtol(de->d_name + prefix_len, &end, 10);
+		if (*end != '\0' || pid <= 0 || (only != 0 && pid != only))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", NSS_UBDNS_STATS_DIR, de->d_name);
+
+		/* a process that exited without tidying up */
+		if (kill(pid, 0) != 0 && errno == ESRCH) {
+			if (clean && unlink(path) != 0)
+				fprintf(stderr, "nss-ubdns-stat: %s: %s\n", path, strerror(errno));
+			continue;
+		}
+		if (stats_read(path, pid, &sum))
+			n_processes++;
+	}
+	closedir(dir);
+
+	stats_print(&sum, n_processes);
+	return (EXIT_SUCCESS);
+}
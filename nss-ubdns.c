@@ -45,10 +45,19 @@
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <inttypes.h>
+#include <poll.h>
 
 #include <stdio.h>
 
 #include "nss-ubdns.h"
+#include "ubdns.h"
+
+#define NSS_UBDNS_PROBES_DEFINE
+#include "probes.h"
+
+#ifdef HAVE_SYS_SDT_H
+__thread int64_t nss_ubdns_probe_start = 0;
+#endif
 
 #define ALIGN(a) (((a+sizeof(void*)-1)/sizeof(void*))*sizeof(void*))
 
@@ -96,39 +105,63 @@ enum nss_status _nss_ubdns_gethostbyaddr_r(
 		char *buffer, size_t buflen,
 		int *errnop, int *h_errnop);
 
-enum nss_status _nss_ubdns_gethostbyname4_r(
+/* Count a lookup through one of the entry points, see nss_ubdns_stats(). */
+static enum nss_status count_lookup(
+		int entry,
+		enum nss_status status,
+		int err)
+{
+	struct nss_ubdns_stats *s = nss_ubdns_stats();
+
+	nss_ubdns_stat_add(&s->lookups[entry], 1);
+	if (status == NSS_STATUS_TRYAGAIN && err == ERANGE)
+		nss_ubdns_stat_add(&s->erange, 1);
+	else if (status == NSS_STATUS_TRYAGAIN && err == EAGAIN)
+		nss_ubdns_stat_add(&s->timeouts, 1);
+
+	return (status);
+}
+
+/* Pack the result of a forward lookup as gethostbyname4_r() returns it. */
+static enum nss_status pack_addrtuple(
 		const char *hn,
+		const struct address *addresses, unsigned n_addresses,
+		const char *names, size_t names_len,
 		struct gaih_addrtuple **pat,
 		char *buffer, size_t buflen,
-		int *errnop, int *h_errnop,
-		int32_t *ttlp)
+		int *errnop, int *h_errnop)
 {
 	size_t l, idx, ms;
 	char *r_name;
+	const char *canon = hn;
 	struct gaih_addrtuple *r_tuple, *r_tuple_prev = NULL;
-	struct address *addresses = NULL, *a;
-	unsigned n_addresses = 0, n;
+	const struct address *a;
+	unsigned n;
 
-	/* If this fails, n_addresses is 0. Which is fine */
-	nss_ubdns_lookup_forward(hn, AF_UNSPEC, &addresses, &n_addresses);
 	if (n_addresses == 0) {
 		*errnop = ENOENT;
 		*h_errnop = HOST_NOT_FOUND;
 		return (NSS_STATUS_NOTFOUND);
 	}
 
-	l = strlen(hn);
-	ms = ALIGN(l+1)+ALIGN(sizeof(struct gaih_addrtuple))*(n_addresses > 0 ? n_addresses : 2);
+	/* An alias is returned under its canonical name */
+	if (names_len > 0)
+		canon = names;
+
+	NSS_UBDNS_PROBE4(pack, hn, 0, n_addresses);
+
+	l = strlen(canon);
+	ms = ALIGN(l+1)+ALIGN(sizeof(struct gaih_addrtuple))*n_addresses;
 	if (buflen < ms) {
-		*errnop = ENOMEM;
-		*h_errnop = NO_RECOVERY;
-		free(addresses);
+		NSS_UBDNS_PROBE5(buffer__small, hn, 0, ms, buflen);
+		*errnop = ERANGE;
+		*h_errnop = NETDB_INTERNAL;
 		return NSS_STATUS_TRYAGAIN;
 	}
 
 	/* First, fill in hostname */
 	r_name = buffer;
-	memcpy(r_name, hn, l+1);
+	memcpy(r_name, canon, l+1);
 	idx = ALIGN(l+1);
 
 	/* Second, fill actual addresses in, but in backwards order */
@@ -149,39 +182,79 @@ enum nss_status _nss_ubdns_gethostbyname4_r(
 
 	*pat = r_tuple_prev;
 
+	return NSS_STATUS_SUCCESS;
+}
+
+static enum nss_status ubdns_gethostbyname4_r(
+		const char *hn,
+		struct gaih_addrtuple **pat,
+		char *buffer, size_t buflen,
+		int *errnop, int *h_errnop,
+		int32_t *ttlp)
+{
+	size_t names_len = 0;
+	char names[NSS_UBDNS_NAMES_MAX];
+	struct address buf[NSS_UBDNS_ADDRESSES_STACK], *addresses;
+	unsigned n_addresses = 0;
+	enum nss_status status;
+	int32_t ttl = 0;
+	int r;
+
+	/* If this fails, n_addresses is 0. Which is fine */
+	r = nss_ubdns_lookup_forward(hn, AF_UNSPEC, buf, NSS_UBDNS_ADDRESSES_STACK,
+				     &addresses, &n_addresses, names, &names_len, &ttl);
 	if (ttlp)
-		*ttlp = 0;
+		*ttlp = ttl;
+	if (r == NSS_UBDNS_TIMEDOUT) {
+		*errnop = EAGAIN;
+		*h_errnop = TRY_AGAIN;
+		return (NSS_STATUS_TRYAGAIN);
+	}
 
-	free(addresses);
+	status = pack_addrtuple(hn, addresses, n_addresses, names, names_len, pat,
+				buffer, buflen, errnop, h_errnop);
+	if (addresses != buf)
+		free(addresses);
+	return (status);
+}
 
-	return NSS_STATUS_SUCCESS;
+enum nss_status _nss_ubdns_gethostbyname4_r(
+		const char *hn,
+		struct gaih_addrtuple **pat,
+		char *buffer, size_t buflen,
+		int *errnop, int *h_errnop,
+		int32_t *ttlp)
+{
+	enum nss_status status;
+
+	NSS_UBDNS_PROBE_BEGIN();
+	NSS_UBDNS_PROBE4(lookup__entry, hn, 0, "gethostbyname4_r");
+	status = ubdns_gethostbyname4_r(hn, pat, buffer, buflen, errnop, h_errnop, ttlp);
+	NSS_UBDNS_PROBE5(lookup__return, hn, 0, "gethostbyname4_r", status);
+	return (count_lookup(NSS_UBDNS_STAT_BYNAME4, status, *errnop));
 }
 
-enum nss_status _nss_ubdns_gethostbyname3_r(
+/* Pack the result of a forward lookup as gethostbyname3_r() returns it. */
+static enum nss_status pack_hostent(
 		const char *hn,
 		int af,
+		const struct address *addresses, unsigned n_addresses,
+		const char *names, size_t names_len,
 		struct hostent *result,
 		char *buffer, size_t buflen,
 		int *errnop, int *h_errnop,
-		int32_t *ttlp,
 		char **canonp)
 {
 	size_t l, idx, ms;
-	char *r_addr, *r_name, *r_aliases, *r_addr_list;
+	char *r_addr, *r_name, *r_aliases, *r_addr_list, *p;
+	const char *r_names = names;
 	size_t alen;
-	struct address *addresses = NULL, *a;
-	unsigned n_addresses = 0, n, c;
+	const struct address *a;
+	unsigned n, c, n_names = 0;
 	unsigned i = 0;
 
-	if (af != AF_INET && af != AF_INET6) {
-		*errnop = EAFNOSUPPORT;
-		*h_errnop = NO_DATA;
-		return (NSS_STATUS_UNAVAIL);
-	}
-
 	alen = PROTO_ADDRESS_SIZE(af);
 
-	nss_ubdns_lookup_forward(hn, af, &addresses, &n_addresses);
 	for (a = addresses, n = 0, c = 0; n < n_addresses; a++, n++)
 		if (af == a->family)
 			c++;
@@ -192,28 +265,46 @@ enum nss_status _nss_ubdns_gethostbyname3_r(
 		return (NSS_STATUS_NOTFOUND);
 	}
 
-	l = strlen(hn);
-	ms = ALIGN(l + 1) +
-		sizeof(char *) +
+	/*
+	 * An alias is returned under its canonical name, with the name that was
+	 * looked up and any others in its CNAME chain as aliases
+	 */
+	if (names_len == 0) {
+		r_names = hn;
+		names_len = strlen(hn) + 1;
+	}
+	for (l = 0; l < names_len; l += strlen(r_names + l) + 1)
+		n_names++;
+
+	NSS_UBDNS_PROBE4(pack, hn, nss_ubdns_probe_qtype(af), c);
+
+	l = names_len;
+	ms = ALIGN(l) +
+		n_names * sizeof(char *) +
 		c * ALIGN(alen) +
 		(c + 1) * sizeof(char *);
 
 	if (buflen < ms) {
-		*errnop = ENOMEM;
-		*h_errnop = NO_RECOVERY;
-		free(addresses);
+		NSS_UBDNS_PROBE5(buffer__small, hn, nss_ubdns_probe_qtype(af), ms, buflen);
+		*errnop = ERANGE;
+		*h_errnop = NETDB_INTERNAL;
 		return NSS_STATUS_TRYAGAIN;
 	}
 
-	/* First, fill in hostname */
+	/* First, fill in the names, hostname first */
 	r_name = buffer;
-	memcpy(r_name, hn, l+1);
-	idx = ALIGN(l+1);
+	memcpy(r_name, r_names, l);
+	idx = ALIGN(l);
 
-	/* Second, create (empty) aliases array */
+	/* Second, the other names are aliases */
 	r_aliases = buffer + idx;
-	*(char**) r_aliases = NULL;
-	idx += sizeof(char*);
+	p = r_name + strlen(r_name) + 1;
+	for (i = 0; i + 1 < n_names; i++) {
+		((char **) r_aliases)[i] = p;
+		p += strlen(p) + 1;
+	}
+	((char **) r_aliases)[i] = NULL;
+	idx += n_names * sizeof(char *);
 
 	/* Third, add addresses */
 	r_addr = buffer + idx;
@@ -253,17 +344,71 @@ enum nss_status _nss_ubdns_gethostbyname3_r(
 	result->h_length = alen;
 	result->h_addr_list = (char**) r_addr_list;
 
-	if (ttlp)
-		*ttlp = 0;
-
 	if (canonp)
 		*canonp = r_name;
 
-	free(addresses);
-
 	return NSS_STATUS_SUCCESS;
 }
 
+static enum nss_status ubdns_gethostbyname3_r(
+		const char *hn,
+		int af,
+		struct hostent *result,
+		char *buffer, size_t buflen,
+		int *errnop, int *h_errnop,
+		int32_t *ttlp,
+		char **canonp)
+{
+	size_t names_len = 0;
+	char names[NSS_UBDNS_NAMES_MAX];
+	struct address buf[NSS_UBDNS_ADDRESSES_STACK], *addresses;
+	unsigned n_addresses = 0;
+	enum nss_status status;
+	int32_t ttl = 0;
+	int r;
+
+	if (af != AF_INET && af != AF_INET6) {
+		*errnop = EAFNOSUPPORT;
+		*h_errnop = NO_DATA;
+		return (NSS_STATUS_UNAVAIL);
+	}
+
+	r = nss_ubdns_lookup_forward(hn, af, buf, NSS_UBDNS_ADDRESSES_STACK,
+				     &addresses, &n_addresses, names, &names_len, &ttl);
+	if (ttlp)
+		*ttlp = ttl;
+	if (r == NSS_UBDNS_TIMEDOUT) {
+		*errnop = EAGAIN;
+		*h_errnop = TRY_AGAIN;
+		return (NSS_STATUS_TRYAGAIN);
+	}
+
+	status = pack_hostent(hn, af, addresses, n_addresses, names, names_len, result,
+			      buffer, buflen, errnop, h_errnop, canonp);
+	if (addresses != buf)
+		free(addresses);
+	return (status);
+}
+
+enum nss_status _nss_ubdns_gethostbyname3_r(
+		const char *hn,
+		int af,
+		struct hostent *result,
+		char *buffer, size_t buflen,
+		int *errnop, int *h_errnop,
+		int32_t *ttlp,
+		char **canonp)
+{
+	enum nss_status status;
+
+	NSS_UBDNS_PROBE_BEGIN();
+	NSS_UBDNS_PROBE4(lookup__entry, hn, nss_ubdns_probe_qtype(af), "gethostbyname3_r");
+	status = ubdns_gethostbyname3_r(hn, af, result, buffer, buflen,
+					errnop, h_errnop, ttlp, canonp);
+	NSS_UBDNS_PROBE5(lookup__return, hn, nss_ubdns_probe_qtype(af), "gethostbyname3_r", status);
+	return (count_lookup(NSS_UBDNS_STAT_BYNAME3, status, *errnop));
+}
+
 enum nss_status _nss_ubdns_gethostbyname2_r(
 		const char *name,
 		int af,
@@ -297,62 +442,52 @@ enum nss_status _nss_ubdns_gethostbyname_r(
 			NULL);
 }
 
-enum nss_status _nss_ubdns_gethostbyaddr2_r(
-		const void* addr, socklen_t len,
+/*
+ * Pack the result of a reverse lookup as gethostbyaddr2_r() returns it, from
+ * the l bytes of n_names names at the start of buffer.
+ */
+static enum nss_status pack_hostent_addr(
+		const void *addr,
 		int af,
+		size_t l, unsigned n_names,
 		struct hostent *result,
 		char *buffer, size_t buflen,
-		int *errnop, int *h_errnop,
-		int32_t *ttlp)
+		int *errnop, int *h_errnop)
 {
-	char *hn = NULL;
-	char *r_name, *r_addr, *r_aliases, *r_addr_list;
-	size_t l, idx, ms, alen;
+	char *r_name, *r_addr, *r_aliases, *r_addr_list, *p;
+	size_t idx, ms, alen;
+	unsigned i;
 
 	alen = PROTO_ADDRESS_SIZE(af);
 
-	if (len != alen) {
-		*errnop = EINVAL;
-		*h_errnop = NO_RECOVERY;
-		return NSS_STATUS_UNAVAIL;
-	}
-
-	if (af != AF_INET && af != AF_INET6) {
-		*errnop = EAFNOSUPPORT;
-		*h_errnop = NO_DATA;
-		return NSS_STATUS_UNAVAIL;
-	}
+	NSS_UBDNS_PROBE4(pack, NSS_UBDNS_PROBE_ARPA(addr, af), NSS_UBDNS_TYPE_PTR, n_names);
 
-	hn = nss_ubdns_lookup_reverse(addr, af);
-	if (!hn) {
-		*errnop = ENOENT;
-		*h_errnop = HOST_NOT_FOUND;
-
-		return NSS_STATUS_NOTFOUND;
-	}
-
-	l = strlen(hn);
-	ms = ALIGN(l + 1) +
-		sizeof(char *) +
+	ms = ALIGN(l) +
+		n_names * sizeof(char *) +
 		ALIGN(alen) +
 		2 * sizeof(char *);
 
 	if (buflen < ms) {
-		*errnop = ENOMEM;
-		*h_errnop = NO_RECOVERY;
-		free(hn);
+		NSS_UBDNS_PROBE5(buffer__small, NSS_UBDNS_PROBE_ARPA(addr, af), NSS_UBDNS_TYPE_PTR,
+				 ms, buflen);
+		*errnop = ERANGE;
+		*h_errnop = NETDB_INTERNAL;
 		return (NSS_STATUS_TRYAGAIN);
 	}
 
-	/* First, fill in hostname */
+	/* First, the hostname is the first name */
 	r_name = buffer;
-	memcpy(r_name, hn, l + 1);
-	idx = ALIGN(l + 1);
+	idx = ALIGN(l);
 
-	/* Second, create (empty) aliases array */
+	/* Second, the other names are aliases */
 	r_aliases = buffer + idx;
-	*(char **) r_aliases = NULL;
-	idx += sizeof(char *);
+	p = r_name + strlen(r_name) + 1;
+	for (i = 0; i + 1 < n_names; i++) {
+		((char **) r_aliases)[i] = p;
+		p += strlen(p) + 1;
+	}
+	((char **) r_aliases)[i] = NULL;
+	idx += n_names * sizeof(char *);
 
 	/* Third, add address */
 	r_addr = buffer + idx;
@@ -374,12 +509,83 @@ enum nss_status _nss_ubdns_gethostbyaddr2_r(
 	result->h_length = alen;
 	result->h_addr_list = (char **) r_addr_list;
 
+	return (NSS_STATUS_SUCCESS);
+}
+
+static enum nss_status ubdns_gethostbyaddr2_r(
+		const void* addr, socklen_t len,
+		int af,
+		struct hostent *result,
+		char *buffer, size_t buflen,
+		int *errnop, int *h_errnop,
+		int32_t *ttlp)
+{
+	size_t l, alen;
+	unsigned n_names = 0;
+	int32_t ttl = 0;
+	int r;
+
+	alen = PROTO_ADDRESS_SIZE(af);
+
+	if (len != alen) {
+		*errnop = EINVAL;
+		*h_errnop = NO_RECOVERY;
+		return NSS_STATUS_UNAVAIL;
+	}
+
+	if (af != AF_INET && af != AF_INET6) {
+		*errnop = EAFNOSUPPORT;
+		*h_errnop = NO_DATA;
+		return NSS_STATUS_UNAVAIL;
+	}
+
+	/* The names are written straight to the start of the buffer */
+	r = nss_ubdns_lookup_reverse(addr, af, buffer, buflen, &l, &n_names, &ttl);
 	if (ttlp)
-		*ttlp = 0;
+		*ttlp = ttl;
+	if (r == NSS_UBDNS_TIMEDOUT) {
+		*errnop = EAGAIN;
+		*h_errnop = TRY_AGAIN;
+		return (NSS_STATUS_TRYAGAIN);
+	}
+	if (r == 0) {
+		*errnop = ENOENT;
+		*h_errnop = HOST_NOT_FOUND;
 
-	free(hn);
+		return NSS_STATUS_NOTFOUND;
+	}
 
-	return (NSS_STATUS_SUCCESS);
+	/* names that did not fit have not been counted */
+	if (r < 0) {
+		NSS_UBDNS_PROBE5(buffer__small, NSS_UBDNS_PROBE_ARPA(addr, af), NSS_UBDNS_TYPE_PTR,
+				 0, buflen);
+		*errnop = ERANGE;
+		*h_errnop = NETDB_INTERNAL;
+		return (NSS_STATUS_TRYAGAIN);
+	}
+
+	return (pack_hostent_addr(addr, af, l, n_names, result, buffer, buflen,
+				  errnop, h_errnop));
+}
+
+enum nss_status _nss_ubdns_gethostbyaddr2_r(
+		const void* addr, socklen_t len,
+		int af,
+		struct hostent *result,
+		char *buffer, size_t buflen,
+		int *errnop, int *h_errnop,
+		int32_t *ttlp)
+{
+	enum nss_status status;
+
+	NSS_UBDNS_PROBE_BEGIN();
+	NSS_UBDNS_PROBE4(lookup__entry, NSS_UBDNS_PROBE_ARPA(addr, af), NSS_UBDNS_TYPE_PTR,
+			 "gethostbyaddr2_r");
+	status = ubdns_gethostbyaddr2_r(addr, len, af, result, buffer, buflen,
+					errnop, h_errnop, ttlp);
+	NSS_UBDNS_PROBE5(lookup__return, NSS_UBDNS_PROBE_ARPA(addr, af), NSS_UBDNS_TYPE_PTR,
+			 "gethostbyaddr2_r", status);
+	return (count_lookup(NSS_UBDNS_STAT_BYADDR, status, *errnop));
 }
 
 enum nss_status _nss_ubdns_gethostbyaddr_r(
@@ -397,3 +603,310 @@ enum nss_status _nss_ubdns_gethostbyaddr_r(
 			errnop, h_errnop,
 			NULL);
 }
+
+/* Pack the result of a pipelined lookup as its NSS entry point would. */
+static enum nss_status pack_lookup(
+		const struct nss_ubdns_lookup *l,
+		struct ubdns_result *result,
+		struct hostent *host,
+		char *buffer, size_t buflen)
+{
+	if (l->r == NSS_UBDNS_TIMEDOUT) {
+		result->errnop = EAGAIN;
+		result->h_errnop = TRY_AGAIN;
+		return (NSS_STATUS_TRYAGAIN);
+	}
+
+	if (!l->reverse && l->af == AF_UNSPEC)
+		return (pack_addrtuple(l->name, l->list, l->n_list, l->names, l->names_len,
+				       &result->pat, buffer, buflen,
+				       &result->errnop, &result->h_errnop));
+	if (!l->reverse)
+		return (pack_hostent(l->name, l->af, l->list, l->n_list, l->names, l->names_len,
+				     host, buffer, buflen,
+				     &result->errnop, &result->h_errnop, NULL));
+
+	if (l->r == 0) {
+		result->errnop = ENOENT;
+		result->h_errnop = HOST_NOT_FOUND;
+		return (NSS_STATUS_NOTFOUND);
+	}
+	if (l->r < 0 || buflen < l->names_len) {
+		result->errnop = ERANGE;
+		result->h_errnop = NETDB_INTERNAL;
+		return (NSS_STATUS_TRYAGAIN);
+	}
+	memcpy(buffer, l->names, l->names_len);
+	return (pack_hostent_addr(l->addr, l->af, l->names_len, l->n_names, host, buffer, buflen,
+				  &result->errnop, &result->h_errnop));
+}
+
+/* Set up a pipelined lookup for a query, or return an errno value for a bad one. */
+static int lookup_query(
+		const struct ubdns_query *q,
+		struct nss_ubdns_lookup *l)
+{
+	if (q->type == UBDNS_FORWARD) {
+		if (q->af != AF_INET && q->af != AF_INET6 && q->af != AF_UNSPEC)
+			return (EAFNOSUPPORT);
+		if (q->name == NULL || strlen(q->name) >= sizeof(l->name))
+			return (EINVAL);
+		strcpy(l->name, q->name);
+	} else if (q->type == UBDNS_REVERSE) {
+		if (q->af != AF_INET && q->af != AF_INET6)
+			return (EAFNOSUPPORT);
+		if (q->addr == NULL)
+			return (EINVAL);
+		memcpy(l->addr, q->addr, PROTO_ADDRESS_SIZE(q->af));
+	} else {
+		return (EINVAL);
+	}
+	l->reverse = (q->type == UBDNS_REVERSE);
+	l->af = q->af;
+	return (0);
+}
+
+/*
+ * Pack a result for the caller, in a buffer that grows as needed: unlike the
+ * NSS entry points, ubdns.h has no way to ask for a bigger one.
+ */
+static void pack_result(
+		const struct nss_ubdns_lookup *l,
+		struct ubdns_result *result,
+		struct hostent *host,
+		char **buffer, size_t *buflen,
+		unsigned entry)
+{
+	char *b;
+
+	for (;;) {
+		memset(result, 0, sizeof(*result));
+		result->ttl = l->ttl;
+		result->status = pack_lookup(l, result, host, *buffer, *buflen);
+		if (result->status != NSS_STATUS_TRYAGAIN || result->errnop != ERANGE || l->r < 0)
+			break;
+		b = realloc(*buffer, *buflen * 2);
+		if (b == NULL) {
+			result->errnop = ENOMEM;
+			break;
+		}
+		*buffer = b;
+		*buflen *= 2;
+	}
+	if (result->status == NSS_STATUS_SUCCESS && result->pat == NULL)
+		result->host = host;
+
+	count_lookup(entry, result->status, result->errnop);
+}
+
+int ubdns_resolve_batch(
+		const struct ubdns_query *queries, unsigned n_queries,
+		unsigned window,
+		ubdns_batch_cb cb, void *arg)
+{
+	struct nss_ubdns_pipeline *p;
+	struct nss_ubdns_lookup *lookups, **idle, *l;
+	struct ubdns_result result;
+	struct hostent host;
+	struct pollfd pfd;
+	unsigned next = 0, done = 0, n_idle, i;
+	size_t buflen = 4096;
+	char *buffer;
+	int err;
+
+	if (window == 0)
+		window = UBDNS_BATCH_WINDOW;
+	if (window > n_queries)
+		window = n_queries;
+	if (n_queries == 0)
+		return (0);
+
+	lookups = malloc(window * sizeof(*lookups));
+	idle = malloc(window * sizeof(*idle));
+	buffer = malloc(buflen);
+	p = nss_ubdns_pipeline_new();
+	if (lookups == NULL || idle == NULL || buffer == NULL || p == NULL) {
+		err = errno;
+		if (p != NULL)
+			nss_ubdns_pipeline_free(p);
+		free(buffer);
+		free(idle);
+		free(lookups);
+		errno = err;
+		return (-1);
+	}
+	for (n_idle = 0; n_idle < window; n_idle++)
+		idle[n_idle] = &lookups[window - n_idle - 1];
+
+	pfd.fd = nss_ubdns_pipeline_fd(p);
+	pfd.events = POLLIN;
+	while (done < n_queries) {
+		/* keep the window full */
+		while (n_idle > 0 && next < n_queries) {
+			i = next++;
+			l = idle[n_idle - 1];
+			err = lookup_query(&queries[i], l);
+			if (err != 0) {
+				memset(&result, 0, sizeof(result));
+				result.status = NSS_STATUS_UNAVAIL;
+				result.errnop = err;
+				result.h_errnop = err == EAFNOSUPPORT ? NO_DATA : NO_RECOVERY;
+				count_lookup(NSS_UBDNS_STAT_BATCH, result.status, err);
+				cb(i, &result, arg);
+				done++;
+				continue;
+			}
+			l->data = (void *) (uintptr_t) i;
+			n_idle--;
+			nss_ubdns_pipeline_add(p, l);
+		}
+
+		while ((l = nss_ubdns_pipeline_next(p)) != NULL) {
+			pack_result(l, &result, &host, &buffer, &buflen, NSS_UBDNS_STAT_BATCH);
+			cb((uintptr_t) l->data, &result, arg);
+			nss_ubdns_lookup_release(l);
+			idle[n_idle++] = l;
+			done++;
+		}
+
+		if (done < n_queries && (n_idle == 0 || next == n_queries))
+			poll(&pfd, 1, nss_ubdns_pipeline_timeout(p));
+	}
+
+	nss_ubdns_pipeline_free(p);
+	free(buffer);
+	free(idle);
+	free(lookups);
+	return (0);
+}
+
+/* A lookup submitted with ubdns_submit(), until its callback is called. */
+struct ubdns_lookup {
+	struct nss_ubdns_lookup l;
+	struct ubdns_lookup *next, *prev;
+	ubdns_cb cb;
+	void *arg;
+	bool cancelled;
+};
+
+struct ubdns {
+	struct nss_ubdns_pipeline *p;
+	struct ubdns_lookup *head;	/* submitted and not yet passed to their callbacks */
+	char *buffer;
+	size_t buflen;
+};
+
+struct ubdns *ubdns_new(void)
+{
+	struct ubdns *u;
+
+	u = calloc(1, sizeof(*u));
+	if (u == NULL)
+		return (NULL);
+	u->buflen = 4096;
+	u->buffer = malloc(u->buflen);
+	u->p = nss_ubdns_pipeline_new();
+	if (u->buffer == NULL || u->p == NULL) {
+		if (u->p != NULL)
+			nss_ubdns_pipeline_free(u->p);
+		free(u->buffer);
+		free(u);
+		errno = ENOMEM;
+		return (NULL);
+	}
+	return (u);
+}
+
+void ubdns_free(struct ubdns *u)
+{
+	struct ubdns_lookup *lk;
+
+	/* cancels and waits for the unfinished lookups, which are all on the list */
+	nss_ubdns_pipeline_free(u->p);
+	while ((lk = u->head) != NULL) {
+		u->head = lk->next;
+		free(lk);
+	}
+	free(u->buffer);
+	free(u);
+}
+
+int ubdns_fd(const struct ubdns *u)
+{
+	return (nss_ubdns_pipeline_fd(u->p));
+}
+
+int ubdns_timeout(const struct ubdns *u)
+{
+	return (nss_ubdns_pipeline_timeout(u->p));
+}
+
+struct ubdns_lookup *ubdns_submit(
+		struct ubdns *u,
+		const struct ubdns_query *q,
+		ubdns_cb cb, void *arg)
+{
+	struct ubdns_lookup *lk;
+	int err;
+
+	lk = malloc(sizeof(*lk));
+	if (lk == NULL)
+		return (NULL);
+	err = lookup_query(q, &lk->l);
+	if (err != 0) {
+		free(lk);
+		errno = err;
+		return (NULL);
+	}
+	lk->l.data = lk;
+	lk->cb = cb;
+	lk->arg = arg;
+	lk->cancelled = false;
+
+	lk->prev = NULL;
+	lk->next = u->head;
+	if (u->head != NULL)
+		u->head->prev = lk;
+	u->head = lk;
+
+	nss_ubdns_pipeline_add(u->p, &lk->l);
+	return (lk);
+}
+
+void ubdns_cancel(struct ubdns *u, struct ubdns_lookup *lk)
+{
+	(void) u;
+	if (lk->cancelled)
+		return;
+	lk->cancelled = true;
+	nss_ubdns_lookup_cancel(&lk->l);
+}
+
+int ubdns_process(struct ubdns *u)
+{
+	struct nss_ubdns_lookup *l;
+	struct ubdns_lookup *lk;
+	struct ubdns_result result;
+	struct hostent host;
+	int n = 0;
+
+	while ((l = nss_ubdns_pipeline_next(u->p)) != NULL) {
+		lk = l->data;
+		if (lk->prev != NULL)
+			lk->prev->next = lk->next;
+		else
+			u->head = lk->next;
+		if (lk->next != NULL)
+			lk->next->prev = lk->prev;
+
+		if (!lk->cancelled) {
+			pack_result(l, &result, &host, &u->buffer, &u->buflen,
+				    NSS_UBDNS_STAT_ASYNC);
+			lk->cb(lk->arg, &result);
+			n++;
+		}
+		nss_ubdns_lookup_release(l);
+		free(lk);
+	}
+	return (n);
+}
@@ -42,52 +42,432 @@
 #include <sys/types.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <stdbool.h>
 #include <time.h>
 
-#define NSS_UBDNS_LUCONF	"/etc/nss-ubdns/libunbound.conf"
-#define NSS_UBDNS_KEYDIR	"/etc/nss-ubdns/keys"
+#define NSS_UBDNS_CONFDIR	"/etc/nss-ubdns"
+#define NSS_UBDNS_CONF		"nss-ubdns.conf"	/* in the configuration directory */
+#define NSS_UBDNS_LUCONF	"libunbound.conf"
+#define NSS_UBDNS_KEYDIR	"keys"
+#define NSS_UBDNS_HOSTSDB	"hosts.db"
 #define NSS_UBDNS_RESOLVCONF	"/etc/resolv.conf"
+#define NSS_UBDNS_CACHED_SOCKET	"/run/nss-ubdns/cached.sock"
+#define NSS_UBDNS_SHMCACHE	"/run/nss-ubdns/cache"
+#define NSS_UBDNS_SNAPSHOT	"/var/cache/nss-ubdns/snapshot"
+#define NSS_UBDNS_STATS_DIR	"/dev/shm"
+#define NSS_UBDNS_STATS_PREFIX	"nss-ubdns-stats."	/* followed by the pid */
 
 #define NSS_UBDNS_PRESLEN_NAME	1025
+#define NSS_UBDNS_NAMES_MAX	1024	/* room for an answer's CNAME chain */
+#define NSS_UBDNS_ARPA_QNAME_MAX	74	/* 32 nibble labels and "ip6.arpa." */
+#define NSS_UBDNS_CACHE_SIZE	(4 * 1024 * 1024)	/* front cache budget */
+#define NSS_UBDNS_CACHE_PTR	255	/* front cache kind for reverse lookups */
+#define NSS_UBDNS_CACHE_HIT	1
+#define NSS_UBDNS_CACHE_PREFETCH	2	/* a hit on an answer that should be refreshed */
+#define NSS_UBDNS_CACHE_STALE	3	/* an expired answer, see nss_ubdns_stale_get() */
+#define NSS_UBDNS_FORK_PREPARE	0	/* pthread_atfork() handler phases */
+#define NSS_UBDNS_FORK_PARENT	1
+#define NSS_UBDNS_FORK_CHILD	2
 #define NSS_UBDNS_TYPE_A	1
 #define NSS_UBDNS_TYPE_PTR	12
 #define NSS_UBDNS_TYPE_AAAA	28
 
+#define NSS_UBDNS_CACHED_MAXMSG	65536
+#define NSS_UBDNS_ADDRESSES_STACK	32	/* addresses returned without allocating */
+
+#define NSS_UBDNS_SEARCH_MAX	6	/* domains in the search list */
+#define NSS_UBDNS_SEARCH_LEN	256	/* bytes of search list */
+#define NSS_UBDNS_NDOTS_MAX	15
+
+#define NSS_UBDNS_ERR_TIMEOUT	(-100)	/* query error: the lookup's deadline passed */
+#define NSS_UBDNS_ERR_CANCELLED	(-101)	/* query error: the lookup was answered without it, or cancelled */
+#define NSS_UBDNS_TIMEDOUT	(-2)	/* lookup result: the deadline passed */
+
+struct ub_ctx;
+struct ub_result;
+struct nss_ubdns_context;
+struct nss_ubdns_lookup;
+struct nss_ubdns_pipeline;
+
 struct address {
 	unsigned char family;
 	uint8_t address[16];
 	unsigned char scope;
 };
 
-void arpa_qname_ip4(const void *addr, char **res);
-void arpa_qname_ip6(const void *addr, char **res);
+/* Module options, read from nss-ubdns.conf in the configuration directory. */
+struct nss_ubdns_options {
+	unsigned deadline;	/* milliseconds per lookup, 0 for none */
+	unsigned serve_stale;	/* seconds past expiry an answer may be served, 0 for never */
+	unsigned stale_ttl;	/* seconds, the TTL given with a stale answer */
+	unsigned stale_threshold;	/* milliseconds to wait for a refresh first */
+	unsigned prefetch_hits;	/* hits that make an expiring answer worth refreshing */
+	unsigned contexts;	/* resolver contexts lookups are spread over */
 
-size_t domain_to_str(const uint8_t *src, size_t src_len, char *dst);
+	/* from resolv.conf */
+	unsigned ndots;		/* dots that make a name be tried as is first */
+	unsigned n_search;
+	char search[NSS_UBDNS_SEARCH_LEN];	/* n_search NUL terminated domains */
+};
 
-int nss_ubdns_lookup_forward(const char *hn, int af, struct address **_list, unsigned *_n_list);
-char *nss_ubdns_lookup_reverse(const void *addr, int af);
+struct nss_ubdns_query {
+	int rrtype;
+	int err;
+	int async_id;
+	bool done;
+	bool cached;		/* res was built by nss_ubdns_result_new(), free() it */
+	struct ub_result *res;
+	struct nss_ubdns_context *context;	/* while resolving in-process */
+	struct nss_ubdns_lookup *lookup;	/* if part of a pipelined lookup */
+};
 
-static inline size_t PROTO_ADDRESS_SIZE(int proto) {
-	assert(proto == AF_INET || proto == AF_INET6);
-	return proto == AF_INET6 ? 16 : 4;
+#define NSS_UBDNS_LOOKUP_NAMES	4096	/* room for a pipelined lookup's names before allocating */
+
+/*
+ * A lookup made through a pipeline, see nss_ubdns_pipeline_add(). The caller
+ * fills in the query and owns the memory; the pipeline fills in the result,
+ * as nss_ubdns_lookup_forward() or nss_ubdns_lookup_reverse() would return
+ * it, with the names of a reverse lookup in names.
+ */
+struct nss_ubdns_lookup {
+	bool reverse;
+	int af;			/* forward: AF_INET, AF_INET6 or AF_UNSPEC */
+	char name[NSS_UBDNS_PRESLEN_NAME];	/* forward */
+	uint8_t addr[16];	/* reverse */
+	void *data;		/* the caller's */
+
+	int r;
+	int32_t ttl;
+	struct address *list;	/* buf, or allocated if too many */
+	unsigned n_list;
+	unsigned n_names;
+	size_t names_len;
+	char *names;		/* names_buf, or allocated if too long */
+	struct address buf[NSS_UBDNS_ADDRESSES_STACK];
+	char names_buf[NSS_UBDNS_LOOKUP_NAMES];
+
+	/* the pipeline's */
+	struct nss_ubdns_pipeline *pipeline;
+	struct nss_ubdns_lookup *next, *prev;	/* unfinished, in the order added */
+	struct nss_ubdns_lookup *ready_next;
+	struct nss_ubdns_context *context;
+	struct nss_ubdns_query q[2];
+	unsigned n_q;
+	bool ready;
+	bool expired;
+	int64_t deadline;
+	int64_t start;
+	size_t key_len;
+	char key[NSS_UBDNS_PRESLEN_NAME];
+};
+
+/*
+ * nss-ubdns-cached protocol. Messages are exchanged in native byte order over
+ * a local stream socket. Replies may arrive in any order and are matched to
+ * their request by id.
+ */
+#define NSS_UBDNS_CACHED_PREFETCH	0x8000	/* in rrtype: refresh, bypassing the caches */
+
+struct nss_ubdns_cached_request {
+	uint32_t id;
+	uint16_t rrtype;
+	uint16_t qname_len;	/* including the terminating NUL */
+	/* followed by the qname */
+};
+
+struct nss_ubdns_cached_reply {
+	uint32_t id;
+	int32_t err;		/* libunbound error code */
+	int32_t ttl;
+	uint32_t len;		/* bytes following the header */
+	uint16_t n_data;
+	uint16_t names_len;
+	uint8_t havedata;
+	uint8_t nxdomain;
+	uint8_t secure;
+	uint8_t bogus;
+	uint8_t rcode;
+	uint8_t pad[3];
+	/* followed by n_data (uint16_t length, rdata) pairs, then the names of
+	 * the CNAME chain, see nss_ubdns_result_names() */
+};
+
+/*
+ * Shared answer cache. A file under /run, written only by nss-ubdns-cached
+ * and mapped read-only by every process using the module. Each slot is
+ * guarded by a sequence counter which is odd while the slot is being
+ * written, so readers never block: a torn or expired slot is a miss.
+ */
+#define NSS_UBDNS_SHMCACHE_MAGIC	0x75626463
+#define NSS_UBDNS_SHMCACHE_VERSION	3
+#define NSS_UBDNS_SHMCACHE_SLOTS	16384
+#define NSS_UBDNS_SHMCACHE_WAYS		4
+#define NSS_UBDNS_SHMCACHE_SLOTSIZE	1024
+
+/*
+ * A snapshot of the shared cache, written by nss-ubdns-cached every
+ * NSS_UBDNS_SNAPSHOT_INTERVAL seconds and when it exits, has the same layout
+ * with its own magic. Its slots expire in CLOCK_REALTIME seconds, so that
+ * they survive a reboot, and they are only valid under the configuration
+ * whose nss_ubdns_config_signature() is in the header.
+ */
+#define NSS_UBDNS_SNAPSHOT_MAGIC	0x75627370
+#define NSS_UBDNS_SNAPSHOT_INTERVAL	300
+
+#define NSS_UBDNS_SHMCACHE_SECURE	0x01
+#define NSS_UBDNS_SHMCACHE_HAVEDATA	0x02
+#define NSS_UBDNS_SHMCACHE_NXDOMAIN	0x04
+
+struct nss_ubdns_shmcache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_slots;
+	uint32_t slot_size;
+	uint32_t valid;		/* cleared when the writer exits */
+	uint32_t generation;	/* bumped when the writer's configuration changes */
+	uint64_t config_sig;	/* of a snapshot */
+	uint8_t pad[32];
+};
+
+struct nss_ubdns_shmcache_slot {
+	uint32_t seq;
+	uint32_t hash;
+	int64_t expire;		/* CLOCK_MONOTONIC seconds */
+	uint32_t generation;	/* slots from other generations are stale */
+	uint16_t rrtype;
+	uint16_t rdata_len;
+	uint16_t n_data;
+	uint8_t flags;
+	uint8_t qname_len;
+	uint16_t names_len;	/* of the CNAME chain, stored after the rdata */
+	uint16_t pad;
+	char qname[256];	/* as produced by nss_ubdns_qname_key() */
+	uint8_t rdata[NSS_UBDNS_SHMCACHE_SLOTSIZE - 288];
+};
+
+/*
+ * Static overrides. nss-ubdns-compile turns a hosts(5) style file into a
+ * read-only hash table, which the module maps and consults before anything
+ * else, see hostsdb.c. The header is followed by the buckets, a power of two
+ * of them at most half full, in which a record is found by linear probing
+ * from nss_ubdns_qname_hash() of its key and kind. A forward record is keyed
+ * by the name's nss_ubdns_qname_key() and holds its addresses, IPv4 first,
+ * then its canonical name and aliases as consecutive NUL-terminated names,
+ * then the uint16_t length of the names. A reverse record is keyed by the
+ * address's arpa qname and holds the same names.
+ */
+#define NSS_UBDNS_HOSTSDB_MAGIC		0x75626862
+#define NSS_UBDNS_HOSTSDB_VERSION	1
+
+#define NSS_UBDNS_HOSTSDB_FORWARD	1	/* record kinds */
+#define NSS_UBDNS_HOSTSDB_REVERSE	2
+
+struct nss_ubdns_hostsdb_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t address_size;	/* sizeof(struct address) */
+	uint32_t n_buckets;
+	uint32_t n_records;
+	int32_t ttl;		/* returned with every answer */
+	uint64_t size;		/* of the whole file */
+};
+
+struct nss_ubdns_hostsdb_bucket {
+	uint32_t hash;
+	uint32_t off;		/* of the record in the file, 0 if the bucket is empty */
+};
+
+struct nss_ubdns_hostsdb_record {
+	uint16_t kind;
+	uint16_t key_len;
+	uint32_t val_len;
+	/* followed by the key, NUL terminated, and the value, padded to 8 bytes */
+};
+
+/*
+ * Runtime statistics. Each process that uses the module counts into a file
+ * of its own under /dev/shm, which nss-ubdns-stat finds and sums. Every
+ * thread has a slot to itself, on cache lines no other thread writes, so
+ * counting is a plain increment; the slots of threads that have exited are
+ * taken over by new ones and keep their counts.
+ */
+#define NSS_UBDNS_STATS_MAGIC		0x75627374
+#define NSS_UBDNS_STATS_VERSION		4
+#define NSS_UBDNS_STATS_SLOTS		256	/* any more threads share the last one */
+#define NSS_UBDNS_STATS_BUCKETS		32
+
+#define NSS_UBDNS_STAT_BYNAME4		0	/* lookups[] entry points */
+#define NSS_UBDNS_STAT_BYNAME3		1	/* also gethostbyname{,2}_r() */
+#define NSS_UBDNS_STAT_BYADDR		2	/* gethostbyaddr{,2}_r() */
+#define NSS_UBDNS_STAT_BATCH		3	/* ubdns_resolve_batch() */
+#define NSS_UBDNS_STAT_ASYNC		4	/* ubdns_submit() */
+#define NSS_UBDNS_STAT_ENTRIES		5
+
+#define NSS_UBDNS_STAT_A		0	/* queries[] types */
+#define NSS_UBDNS_STAT_AAAA		1
+#define NSS_UBDNS_STAT_PTR		2
+#define NSS_UBDNS_STAT_QTYPES		3
+
+struct nss_ubdns_stats_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_slots;
+	uint32_t slot_size;
+	int32_t pid;
+	uint8_t pad[44];
+};
+
+struct nss_ubdns_stats {
+	uint32_t owner;		/* thread counting here, 0 if none */
+	uint32_t pad;
+	uint64_t lookups[NSS_UBDNS_STAT_ENTRIES];
+	uint64_t erange;	/* lookups that asked for a bigger buffer */
+	uint64_t timeouts;	/* lookups that gave up at their deadline */
+	uint64_t cache_hits;	/* front cache */
+	uint64_t cache_stale;	/* expired there, see nss_ubdns_stale_get() */
+	uint64_t cache_misses;
+	uint64_t overrides;	/* answered from hosts.db */
+	uint64_t queries[NSS_UBDNS_STAT_QTYPES];	/* past the front cache */
+	uint64_t shm_hits;	/* of those, answered by the shared cache */
+	uint64_t errors;	/* answers: libunbound errors */
+	uint64_t bogus;
+	uint64_t servfail;
+	uint64_t nxdomain;
+	/*
+	 * Lookups taking under 2^i microseconds in bucket i. Front cache hits
+	 * go in the first without being timed: reading the clock twice would
+	 * cost about as much as the hit itself.
+	 */
+	uint64_t latency[NSS_UBDNS_STATS_BUCKETS];
+} __attribute__((aligned(64)));
+
+/* the calling thread's slot, see nss_ubdns_stats_slot() */
+extern __thread struct nss_ubdns_stats *nss_ubdns_stats_self;
+extern __thread bool nss_ubdns_stats_shared;	/* with other threads */
+
+struct nss_ubdns_stats *nss_ubdns_stats_slot(void);
+void nss_ubdns_stats_latency(struct nss_ubdns_stats *s, int64_t start);
+void nss_ubdns_stats_fork(int phase);
+
+static inline struct nss_ubdns_stats *nss_ubdns_stats(void) {
+	struct nss_ubdns_stats *s = nss_ubdns_stats_self;
+
+	return (s != NULL ? s : nss_ubdns_stats_slot());
 }
 
-static inline int address_compare(const void *_a, const void *_b) {
-	const struct address *a = _a, *b = _b;
+/*
+ * A thread with a slot of its own is the only one writing to it, so it needn't
+ * add atomically. The threads sharing the last slot, or the unread one when
+ * there is no segment, must. Readers may see any recent value.
+ */
+static inline void nss_ubdns_stat_add(uint64_t *counter, uint64_t n) {
+	if (nss_ubdns_stats_shared)
+		__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+				 __ATOMIC_RELAXED);
+}
 
-	/* Order lowest scope first, IPv4 before IPv6, lowest interface index first */
+static inline int64_t nss_ubdns_now(void) {
+	struct timespec ts;
 
-	if (a->scope < b->scope)
-		return -1;
-	if (a->scope > b->scope)
-		return 1;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (ts.tv_sec);
+}
 
-	if (a->family == AF_INET && b->family == AF_INET6)
-		return -1;
-	if (a->family == AF_INET6 && b->family == AF_INET)
-		return 1;
+/* CLOCK_MONOTONIC milliseconds, for lookup deadlines */
+static inline int64_t nss_ubdns_now_ms(void) {
+	struct timespec ts;
 
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* CLOCK_MONOTONIC nanoseconds, for lookup latency statistics */
+static inline int64_t nss_ubdns_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+const char *nss_ubdns_confdir(void);
+bool nss_ubdns_confdir_private(void);
+void nss_ubdns_conf_path(char *path, size_t size, const char *fn);
+struct ub_ctx *nss_ubdns_ctx_new(void);
+struct ub_ctx *nss_ubdns_prefetch_ctx_new(void);
+uint64_t nss_ubdns_config_signature(void);
+void nss_ubdns_options_load(struct nss_ubdns_options *opts);
+
+struct ub_result *nss_ubdns_result_new(int rrtype, const uint8_t *rdata, size_t rdata_len, unsigned n_data,
+				       const char *names, size_t names_len);
+struct ub_result *nss_ubdns_result_copy(const struct ub_result *src);
+size_t nss_ubdns_result_names(const struct ub_result *res, char *dst, size_t dst_len, unsigned *n_names);
+size_t nss_ubdns_result_rdata(const struct ub_result *res, uint8_t *dst, size_t dst_len, unsigned *n_data);
+size_t nss_ubdns_qname_key(const char *qname, char *key, size_t key_size);
+uint32_t nss_ubdns_qname_hash(const char *key, int rrtype);
+
+int nss_ubdns_cache_get(int kind, const void *key, size_t key_len, void *buf, size_t buf_len,
+			void **val, size_t *val_len, int32_t *ttl);
+bool nss_ubdns_cache_get_stale(int kind, const void *key, size_t key_len, void *buf, size_t buf_len,
+			       void **val, size_t *val_len, int64_t max_stale);
+void nss_ubdns_cache_drop(int kind, const void *key, size_t key_len);
+void nss_ubdns_cache_flush(void);
+void nss_ubdns_cache_set_prefetch(unsigned hits);
+void nss_ubdns_cache_put(int kind, const void *key, size_t key_len, const void *val, size_t val_len, int32_t ttl);
+void nss_ubdns_cache_fork(int phase);
+
+int nss_ubdns_shmcache_lookup(const char *qname, struct nss_ubdns_query *q);
+uint32_t nss_ubdns_shmcache_generation(void);
+struct nss_ubdns_shmcache_header *nss_ubdns_shmcache_create(const char *path);
+void nss_ubdns_shmcache_store(struct nss_ubdns_shmcache_header *hdr, const char *key, int rrtype, const struct ub_result *res);
+void nss_ubdns_shmcache_flush(struct nss_ubdns_shmcache_header *hdr);
+void nss_ubdns_shmcache_close(struct nss_ubdns_shmcache_header *hdr);
+void nss_ubdns_shmcache_fork(int phase);
+void nss_ubdns_shmcache_set_config(uint64_t sig);
+bool nss_ubdns_shmcache_snapshot(struct nss_ubdns_shmcache_header *hdr, const char *path, uint64_t sig);
+unsigned nss_ubdns_shmcache_restore(struct nss_ubdns_shmcache_header *hdr, const char *path, uint64_t sig);
+
+int nss_ubdns_cached_resolve(const char *qname, struct nss_ubdns_query *q, unsigned n_q,
+			     int64_t deadline, bool prefetch);
+int nss_ubdns_cached_resolve_names(const char *const *qnames, struct nss_ubdns_query *q, unsigned n_q,
+				   int64_t deadline,
+				   bool (*decided)(const struct nss_ubdns_query *, unsigned, void *),
+				   void *arg);
+
+void nss_ubdns_hostsdb_init(void);
+void nss_ubdns_hostsdb_check(void);
+bool nss_ubdns_hostsdb_forward(const char *hn, int af, struct address *buf, unsigned buf_n,
+			       struct address **_list, unsigned *_n_list,
+			       char *names, size_t *_names_len, int32_t *ttlp);
+int nss_ubdns_hostsdb_reverse(const char *qname, size_t qname_len, char *buf, size_t buf_len,
+			      size_t *_names_len, unsigned *_n_names, int32_t *ttlp);
+void nss_ubdns_hostsdb_fork(int phase);
+
+size_t arpa_qname_ip4(const void *addr, char *dst);
+size_t arpa_qname_ip6(const void *addr, char *dst);
+
+size_t domain_to_str(const uint8_t *src, size_t src_len, char *dst);
+size_t domain_to_str_size(const uint8_t *src, size_t src_len);
+
+int nss_ubdns_lookup_forward(const char *hn, int af, struct address *buf, unsigned buf_n,
+			     struct address **_list, unsigned *_n_list,
+			     char *names, size_t *_names_len, int32_t *ttlp);
+int nss_ubdns_lookup_reverse(const void *addr, int af, char *buf, size_t buf_len,
+			     size_t *_names_len, unsigned *_n_names, int32_t *ttlp);
+
+struct nss_ubdns_pipeline *nss_ubdns_pipeline_new(void);
+void nss_ubdns_pipeline_free(struct nss_ubdns_pipeline *p);
+int nss_ubdns_pipeline_fd(const struct nss_ubdns_pipeline *p);
+int nss_ubdns_pipeline_timeout(const struct nss_ubdns_pipeline *p);
+void nss_ubdns_pipeline_add(struct nss_ubdns_pipeline *p, struct nss_ubdns_lookup *l);
+struct nss_ubdns_lookup *nss_ubdns_pipeline_next(struct nss_ubdns_pipeline *p);
+void nss_ubdns_lookup_cancel(struct nss_ubdns_lookup *l);
+void nss_ubdns_lookup_release(struct nss_ubdns_lookup *l);
+
+static inline size_t PROTO_ADDRESS_SIZE(int proto) {
+	assert(proto == AF_INET || proto == AF_INET6);
+	return proto == AF_INET6 ? 16 : 4;
 }
 
 #endif /* NSS_UBDNS_H */
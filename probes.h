@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef NSS_UBDNS_PROBES_H
+#define NSS_UBDNS_PROBES_H
+
+/*
+ * USDT probes, provider "nss_ubdns", built in when <sys/sdt.h> is available.
+ * Every probe's first three arguments are the name, the query type (0 for a
+ * lookup of both A and AAAA) and the nanoseconds since the lookup entered the
+ * module, or 0 in the module's own background threads:
+ *
+ *   lookup__entry	function
+ *   cache__lookup	0 miss, 1 hit, 2 hit due for prefetch, 3 expired answer
+ *   resolve__start
+ *   resolve__done	libunbound error, rcode
+ *   validate		secure, bogus, why_bogus
+ *   pack		number of addresses or names
+ *   buffer__small	bytes needed (0 if unknown), bytes given
+ *   lookup__return	function, enum nss_status
+ *
+ * Each probe has a semaphore, so its arguments are only computed, and the
+ * clock only read, while a tracer is attached to it.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#ifdef NSS_UBDNS_PROBES_DEFINE
+# define NSS_UBDNS_SEMAPHORE(name) \
+	unsigned short nss_ubdns_##name##_semaphore __attribute__((section(".probes"))) = 0
+#else
+# define NSS_UBDNS_SEMAPHORE(name) \
+	extern unsigned short nss_ubdns_##name##_semaphore
+#endif
+
+NSS_UBDNS_SEMAPHORE(lookup__entry);
+NSS_UBDNS_SEMAPHORE(cache__lookup);
+NSS_UBDNS_SEMAPHORE(resolve__start);
+NSS_UBDNS_SEMAPHORE(resolve__done);
+NSS_UBDNS_SEMAPHORE(validate);
+NSS_UBDNS_SEMAPHORE(pack);
+NSS_UBDNS_SEMAPHORE(buffer__small);
+NSS_UBDNS_SEMAPHORE(lookup__return);
+
+/* when the calling thread's lookup entered the module, while tracing */
+extern __thread int64_t nss_ubdns_probe_start;
+
+#define NSS_UBDNS_PROBE_ENABLED(name) \
+	__builtin_expect(nss_ubdns_##name##_semaphore != 0, 0)
+
+static inline bool nss_ubdns_probing(void) {
+	return (__builtin_expect((nss_ubdns_lookup__entry_semaphore |
+				  nss_ubdns_cache__lookup_semaphore |
+				  nss_ubdns_resolve__start_semaphore |
+				  nss_ubdns_resolve__done_semaphore |
+				  nss_ubdns_validate_semaphore |
+				  nss_ubdns_pack_semaphore |
+				  nss_ubdns_buffer__small_semaphore |
+				  nss_ubdns_lookup__return_semaphore) != 0, 0));
+}
+
+/* At each entry point: start the clock the lookup's probes report. */
+#define NSS_UBDNS_PROBE_BEGIN() do { \
+	if (nss_ubdns_probing()) \
+		nss_ubdns_probe_start = nss_ubdns_now_ns(); \
+} while (0)
+
+#define NSS_UBDNS_PROBE_ELAPSED() \
+	(nss_ubdns_probe_start != 0 ? nss_ubdns_now_ns() - nss_ubdns_probe_start : 0)
+
+#define NSS_UBDNS_PROBE3(name, qname, qtype) do { \
+	if (NSS_UBDNS_PROBE_ENABLED(name)) \
+		DTRACE_PROBE3(nss_ubdns, name, qname, qtype, NSS_UBDNS_PROBE_ELAPSED()); \
+} while (0)
+
+#define NSS_UBDNS_PROBE4(name, qname, qtype, a4) do { \
+	if (NSS_UBDNS_PROBE_ENABLED(name)) \
+		DTRACE_PROBE4(nss_ubdns, name, qname, qtype, NSS_UBDNS_PROBE_ELAPSED(), a4); \
+} while (0)
+
+#define NSS_UBDNS_PROBE5(name, qname, qtype, a4, a5) do { \
+	if (NSS_UBDNS_PROBE_ENABLED(name)) \
+		DTRACE_PROBE5(nss_ubdns, name, qname, qtype, NSS_UBDNS_PROBE_ELAPSED(), a4, a5); \
+} while (0)
+
+#define NSS_UBDNS_PROBE6(name, qname, qtype, a4, a5, a6) do { \
+	if (NSS_UBDNS_PROBE_ENABLED(name)) \
+		DTRACE_PROBE6(nss_ubdns, name, qname, qtype, NSS_UBDNS_PROBE_ELAPSED(), a4, a5, a6); \
+} while (0)
+
+/* The name of a reverse lookup, only worked out while it is being traced. */
+#define NSS_UBDNS_PROBE_ARPA(addr, af) \
+	nss_ubdns_probe_arpa(addr, af, (char [NSS_UBDNS_ARPA_QNAME_MAX]) { 0 })
+
+static inline const char *nss_ubdns_probe_arpa(const void *addr, int af, char *buf) {
+	if (af == AF_INET)
+		arpa_qname_ip4(addr, buf);
+	else if (af == AF_INET6)
+		arpa_qname_ip6(addr, buf);
+	return (buf);
+}
+
+#else /* HAVE_SYS_SDT_H */
+
+#define NSS_UBDNS_PROBE_BEGIN()					do { } while (0)
+#define NSS_UBDNS_PROBE3(name, qname, qtype)			do { } while (0)
+#define NSS_UBDNS_PROBE4(name, qname, qtype, a4)		do { } while (0)
+#define NSS_UBDNS_PROBE5(name, qname, qtype, a4, a5)		do { } while (0)
+#define NSS_UBDNS_PROBE6(name, qname, qtype, a4, a5, a6)	do { } while (0)
+
+#endif /* HAVE_SYS_SDT_H */
+
+/* The query type probes report for a forward lookup in family af. */
+static inline int nss_ubdns_probe_qtype(int af) {
+	if (af == AF_INET)
+		return (NSS_UBDNS_TYPE_A);
+	if (af == AF_INET6)
+		return (NSS_UBDNS_TYPE_AAAA);
+	return (0);
+}
+
+#endif /* NSS_UBDNS_PROBES_H */
@@ -0,0 +1,363 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unbound.h>
+
+#include "nss-ubdns.h"
+
+#define CNAME_CHAIN_MAX		16
+
+#define TYPE_CNAME		5
+
+/*
+ * Copy the CNAME chain, as returned by nss_ubdns_result_names(), to the end
+ * of a result built below. canonname points at the canonical name, and the
+ * other names follow it, up to an empty one.
+ */
+static void
+result_set_names(struct ub_result *res, char *p, const char *names, size_t names_len) {
+	if (names_len == 0)
+		return;
+	memcpy(p, names, names_len);
+	p[names_len] = '\0';
+	res->canonname = p;
+}
+
+/*
+ * Build a ub_result from a sequence of (uint16_t length, rdata) pairs, as
+ * carried by nss-ubdns-cached replies and the shared answer cache, and the
+ * names of its CNAME chain. Everything lives in a single allocation, which is
+ * released with free().
+ */
+struct ub_result *
+nss_ubdns_result_new(int rrtype, const uint8_t *rdata, size_t rdata_len, unsigned n_data,
+		     const char *names, size_t names_len)
+{
+	struct ub_result *res;
+	uint8_t *p, *end;
+	unsigned i;
+
+	res = calloc(1, sizeof(*res) +
+		     (n_data + 1) * sizeof(char *) +
+		     n_data * sizeof(int) +
+		     rdata_len + names_len + 1);
+	if (res == NULL)
+		return (NULL);
+
+	res->data = (char **) (res + 1);
+	res->len = (int *) (res->data + n_data + 1);
+	p = (uint8_t *) (res->len + n_data);
+	end = p + rdata_len;
+	if (rdata_len > 0)
+		memcpy(p, rdata, rdata_len);
+
+	for (i = 0; i < n_data; i++) {
+		uint16_t len;
+
+		if (end - p < (ptrdiff_t) sizeof(len))
+			break;
+		memcpy(&len, p, sizeof(len));
+		p += sizeof(len);
+		if (end - p < len)
+			break;
+		res->data[i] = (char *) p;
+		res->len[i] = len;
+		p += len;
+	}
+	if (i != n_data) {
+		free(res);
+		return (NULL);
+	}
+	res->data[i] = NULL;
+	result_set_names(res, (char *) end, names, names_len);
+
+	res->qtype = rrtype;
+	res->qclass = 1 /*IN*/;
+	return (res);
+}
+
+/*
+ * Copy a ub_result into a single allocation, in the same layout as
+ * nss_ubdns_result_new(). Only the fields used by the lookup functions are
+ * kept.
+ */
+struct ub_result *
+nss_ubdns_result_copy(const struct ub_result *src) {
+	struct ub_result *res;
+	char names[NSS_UBDNS_NAMES_MAX];
+	size_t rdata_len = 0, names_len;
+	unsigned i, n_data, n_names;
+	uint8_t *p;
+
+	for (n_data = 0; src->data[n_data] != NULL; n_data++)
+		rdata_len += src->len[n_data];
+	names_len = nss_ubdns_result_names(src, names, sizeof(names), &n_names);
+
+	res = calloc(1, sizeof(*res) +
+		     (n_data + 1) * sizeof(char *) +
+		     n_data * sizeof(int) +
+		     rdata_len + names_len + 1);
+	if (res == NULL)
+		return (NULL);
+
+	res->data = (char **) (res + 1);
+	res->len = (int *) (res->data + n_data + 1);
+	p = (uint8_t *) (res->len + n_data);
+	for (i = 0; i < n_data; i++) {
+		memcpy(p, src->data[i], src->len[i]);
+		res->data[i] = (char *) p;
+		res->len[i] = src->len[i];
+		p += src->len[i];
+	}
+	res->data[i] = NULL;
+	result_set_names(res, (char *) p, names, names_len);
+
+	res->qtype = src->qtype;
+	res->qclass = src->qclass;
+	res->rcode = src->rcode;
+	res->havedata = src->havedata;
+	res->nxdomain = src->nxdomain;
+	res->secure = src->secure;
+	res->bogus = src->bogus;
+	res->ttl = src->ttl;
+	return (res);
+}
+
+/*
+ * Read the name at off in a DNS message, following compression pointers, into
+ * wire in uncompressed form. Returns its length, or 0 if it is malformed, and
+ * sets *next to the offset just past the name where it appears.
+ */
+static size_t
+packet_name(const uint8_t *pkt, size_t pkt_len, size_t off, uint8_t *wire, size_t *next) {
+	size_t len = 0;
+	unsigned jumps = 0;
+
+	*next = 0;
+	for (;;) {
+		uint8_t l;
+
+		if (off >= pkt_len)
+			return (0);
+		l = pkt[off];
+		if ((l & 0xc0) == 0xc0) {
+			if (off + 1 >= pkt_len || ++jumps > 64)
+				return (0);
+			if (*next == 0)
+				*next = off + 2;
+			off = ((l & 0x3f) << 8) | pkt[off + 1];
+			continue;
+		}
+		if (l > 63 || off + 1 + l > pkt_len || len + 1 + l > 255)
+			return (0);
+		memcpy(wire + len, pkt + off, 1 + l);
+		len += 1 + l;
+		off += 1 + l;
+		if (l == 0)
+			break;
+	}
+	if (*next == 0)
+		*next = off;
+	return (len);
+}
+
+/* Label lengths are below 'A', so lowercasing every octet is safe. */
+static bool
+wire_name_equal(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len) {
+	size_t i;
+
+	if (a_len != b_len)
+		return (false);
+	for (i = 0; i < a_len; i++) {
+		uint8_t x = a[i], y = b[i];
+
+		if (x >= 'A' && x <= 'Z')
+			x += 'a' - 'A';
+		if (y >= 'A' && y <= 'Z')
+			y += 'a' - 'A';
+		if (x != y)
+			return (false);
+	}
+	return (true);
+}
+
+/* Append a name in presentation form, without its trailing dot. */
+static bool
+names_append(char *dst, size_t dst_len, size_t *off, const uint8_t *wire, size_t wire_len) {
+	size_t len;
+
+	if (domain_to_str_size(wire, wire_len) > dst_len - *off)
+		return (false);
+	domain_to_str(wire, wire_len, dst + *off);
+	len = strlen(dst + *off);
+	if (len > 1)
+		dst[*off + --len] = '\0';
+	*off += len + 1;
+	return (true);
+}
+
+/*
+ * The CNAME chain of an answer, as consecutive NUL-terminated names: the
+ * canonical name, then the name that was queried and any others the chain
+ * passed through, in order. Aliases that don't fit in dst are left out.
+ * Returns the length of the names, or 0 if the answer involved no CNAME.
+ */
+size_t
+nss_ubdns_result_names(const struct ub_result *res, char *dst, size_t dst_len,
+		       unsigned *n_names)
+{
+	struct {
+		uint8_t owner[255], target[255];
+		size_t owner_len, target_len;
+	} cname[CNAME_CHAIN_MAX];
+	const uint8_t *pkt = res->answer_packet;
+	size_t pkt_len = res->answer_len, off, next, len, name_len;
+	uint8_t name[255];
+	unsigned i, j, n_an, n_cname = 0, chain[CNAME_CHAIN_MAX], n_chain = 0;
+
+	*n_names = 0;
+
+	/* built by nss_ubdns_result_new() or nss_ubdns_result_copy() */
+	if (pkt == NULL) {
+		const char *p = res->canonname;
+
+		if (p == NULL)
+			return (0);
+		for (; *p != '\0'; p += strlen(p) + 1)
+			(*n_names)++;
+		len = p - res->canonname;
+		if (len > dst_len) {
+			*n_names = 0;
+			return (0);
+		}
+		memcpy(dst, res->canonname, len);
+		return (len);
+	}
+
+	if (pkt_len < 12 || ((pkt[4] << 8) | pkt[5]) != 1)
+		return (0);
+	n_an = (pkt[6] << 8) | pkt[7];
+
+	name_len = packet_name(pkt, pkt_len, 12, name, &off);
+	if (name_len == 0)
+		return (0);
+	off += 4;
+
+	for (i = 0; i < n_an && n_cname < CNAME_CHAIN_MAX; i++) {
+		uint16_t type, rdlen;
+
+		len = packet_name(pkt, pkt_len, off, cname[n_cname].owner, &off);
+		if (len == 0 || off + 10 > pkt_len)
+			return (0);
+		type = (pkt[off] << 8) | pkt[off + 1];
+		rdlen = (pkt[off + 8] << 8) | pkt[off + 9];
+		off += 10;
+		if (off + rdlen > pkt_len)
+			return (0);
+		if (type == TYPE_CNAME) {
+			cname[n_cname].owner_len = len;
+			cname[n_cname].target_len = packet_name(pkt, pkt_len, off,
+								cname[n_cname].target, &next);
+			if (cname[n_cname].target_len == 0)
+				return (0);
+			n_cname++;
+		}
+		off += rdlen;
+	}
+
+	/* walk the chain from the query name */
+	for (;;) {
+		for (j = 0; j < n_cname; j++)
+			if (wire_name_equal(cname[j].owner, cname[j].owner_len, name, name_len))
+				break;
+		if (j == n_cname || n_chain == CNAME_CHAIN_MAX)
+			break;
+		chain[n_chain++] = j;
+		memcpy(name, cname[j].target, cname[j].target_len);
+		name_len = cname[j].target_len;
+	}
+	if (n_chain == 0)
+		return (0);
+
+	off = 0;
+	if (!names_append(dst, dst_len, &off, name, name_len))
+		return (0);
+	(*n_names)++;
+	for (i = 0; i < n_chain; i++) {
+		j = chain[i];
+		if (!names_append(dst, dst_len, &off, cname[j].owner, cname[j].owner_len))
+			break;
+		(*n_names)++;
+	}
+	return (off);
+}
+
+/* Append the rdata of a ub_result as (uint16_t length, rdata) pairs. */
+size_t
+nss_ubdns_result_rdata(const struct ub_result *res, uint8_t *dst, size_t dst_len, unsigned *n_data) {
+	size_t off = 0;
+	unsigned i;
+
+	for (i = 0; res->data[i] != NULL; i++) {
+		uint16_t len = res->len[i];
+
+		if (off + sizeof(len) + len > dst_len)
+			return (0);
+		memcpy(dst + off, &len, sizeof(len));
+		memcpy(dst + off + sizeof(len), res->data[i], len);
+		off += sizeof(len) + len;
+	}
+	*n_data = i;
+	return (off);
+}
+
+/*
+ * Normalize a name for use as a cache key: lowercased, without the trailing
+ * dot. Returns the length of the key, or 0 if it does not fit.
+ */
+size_t
+nss_ubdns_qname_key(const char *qname, char *key, size_t key_size) {
+	size_t i, len;
+
+	len = strlen(qname);
+	if (len > 1 && qname[len - 1] == '.')
+		len--;
+	if (len == 0 || len >= key_size)
+		return (0);
+
+	for (i = 0; i < len; i++) {
+		char c = qname[i];
+		key[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+	}
+	key[len] = '\0';
+	return (len);
+}
+
+uint32_t
+nss_ubdns_qname_hash(const char *key, int rrtype) {
+	uint32_t h = 2166136261u;
+
+	for (; *key != '\0'; key++)
+		h = (h ^ (uint8_t) *key) * 16777619u;
+	h = (h ^ (uint32_t) rrtype) * 16777619u;
+	return (h);
+}
@@ -0,0 +1,533 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <unbound.h>
+
+#include "nss-ubdns.h"
+
+#define SHMCACHE_SIZE	(sizeof(struct nss_ubdns_shmcache_header) + \
+			 NSS_UBDNS_SHMCACHE_SLOTS * sizeof(struct nss_ubdns_shmcache_slot))
+
+/*
+ * Reader side. The file is mapped on first use and never unmapped, since
+ * other threads may be reading from it at any time. The writer reuses the
+ * same file when it restarts, so the mapping stays current.
+ */
+static struct nss_ubdns_shmcache_header *shm_hdr = NULL;
+static int64_t shm_retry = 0;
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * While the daemon is not running, answers come from its last snapshot
+ * instead, as long as it was taken under the configuration this process
+ * uses. The snapshot is mapped at most once, like the cache itself: it is
+ * there for processes that start while the daemon is down, and a long-running
+ * one goes back to resolving itself as its answers expire.
+ */
+static struct nss_ubdns_shmcache_header *snap_hdr = NULL;
+static int64_t snap_retry = 0;
+static uint64_t snap_config_sig = 0;	/* of this process's configuration */
+
+static struct nss_ubdns_shmcache_slot *
+shmcache_slot(struct nss_ubdns_shmcache_header *hdr, uint32_t idx) {
+	return ((struct nss_ubdns_shmcache_slot *) (hdr + 1) + (idx & (hdr->n_slots - 1)));
+}
+
+static int64_t
+shmcache_expire(const struct nss_ubdns_shmcache_header *hdr,
+		const struct nss_ubdns_shmcache_slot *slot)
+{
+	return (slot->generation == hdr->generation ? slot->expire : 0);
+}
+
+static bool
+shmcache_header_ok(const struct nss_ubdns_shmcache_header *hdr, uint32_t magic) {
+	return (hdr->magic == magic &&
+		hdr->version == NSS_UBDNS_SHMCACHE_VERSION &&
+		hdr->n_slots == NSS_UBDNS_SHMCACHE_SLOTS &&
+		hdr->slot_size == sizeof(struct nss_ubdns_shmcache_slot));
+}
+
+static struct nss_ubdns_shmcache_header *
+shmcache_map(void) {
+	struct nss_ubdns_shmcache_header *hdr;
+	struct stat sb;
+	int64_t now;
+	void *p;
+	int fd;
+
+	hdr = __atomic_load_n(&shm_hdr, __ATOMIC_ACQUIRE);
+	if (hdr != NULL)
+		return (hdr);
+
+	if (nss_ubdns_confdir_private())
+		return (NULL);
+
+	now = nss_ubdns_now();
+	if (now < __atomic_load_n(&shm_retry, __ATOMIC_RELAXED))
+		return (NULL);
+
+	/* never make a lookup wait on another thread's attempt */
+	if (pthread_mutex_trylock(&shm_lock) != 0)
+		return (NULL);
+
+	if (shm_hdr == NULL) {
+		fd = open(NSS_UBDNS_SHMCACHE, O_RDONLY | O_CLOEXEC);
+		if (fd != -1) {
+			if (fstat(fd, &sb) == 0 && sb.st_uid == 0 &&
+			    (size_t) sb.st_size == SHMCACHE_SIZE)
+			{
+				p = mmap(NULL, SHMCACHE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+				if (p != MAP_FAILED) {
+					if (shmcache_header_ok(p, NSS_UBDNS_SHMCACHE_MAGIC))
+						__atomic_store_n(&shm_hdr, p, __ATOMIC_RELEASE);
+					else
+						munmap(p, SHMCACHE_SIZE);
+				}
+			}
+			close(fd);
+		}
+		if (shm_hdr == NULL)
+			__atomic_store_n(&shm_retry, now + 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&shm_lock);
+
+	return (shm_hdr);
+}
+
+static struct nss_ubdns_shmcache_header *
+snapshot_map(void) {
+	struct nss_ubdns_shmcache_header *hdr;
+	struct stat sb;
+	int64_t now;
+	void *p;
+	int fd;
+
+	hdr = __atomic_load_n(&snap_hdr, __ATOMIC_ACQUIRE);
+	if (hdr != NULL)
+		return (hdr);
+
+	if (nss_ubdns_confdir_private())
+		return (NULL);
+
+	now = nss_ubdns_now();
+	if (now < __atomic_load_n(&snap_retry, __ATOMIC_RELAXED))
+		return (NULL);
+	if (pthread_mutex_trylock(&shm_lock) != 0)
+		return (NULL);
+
+	if (snap_hdr == NULL) {
+		fd = open(NSS_UBDNS_SNAPSHOT, O_RDONLY | O_CLOEXEC);
+		if (fd != -1) {
+			if (fstat(fd, &sb) == 0 && sb.st_uid == 0 &&
+			    (size_t) sb.st_size == SHMCACHE_SIZE)
+			{
+				p = mmap(NULL, SHMCACHE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+				if (p != MAP_FAILED) {
+					if (shmcache_header_ok(p, NSS_UBDNS_SNAPSHOT_MAGIC))
+						__atomic_store_n(&snap_hdr, p, __ATOMIC_RELEASE);
+					else
+						munmap(p, SHMCACHE_SIZE);
+				}
+			}
+			close(fd);
+		}
+		/* a snapshot may be written later, when the daemon exits */
+		if (snap_hdr == NULL)
+			__atomic_store_n(&snap_retry, now + 10, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&shm_lock);
+
+	return (snap_hdr);
+}
+
+/* Tell the reader the signature of the configuration lookups use. */
+void
+nss_ubdns_shmcache_set_config(uint64_t sig) {
+	__atomic_store_n(&snap_config_sig, sig, __ATOMIC_RELAXED);
+}
+
+/* Called around fork(), see nss_ubdns_cache_fork(). The mapping is inherited. */
+void
+nss_ubdns_shmcache_fork(int phase) {
+	if (phase == NSS_UBDNS_FORK_PREPARE)
+		pthread_mutex_lock(&shm_lock);
+	else
+		pthread_mutex_unlock(&shm_lock);
+}
+
+static int
+shmcache_find(struct nss_ubdns_shmcache_header *hdr, const char *qname, int64_t now,
+	      struct nss_ubdns_query *q)
+{
+	struct nss_ubdns_shmcache_slot *slot, copy;
+	struct ub_result *res;
+	char key[sizeof(copy.qname)];
+	size_t key_len;
+	uint32_t hash, seq;
+	unsigned i;
+
+	key_len = nss_ubdns_qname_key(qname, key, sizeof(key));
+	if (key_len == 0)
+		return (-1);
+	hash = nss_ubdns_qname_hash(key, q->rrtype);
+
+	for (i = 0; i < NSS_UBDNS_SHMCACHE_WAYS; i++) {
+		slot = shmcache_slot(hdr, hash + i);
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) != 0 ||
+		    __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash)
+			continue;
+
+		memcpy(&copy, slot, sizeof(copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			return (-1);
+
+		if (copy.generation != __atomic_load_n(&hdr->generation, __ATOMIC_ACQUIRE) ||
+		    copy.rrtype != q->rrtype ||
+		    copy.qname_len != key_len ||
+		    memcmp(copy.qname, key, key_len) != 0)
+			continue;
+
+		if (copy.expire <= now ||
+		    copy.rdata_len + copy.names_len > sizeof(copy.rdata))
+			return (-1);
+
+		res = nss_ubdns_result_new(q->rrtype, copy.rdata, copy.rdata_len, copy.n_data,
+					   (char *) copy.rdata + copy.rdata_len, copy.names_len);
+		if (res == NULL)
+			return (-1);
+		res->secure = (copy.flags & NSS_UBDNS_SHMCACHE_SECURE) != 0;
+		res->havedata = (copy.flags & NSS_UBDNS_SHMCACHE_HAVEDATA) != 0;
+		res->nxdomain = (copy.flags & NSS_UBDNS_SHMCACHE_NXDOMAIN) != 0;
+		res->rcode = res->nxdomain ? 3 /*NXDOMAIN*/ : 0;
+		res->ttl = copy.expire - now;
+
+		q->res = res;
+		q->err = 0;
+		q->done = true;
+		q->cached = true;
+		return (0);
+	}
+	return (-1);
+}
+
+/*
+ * Look up an answer in the shared cache, or in its snapshot if the daemon is
+ * not running. Returns 0 and fills in the query on a hit, or -1 if the answer
+ * is absent, expired, or was being rewritten.
+ */
+int
+nss_ubdns_shmcache_lookup(const char *qname, struct nss_ubdns_query *q) {
+	struct nss_ubdns_shmcache_header *hdr;
+
+	hdr = shmcache_map();
+	if (hdr != NULL && __atomic_load_n(&hdr->valid, __ATOMIC_ACQUIRE))
+		return (shmcache_find(hdr, qname, nss_ubdns_now(), q));
+
+	hdr = snapshot_map();
+	if (hdr == NULL ||
+	    hdr->config_sig != __atomic_load_n(&snap_config_sig, __ATOMIC_RELAXED))
+		return (-1);
+	return (shmcache_find(hdr, qname, time(NULL), q));
+}
+
+/*
+ * The writer's configuration generation, which changes whenever answers it
+ * gave earlier may no longer be valid. 0 if there is no shared cache.
+ */
+uint32_t
+nss_ubdns_shmcache_generation(void) {
+	struct nss_ubdns_shmcache_header *hdr;
+
+	hdr = shmcache_map();
+	if (hdr == NULL)
+		return (0);
+	return (__atomic_load_n(&hdr->generation, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Writer side, used only by nss-ubdns-cached. An existing cache file with a
+ * compatible layout is reused in place, which lets readers keep their
+ * mappings across a restart of the daemon. Its answers are discarded, since
+ * the configuration they were validated with may have changed meanwhile.
+ */
+struct nss_ubdns_shmcache_header *
+nss_ubdns_shmcache_create(const char *path) {
+	struct nss_ubdns_shmcache_header *hdr;
+	struct stat sb;
+	uint32_t i;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return (NULL);
+
+	if (fstat(fd, &sb) != 0 ||
+	    ((size_t) sb.st_size != SHMCACHE_SIZE && ftruncate(fd, SHMCACHE_SIZE) != 0))
+	{
+		close(fd);
+		return (NULL);
+	}
+
+	p = mmap(NULL, SHMCACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return (NULL);
+	hdr = p;
+
+	if (!shmcache_header_ok(hdr, NSS_UBDNS_SHMCACHE_MAGIC)) {
+		/* a reader holding an old mapping would reject the old magic */
+		memset(hdr, 0, SHMCACHE_SIZE);
+		hdr->version = NSS_UBDNS_SHMCACHE_VERSION;
+		hdr->n_slots = NSS_UBDNS_SHMCACHE_SLOTS;
+		hdr->slot_size = sizeof(struct nss_ubdns_shmcache_slot);
+		__atomic_store_n(&hdr->magic, NSS_UBDNS_SHMCACHE_MAGIC, __ATOMIC_RELEASE);
+	} else {
+		/* finish off any slot left half-written by a previous writer */
+		for (i = 0; i < hdr->n_slots; i++) {
+			struct nss_ubdns_shmcache_slot *slot = shmcache_slot(hdr, i);
+			if ((slot->seq & 1) != 0) {
+				slot->hash = 0;
+				__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+			}
+		}
+		nss_ubdns_shmcache_flush(hdr);
+	}
+
+	__atomic_store_n(&hdr->valid, 1, __ATOMIC_RELEASE);
+	return (hdr);
+}
+
+void
+nss_ubdns_shmcache_store(struct nss_ubdns_shmcache_header *hdr, const char *key,
+			 int rrtype, const struct ub_result *res)
+{
+	struct nss_ubdns_shmcache_slot *slot, *victim = NULL;
+	uint8_t rdata[sizeof(slot->rdata)];
+	char names[NSS_UBDNS_NAMES_MAX];
+	size_t key_len, rdata_len, names_len;
+	unsigned n_data = 0, n_names;
+	uint32_t hash, seq;
+	int64_t now;
+	unsigned i;
+
+	/* never share an answer that failed validation, or a server failure */
+	if (res->bogus || (res->rcode != 0 && !res->nxdomain) || res->ttl <= 0)
+		return;
+
+	key_len = strlen(key);
+	if (key_len == 0 || key_len >= sizeof(slot->qname))
+		return;
+
+	rdata_len = nss_ubdns_result_rdata(res, rdata, sizeof(rdata), &n_data);
+	if (rdata_len == 0 && res->havedata)
+		return;
+
+	names_len = nss_ubdns_result_names(res, names, sizeof(names), &n_names);
+	if (names_len > sizeof(rdata) - rdata_len)
+		return;
+	memcpy(rdata + rdata_len, names, names_len);
+
+	hash = nss_ubdns_qname_hash(key, rrtype);
+	now = nss_ubdns_now();
+
+	/* replace the same key, else a stale slot, else the soonest to expire */
+	for (i = 0; i < NSS_UBDNS_SHMCACHE_WAYS; i++) {
+		slot = shmcache_slot(hdr, hash + i);
+		if (slot->hash == hash && slot->rrtype == rrtype &&
+		    slot->qname_len == key_len && memcmp(slot->qname, key, key_len) == 0)
+		{
+			victim = slot;
+			break;
+		}
+		if (victim == NULL || shmcache_expire(hdr, slot) < shmcache_expire(hdr, victim))
+			victim = slot;
+	}
+	slot = victim;
+
+	seq = slot->seq;
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+	slot->expire = now + res->ttl;
+	slot->generation = hdr->generation;
+	slot->rrtype = rrtype;
+	slot->rdata_len = rdata_len;
+	slot->n_data = n_data;
+	slot->names_len = names_len;
+	slot->flags = (res->secure ? NSS_UBDNS_SHMCACHE_SECURE : 0) |
+		(res->havedata ? NSS_UBDNS_SHMCACHE_HAVEDATA : 0) |
+		(res->nxdomain ? NSS_UBDNS_SHMCACHE_NXDOMAIN : 0);
+	slot->qname_len = key_len;
+	memcpy(slot->qname, key, key_len + 1);
+	memcpy(slot->rdata, rdata, rdata_len + names_len);
+
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Invalidate every slot, e.g. after the writer's configuration has changed. */
+void
+nss_ubdns_shmcache_flush(struct nss_ubdns_shmcache_header *hdr) {
+	__atomic_add_fetch(&hdr->generation, 1, __ATOMIC_RELEASE);
+}
+
+void
+nss_ubdns_shmcache_close(struct nss_ubdns_shmcache_header *hdr) {
+	__atomic_store_n(&hdr->valid, 0, __ATOMIC_RELEASE);
+	munmap(hdr, SHMCACHE_SIZE);
+}
+
+/*
+ * Write the answers in the cache that are still current to a snapshot, see
+ * nss-ubdns.h, taken under the configuration with signature sig. The file
+ * is written next to path and renamed over it, and is sparse where slots
+ * are empty. The cache may be written meanwhile: slots are read as
+ * shmcache_find() reads them, and one caught being rewritten is left out.
+ */
+bool
+nss_ubdns_shmcache_snapshot(struct nss_ubdns_shmcache_header *hdr, const char *path, uint64_t sig) {
+	struct nss_ubdns_shmcache_header snap;
+	struct nss_ubdns_shmcache_slot *slot, copy;
+	char tmp[PATH_MAX];
+	int64_t now, real;
+	uint32_t generation, i, seq;
+	bool ok;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		return (false);
+	ok = (fchmod(fd, 0644) == 0 && ftruncate(fd, SHMCACHE_SIZE) == 0);
+
+	/* answers stored under a later configuration than sig's are left out */
+	generation = __atomic_load_n(&hdr->generation, __ATOMIC_ACQUIRE);
+	now = nss_ubdns_now();
+	real = time(NULL);
+	for (i = 0; ok && i < hdr->n_slots; i++) {
+		slot = shmcache_slot(hdr, i);
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) != 0)
+			continue;
+		memcpy(&copy, slot, sizeof(copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq ||
+		    copy.generation != generation || copy.expire <= now)
+			continue;
+
+		copy.seq = 0;
+		copy.generation = 0;
+		copy.expire = real + (copy.expire - now);
+		ok = (pwrite(fd, &copy, sizeof(copy), sizeof(snap) + (off_t) i * sizeof(copy)) ==
+		      sizeof(copy));
+	}
+
+	memset(&snap, 0, sizeof(snap));
+	snap.magic = NSS_UBDNS_SNAPSHOT_MAGIC;
+	snap.version = NSS_UBDNS_SHMCACHE_VERSION;
+	snap.n_slots = hdr->n_slots;
+	snap.slot_size = sizeof(struct nss_ubdns_shmcache_slot);
+	snap.valid = 1;
+	snap.config_sig = sig;
+	ok = ok && pwrite(fd, &snap, sizeof(snap), 0) == sizeof(snap) && fsync(fd) == 0;
+	if (close(fd) != 0)
+		ok = false;
+
+	if (ok && rename(tmp, path) == 0)
+		return (true);
+	unlink(tmp);
+	return (false);
+}
+
+/*
+ * Load the answers of a snapshot that are still current into the cache, if
+ * it was taken under the configuration with signature sig. Returns how many
+ * were loaded.
+ */
+unsigned
+nss_ubdns_shmcache_restore(struct nss_ubdns_shmcache_header *hdr, const char *path, uint64_t sig) {
+	const struct nss_ubdns_shmcache_header *snap;
+	const struct nss_ubdns_shmcache_slot *src;
+	struct nss_ubdns_shmcache_slot *slot, copy;
+	int64_t now, real;
+	struct stat sb;
+	unsigned n = 0;
+	uint32_t i, seq;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return (0);
+	if (fstat(fd, &sb) != 0 || sb.st_uid != geteuid() || (size_t) sb.st_size != SHMCACHE_SIZE) {
+		close(fd);
+		return (0);
+	}
+	p = mmap(NULL, SHMCACHE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return (0);
+	snap = p;
+	if (!shmcache_header_ok(snap, NSS_UBDNS_SNAPSHOT_MAGIC) || snap->config_sig != sig) {
+		munmap(p, SHMCACHE_SIZE);
+		return (0);
+	}
+
+	now = nss_ubdns_now();
+	real = time(NULL);
+	for (i = 0; i < snap->n_slots; i++) {
+		src = (const struct nss_ubdns_shmcache_slot *) (snap + 1) + i;
+		if (src->qname_len == 0 || src->expire <= real ||
+		    src->qname_len >= sizeof(src->qname) || src->qname[src->qname_len] != '\0')
+			continue;
+
+		slot = shmcache_slot(hdr, i);
+		seq = slot->seq;
+		__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		memcpy(&copy, src, sizeof(copy));
+		copy.seq = seq + 1;
+		copy.generation = hdr->generation;
+		copy.expire = now + (src->expire - real);
+		memcpy(slot, &copy, sizeof(copy));
+
+		__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+		n++;
+	}
+
+	munmap(p, SHMCACHE_SIZE);
+	return (n);
+}
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nss-ubdns.h"
+
+#define STATS_SIZE	(sizeof(struct nss_ubdns_stats_header) + \
+			 NSS_UBDNS_STATS_SLOTS * sizeof(struct nss_ubdns_stats))
+
+__thread struct nss_ubdns_stats *nss_ubdns_stats_self = NULL;
+__thread bool nss_ubdns_stats_shared = false;
+
+/*
+ * The process's segment, created the first time one of its threads counts
+ * something. If it can't be created, counts go to a slot nobody reads.
+ */
+static struct nss_ubdns_stats_header *stats_hdr = NULL;
+static char stats_path[64];
+static struct nss_ubdns_stats stats_void;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+static struct nss_ubdns_stats *
+stats_slots(struct nss_ubdns_stats_header *hdr) {
+	return ((struct nss_ubdns_stats *) (hdr + 1));
+}
+
+/* A thread exits: its slot, counts and all, is free for the next one. */
+static void
+stats_release(void *arg) {
+	struct nss_ubdns_stats *s = arg;
+
+	__atomic_store_n(&s->owner, 0, __ATOMIC_RELEASE);
+}
+
+static void
+stats_init(void) {
+	pthread_key_create(&stats_key, stats_release);
+}
+
+static struct nss_ubdns_stats_header *
+stats_create(void) {
+	struct nss_ubdns_stats_header *hdr;
+	void *p;
+	int fd;
+
+	snprintf(stats_path, sizeof(stats_path), "%s/%s%d",
+		 NSS_UBDNS_STATS_DIR, NSS_UBDNS_STATS_PREFIX, (int) getpid());
+
+	/* a file left by an earlier process with this pid; never follow a link */
+	unlink(stats_path);
+	fd = open(stats_path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return (NULL);
+	if (ftruncate(fd, STATS_SIZE) != 0) {
+		close(fd);
+		unlink(stats_path);
+		return (NULL);
+	}
+	p = mmap(NULL, STATS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		unlink(stats_path);
+		return (NULL);
+	}
+
+	hdr = p;
+	hdr->version = NSS_UBDNS_STATS_VERSION;
+	hdr->n_slots = NSS_UBDNS_STATS_SLOTS;
+	hdr->slot_size = sizeof(struct nss_ubdns_stats);
+	hdr->pid = getpid();
+	__atomic_store_n(&hdr->magic, NSS_UBDNS_STATS_MAGIC, __ATOMIC_RELEASE);
+	return (hdr);
+}
+
+/* Slow path of nss_ubdns_stats(): find the calling thread a slot. */
+struct nss_ubdns_stats *
+nss_ubdns_stats_slot(void) {
+	struct nss_ubdns_stats *slots, *s = &stats_void;
+	bool shared = true;
+	uint32_t tid;
+	unsigned i;
+
+	pthread_once(&stats_once, stats_init);
+
+	pthread_mutex_lock(&stats_lock);
+	if (stats_hdr == NULL)
+		stats_hdr = stats_create();
+	if (stats_hdr != NULL) {
+		slots = stats_slots(stats_hdr);
+		tid = syscall(SYS_gettid);
+		s = &slots[NSS_UBDNS_STATS_SLOTS - 1];
+		for (i = 0; i < NSS_UBDNS_STATS_SLOTS - 1; i++) {
+			if (slots[i].owner == 0) {
+				s = &slots[i];
+				__atomic_store_n(&s->owner, tid, __ATOMIC_RELAXED);
+				pthread_setspecific(stats_key, s);
+				shared = false;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	nss_ubdns_stats_shared = shared;
+	nss_ubdns_stats_self = s;
+	return (s);
+}
+
+/* Count a lookup that started at start, in CLOCK_MONOTONIC nanoseconds. */
+void
+nss_ubdns_stats_latency(struct nss_ubdns_stats *s, int64_t start) {
+	uint64_t us;
+	unsigned b = 0;
+
+	us = (nss_ubdns_now_ns() - start) / 1000;
+	if (us > 0)
+		b = 64 - __builtin_clzll(us);
+	if (b >= NSS_UBDNS_STATS_BUCKETS)
+		b = NSS_UBDNS_STATS_BUCKETS - 1;
+	nss_ubdns_stat_add(&s->latency[b], 1);
+}
+
+/*
+ * Called around fork(), see nss_ubdns_cache_fork(). The child gets a segment
+ * of its own when it first counts something, rather than counting into its
+ * parent's.
+ */
+void
+nss_ubdns_stats_fork(int phase) {
+	if (phase == NSS_UBDNS_FORK_PREPARE) {
+		pthread_mutex_lock(&stats_lock);
+		return;
+	}
+	if (phase == NSS_UBDNS_FORK_CHILD) {
+		if (stats_hdr != NULL) {
+			munmap(stats_hdr, STATS_SIZE);
+			stats_hdr = NULL;
+			pthread_setspecific(stats_key, NULL);
+		}
+		nss_ubdns_stats_self = NULL;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void __attribute__((destructor))
+stats_finish(void) {
+	if (stats_hdr != NULL && stats_hdr->pid == getpid())
+		unlink(stats_path);
+}
@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * ubdns-bulk - look up the names and addresses read from stdin
+ *
+ * Each line of input is a name, whose addresses are looked up, or an IPv4 or
+ * IPv6 address, whose names are. Each result is written as soon as it is in,
+ * so the output is not in the order of the input: the query, a tab, then the
+ * addresses or names separated by spaces, or "!" and the NSS status if there
+ * are none. The lines read so far are passed to ubdns_resolve_batch(), with
+ * up to WINDOW lookups in progress at once, whenever the input pauses or
+ * CHUNK of them have been read.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ubdns.h"
+
+struct chunk {
+	char **lines;
+	struct ubdns_query *queries;
+	unsigned char (*addrs)[16];
+	unsigned n, size;
+};
+
+static const char *
+status_name(enum nss_status status) {
+	switch (status) {
+	case NSS_STATUS_TRYAGAIN:
+		return ("TRYAGAIN");
+	case NSS_STATUS_UNAVAIL:
+		return ("UNAVAIL");
+	case NSS_STATUS_NOTFOUND:
+		return ("NOTFOUND");
+	default:
+		return ("ERROR");
+	}
+}
+
+static void
+print_result(unsigned i, const struct ubdns_result *result, void *arg) {
+	const struct chunk *ch = arg;
+	const struct ubdns_query *q = &ch->queries[i];
+	const struct gaih_addrtuple *at;
+	char addr[INET6_ADDRSTRLEN], **p;
+	const char *sep = "";
+
+	fputs(ch->lines[i], stdout);
+	putchar('\t');
+	if (result->status != NSS_STATUS_SUCCESS) {
+		printf("!%s\n", status_name(result->status));
+		return;
+	}
+
+	if (q->type == UBDNS_REVERSE) {
+		fputs(result->host->h_name, stdout);
+		for (p = result->host->h_aliases; *p != NULL; p++)
+			printf(" %s", *p);
+	} else if (result->pat != NULL) {
+		for (at = result->pat; at != NULL; at = at->next) {
+			inet_ntop(at->family, at->addr, addr, sizeof(addr));
+			printf("%s%s", sep, addr);
+			sep = " ";
+		}
+	} else {
+		for (p = result->host->h_addr_list; *p != NULL; p++) {
+			inet_ntop(result->host->h_addrtype, *p, addr, sizeof(addr));
+			printf("%s%s", sep, addr);
+			sep = " ";
+		}
+	}
+	putchar('\n');
+}
+
+static void
+chunk_add(struct chunk *ch, const char *text, int af) {
+	struct ubdns_query *q;
+	char *line;
+
+	if (ch->n == ch->size) {
+		ch->size = ch->size == 0 ? 1024 : ch->size * 2;
+		ch->lines = realloc(ch->lines, ch->size * sizeof(*ch->lines));
+		ch->queries = realloc(ch->queries, ch->size * sizeof(*ch->queries));
+		ch->addrs = realloc(ch->addrs, ch->size * sizeof(*ch->addrs));
+		if (ch->lines == NULL || ch->queries == NULL || ch->addrs == NULL) {
+			fprintf(stderr, "ubdns-bulk: %s\n", strerror(ENOMEM));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	line = strdup(text);
+	if (line == NULL) {
+		fprintf(stderr, "ubdns-bulk: %s\n", strerror(ENOMEM));
+		exit(EXIT_FAILURE);
+	}
+	line[strcspn(line, "\r")] = '\0';
+
+	q = &ch->queries[ch->n];
+	memset(q, 0, sizeof(*q));
+	if (inet_pton(AF_INET, line, ch->addrs[ch->n]) == 1) {
+		q->type = UBDNS_REVERSE;
+		q->af = AF_INET;
+		q->addr = ch->addrs[ch->n];
+	} else if (inet_pton(AF_INET6, line, ch->addrs[ch->n]) == 1) {
+		q->type = UBDNS_REVERSE;
+		q->af = AF_INET6;
+		q->addr = ch->addrs[ch->n];
+	} else {
+		q->type = UBDNS_FORWARD;
+		q->af = af;
+		q->name = line;
+	}
+	ch->lines[ch->n++] = line;
+}
+
+static void
+chunk_run(struct chunk *ch, unsigned window) {
+	unsigned i;
+
+	if (ubdns_resolve_batch(ch->queries, ch->n, window, print_result, ch) != 0) {
+		fprintf(stderr, "ubdns-bulk: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fflush(stdout);
+	for (i = 0; i < ch->n; i++)
+		free(ch->lines[i]);
+	ch->n = 0;
+}
+
+static bool
+input_pending(void) {
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+
+	return (poll(&pfd, 1, 0) > 0);
+}
+
+static void
+usage(void) {
+	fprintf(stderr, "Usage: ubdns-bulk [-4 | -6] [-w WINDOW] [-c CHUNK]\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv) {
+	static char buf[65536];
+	struct chunk ch = { 0 };
+	unsigned window = UBDNS_BATCH_WINDOW, chunk = 0;
+	size_t len = 0, off;
+	char *end, *nl;
+	int af = AF_UNSPEC;
+	ssize_t n;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "46c:w:")) != -1) {
+		switch (opt) {
+		case '4':
+			af = AF_INET;
+			break;
+		case '6':
+			af = AF_INET6;
+			break;
+		case 'c':
+			chunk = strtoul(optarg, &end, 10);
+			if (*end != '\0' || chunk == 0)
+				usage();
+			break;
+		case 'w':
+			window = strtoul(optarg, &end, 10);
+			if (*end != '\0' || window == 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	/* the window drains at the end of each batch, so make that rare */
+	if (chunk == 0)
+		chunk = window < 1024 ? 65536 : 64 * window;
+
+	for (;;) {
+		if (ch.n > 0 && !input_pending())
+			chunk_run(&ch, window);
+
+		n = read(STDIN_FILENO, buf + len, sizeof(buf) - 1 - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			fprintf(stderr, "ubdns-bulk: %s\n", strerror(errno));
+			return (EXIT_FAILURE);
+		}
+		if (n == 0)
+			break;
+		len += n;
+
+		for (off = 0; (nl = memchr(buf + off, '\n', len - off)) != NULL;
+		     off = nl + 1 - buf)
+		{
+			*nl = '\0';
+			if (buf[off] != '\0' && buf[off] != '\r')
+				chunk_add(&ch, buf + off, af);
+			if (ch.n == chunk)
+				chunk_run(&ch, window);
+		}
+		len -= off;
+		memmove(buf, buf + off, len);
+		if (len == sizeof(buf) - 1) {
+			fprintf(stderr, "ubdns-bulk: line too long\n");
+			return (EXIT_FAILURE);
+		}
+	}
+
+	/* a last line without a newline */
+	if (len > 0) {
+		buf[len] = '\0';
+		chunk_add(&ch, buf, af);
+	}
+	if (ch.n > 0)
+		chunk_run(&ch, window);
+
+	free(ch.lines);
+	free(ch.queries);
+	free(ch.addrs);
+	return (EXIT_SUCCESS);
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2011 Robert S. Edmonds
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * ubdns.h - interface of the nss-ubdns module for programs with many names or
+ * addresses to look up
+ *
+ * Besides its NSS entry points, libnss_ubdns.so.2 exports functions that look
+ * up many names and addresses concurrently from a single thread, either as a
+ * batch or from an event loop, with the same caches, hosts.db overrides and
+ * DNSSEC validation as lookups made through the name service switch.
+ * Programs link with -l:libnss_ubdns.so.2.
+ */
+
+#ifndef UBDNS_H
+#define UBDNS_H
+
+#include <netdb.h>
+#include <nss.h>
+#include <stdint.h>
+
+#define UBDNS_FORWARD		0	/* the addresses of a name */
+#define UBDNS_REVERSE		1	/* the names of an address */
+
+#define UBDNS_BATCH_WINDOW	256	/* default number of lookups in progress */
+
+struct ubdns_query {
+	int type;		/* UBDNS_FORWARD or UBDNS_REVERSE */
+	int af;			/* AF_INET or AF_INET6, or AF_UNSPEC for both addresses */
+	const char *name;	/* forward: the name, looked up as given */
+	const void *addr;	/* reverse: the address, 4 or 16 bytes as af says */
+};
+
+/*
+ * The result of a lookup, as the NSS entry points return it: in *pat as
+ * gethostbyname4_r() does for forward lookups of AF_UNSPEC, and in *host as
+ * gethostbyname3_r() and gethostbyaddr2_r() do for the others. errnop and
+ * h_errnop are set unless status is NSS_STATUS_SUCCESS; NSS_STATUS_TRYAGAIN
+ * with EAGAIN means the lookup's deadline passed.
+ */
+struct ubdns_result {
+	enum nss_status status;
+	int errnop;
+	int h_errnop;
+	int32_t ttl;
+	struct gaih_addrtuple *pat;
+	struct hostent *host;
+};
+
+/* Called with the index of a query and its result, which is only valid until it returns. */
+typedef void (*ubdns_batch_cb)(unsigned i, const struct ubdns_result *result, void *arg);
+
+/*
+ * Look up queries[0] to queries[n_queries - 1] with up to window of them in
+ * progress at once, or UBDNS_BATCH_WINDOW if window is 0, and call cb with
+ * each result as it comes in. Returns 0 once every query has had its
+ * result, or -1 with errno set if the lookups could not be started.
+ */
+int ubdns_resolve_batch(const struct ubdns_query *queries, unsigned n_queries, unsigned window,
+			ubdns_batch_cb cb, void *arg);
+
+/*
+ * An asynchronous resolver for event loops. Lookups are submitted with
+ * ubdns_submit(), and their callbacks are called from ubdns_process(), never
+ * from ubdns_submit(). Call ubdns_process() whenever ubdns_fd() is readable,
+ * and once ubdns_timeout() milliseconds have passed so that lookups past
+ * their deadline fail. A struct ubdns may only be used by one thread at a
+ * time, and not in the child of a fork.
+ */
+struct ubdns;
+struct ubdns_lookup;
+
+/* Called with a lookup's result, which is only valid until it returns. */
+typedef void (*ubdns_cb)(void *arg, const struct ubdns_result *result);
+
+/* Returns NULL with errno set on failure. */
+struct ubdns *ubdns_new(void);
+
+/* Cancels the unfinished lookups, without calling their callbacks. Not from a callback. */
+void ubdns_free(struct ubdns *u);
+
+/* A file descriptor that is readable when ubdns_process() has work to do. */
+int ubdns_fd(const struct ubdns *u);
+
+/* Milliseconds until the next lookup's deadline, or -1 if there is none. */
+int ubdns_timeout(const struct ubdns *u);
+
+/*
+ * Start looking up a query, whose name or address is copied. Returns a
+ * handle for ubdns_cancel(), valid until cb is called, or NULL with errno
+ * set if the query is bad or there is no memory.
+ */
+struct ubdns_lookup *ubdns_submit(struct ubdns *u, const struct ubdns_query *q,
+				  ubdns_cb cb, void *arg);
+
+/* Give up on a lookup whose callback has not been called. It never will be. */
+void ubdns_cancel(struct ubdns *u, struct ubdns_lookup *lookup);
+
+/*
+ * Call the callbacks of the lookups that are complete, without waiting.
+ * Callbacks may submit and cancel lookups. Returns the number called.
+ */
+int ubdns_process(struct ubdns *u);
+
+#endif /* UBDNS_H */